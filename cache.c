@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200112L
+#include "cache.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Buffer cache: a fixed arena of block buffers indexed by a hash table,
+// recycled in LRU order. Writes are deferred (write-back) until
+// bcache_flush(), which disk_barrier()/disk_sync()/disk_close() call.
+
+typedef struct bcache_buf {
+    uint32_t block_num;
+    int valid;                // Buffer holds block_num
+    int dirty;                // Buffer differs from disk
+    int refcount;             // Pinned by bcache_get()
+    struct bcache_buf *hash_next;
+    struct bcache_buf *lru_prev;
+    struct bcache_buf *lru_next;
+} bcache_buf_t;
+
+static uint32_t capacity = BCACHE_DEFAULT_BLOCKS;
+static uint32_t num_bufs = 0;
+static uint32_t hash_size = 0;
+static bcache_buf_t *bufs = NULL;
+static bcache_buf_t **hash = NULL;
+static uint8_t *arena = NULL;
+
+// LRU list: head is most recently used, tail is the next victim
+static bcache_buf_t *lru_head = NULL;
+static bcache_buf_t *lru_tail = NULL;
+
+static bcache_stats_t stats;
+
+void bcache_set_capacity(uint32_t blocks) {
+    capacity = blocks;
+}
+
+uint32_t bcache_capacity(void) {
+    return capacity;
+}
+
+static uint8_t *buf_data(bcache_buf_t *b) {
+    return arena + (size_t)(b - bufs) * BLOCK_SIZE;
+}
+
+static bcache_buf_t *data_buf(void *data) {
+    return &bufs[((uint8_t *)data - arena) / BLOCK_SIZE];
+}
+
+static uint32_t hash_index(uint32_t block_num) {
+    return (block_num * 2654435761u) & (hash_size - 1);
+}
+
+static void lru_unlink(bcache_buf_t *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_front(bcache_buf_t *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static void hash_remove(bcache_buf_t *b) {
+    bcache_buf_t **pp = &hash[hash_index(b->block_num)];
+    while (*pp && *pp != b) pp = &(*pp)->hash_next;
+    if (*pp) *pp = b->hash_next;
+    b->hash_next = NULL;
+}
+
+int bcache_init(void) {
+    bcache_destroy();
+    memset(&stats, 0, sizeof(stats));
+    if (capacity == 0) return 0;
+
+    // Buffers are block aligned so they can be handed to an O_DIRECT disk
+    if (posix_memalign((void **)&arena, BLOCK_SIZE, (size_t)capacity * BLOCK_SIZE) != 0) {
+        arena = NULL;
+        fprintf(stderr, "Error: Failed to allocate %u-block buffer cache\n", capacity);
+        return -1;
+    }
+
+    hash_size = 1;
+    while (hash_size < capacity * 2) hash_size <<= 1;
+
+    bufs = calloc(capacity, sizeof(bcache_buf_t));
+    hash = calloc(hash_size, sizeof(bcache_buf_t *));
+    if (!bufs || !hash) {
+        fprintf(stderr, "Error: Failed to allocate buffer cache index\n");
+        bcache_destroy();
+        return -1;
+    }
+
+    num_bufs = capacity;
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        lru_push_front(&bufs[i]);
+    }
+    return 0;
+}
+
+void bcache_destroy(void) {
+    free(arena);
+    free(bufs);
+    free(hash);
+    arena = NULL;
+    bufs = NULL;
+    hash = NULL;
+    num_bufs = 0;
+    hash_size = 0;
+    lru_head = lru_tail = NULL;
+}
+
+int bcache_enabled(void) {
+    return num_bufs > 0;
+}
+
+static bcache_buf_t *lookup(uint32_t block_num) {
+    for (bcache_buf_t *b = hash[hash_index(block_num)]; b; b = b->hash_next) {
+        if (b->block_num == block_num) return b;
+    }
+    return NULL;
+}
+
+// Find a victim: the least recently used unpinned buffer
+static bcache_buf_t *evict(void) {
+    bcache_buf_t *b = lru_tail;
+    while (b && b->refcount > 0) b = b->lru_prev;
+    if (!b) return NULL;
+
+    if (b->valid) {
+        if (b->dirty) {
+            const void *data = buf_data(b);
+            if (disk_raw_writev(b->block_num, &data, 1) != 0) return NULL;
+            b->dirty = 0;
+            stats.writebacks++;
+        }
+        hash_remove(b);
+        b->valid = 0;
+        stats.evictions++;
+    }
+    return b;
+}
+
+static void *get(uint32_t block_num, int read) {
+    if (!bcache_enabled()) return NULL;
+
+    bcache_buf_t *b = lookup(block_num);
+    if (b) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        b = evict();
+        if (!b) return NULL;
+
+        if (read && disk_raw_read(block_num, buf_data(b)) != 0) return NULL;
+        b->block_num = block_num;
+        b->valid = 1;
+        b->hash_next = hash[hash_index(block_num)];
+        hash[hash_index(block_num)] = b;
+    }
+
+    b->refcount++;
+    lru_unlink(b);
+    lru_push_front(b);
+    return buf_data(b);
+}
+
+void *bcache_get(uint32_t block_num) {
+    return get(block_num, 1);
+}
+
+void *bcache_get_new(uint32_t block_num) {
+    return get(block_num, 0);
+}
+
+void bcache_put(void *data) {
+    bcache_buf_t *b = data_buf(data);
+    if (b->refcount > 0) b->refcount--;
+}
+
+void bcache_mark_dirty(void *data) {
+    data_buf(data)->dirty = 1;
+}
+
+void bcache_forget(uint32_t start, uint32_t count) {
+    if (!bcache_enabled()) return;
+
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t *b = lookup(start + i);
+        if (!b || b->refcount > 0) continue;
+        hash_remove(b);
+        b->valid = 0;
+        b->dirty = 0;
+    }
+}
+
+static int compare_block_num(const void *a, const void *b) {
+    uint32_t x = (*(bcache_buf_t *const *)a)->block_num;
+    uint32_t y = (*(bcache_buf_t *const *)b)->block_num;
+    return (x > y) - (x < y);
+}
+
+int bcache_flush(void) {
+    if (!bcache_enabled()) return 0;
+
+    bcache_buf_t **dirty = malloc(num_bufs * sizeof(bcache_buf_t *));
+    const void **run = malloc(num_bufs * sizeof(void *));
+    if (!dirty || !run) {
+        free(dirty);
+        free(run);
+        fprintf(stderr, "Error: Out of memory flushing buffer cache\n");
+        return -1;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        if (bufs[i].valid && bufs[i].dirty) dirty[n++] = &bufs[i];
+    }
+    qsort(dirty, n, sizeof(bcache_buf_t *), compare_block_num);
+
+    // Write back contiguous runs of dirty blocks with one vectored write each
+    int ret = 0;
+    for (uint32_t i = 0; i < n && ret == 0; ) {
+        uint32_t len = 0;
+        do {
+            run[len] = buf_data(dirty[i + len]);
+            len++;
+        } while (i + len < n && dirty[i + len]->block_num == dirty[i]->block_num + len);
+
+        if (disk_raw_writev(dirty[i]->block_num, run, len) != 0) {
+            ret = -1;
+            break;
+        }
+        for (uint32_t j = 0; j < len; j++) dirty[i + j]->dirty = 0;
+        stats.writebacks += len;
+        i += len;
+    }
+
+    free(dirty);
+    free(run);
+    return ret;
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+    *out = stats;
+}
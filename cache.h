@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "vsfs.h"
+
+// Default buffer cache capacity (blocks)
+#define BCACHE_DEFAULT_BLOCKS 64
+
+// Buffer cache statistics
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;      // Dirty blocks written to disk
+} bcache_stats_t;
+
+// Set the capacity used by the next bcache_init() (0 disables the cache)
+void bcache_set_capacity(uint32_t blocks);
+uint32_t bcache_capacity(void);
+
+// Set up / tear down the cache (called by disk_open() / disk_close())
+int bcache_init(void);
+void bcache_destroy(void);
+int bcache_enabled(void);
+
+// Pin a block in the cache. bcache_get() reads it from disk on a miss;
+// bcache_get_new() is for callers that will overwrite the whole block.
+// Returns NULL when every buffer is pinned.
+void *bcache_get(uint32_t block_num);
+void *bcache_get_new(uint32_t block_num);
+
+// Release a pinned block
+void bcache_put(void *data);
+
+// Mark a pinned block as modified; it is written back on flush or eviction
+void bcache_mark_dirty(void *data);
+
+// Drop any cached copies of blocks [start, start + count) that are about to
+// be written around the cache; pinned buffers are left alone
+void bcache_forget(uint32_t start, uint32_t count);
+
+// Write every dirty block back to disk in ascending block order
+int bcache_flush(void);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif // CACHE_H
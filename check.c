@@ -0,0 +1,391 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "disk.h"
+#include "journal.h"
+#include "dir.h"
+#include "extent.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Inodes or directory leaves handed to a check worker at a time
+#define CHECK_INODE_CHUNK 4096
+#define CHECK_LEAF_CHUNK 64
+#define CHECK_MAX_THREADS 64
+
+// State shared by the check passes. Workers update refs, claimed and
+// errors atomically.
+typedef struct {
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    const void *inode_table;
+    uint32_t *refs;               // Directory entries naming each inode
+    uint64_t *claimed;            // Shadow data bitmap: blocks some inode uses
+    uint32_t *leaves;             // Root directory leaf blocks
+    uint32_t num_leaves;
+    uint32_t leaf_capacity;
+    int threads;
+    int errors;
+} check_state_t;
+
+// Where check_fs() prints its findings (NULL: nowhere)
+static FILE *report_out = NULL;
+
+static void report(const char *format, ...) {
+    if (!report_out) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(report_out, format, args);
+    va_end(args);
+}
+
+static void check_error(check_state_t *state) {
+    __atomic_fetch_add(&state->errors, 1, __ATOMIC_RELAXED);
+}
+
+static void owner_name(uint32_t inum, char *name, size_t size) {
+    if (inum == 0) {
+        snprintf(name, size, "Root directory");
+    } else {
+        snprintf(name, size, "Inode %u", inum);
+    }
+}
+
+// Claim data blocks [bit, bit + length) for one inode in the shadow bitmap.
+// Returns the first block another inode claimed already, or -1.
+static int64_t claim_run(check_state_t *state, uint32_t bit, uint32_t length) {
+    uint64_t end = (uint64_t)bit + length;
+    int64_t first_dup = -1;
+    
+    for (uint64_t i = bit; i < end; i = (i | 63) + 1) {
+        uint64_t mask = ~0ULL << (i % 64);
+        if (end - (i - i % 64) < 64) mask &= (1ULL << (end - (i - i % 64))) - 1;
+        uint64_t old = __atomic_fetch_or(&state->claimed[i / 64], mask, __ATOMIC_RELAXED);
+        if ((old & mask) && first_dup < 0) {
+            first_dup = (int64_t)(i - i % 64) + __builtin_ctzll(old & mask);
+        }
+    }
+    return first_dup;
+}
+
+// A run of data blocks must lie in the data region, be marked in the data
+// bitmap throughout, and belong to no other inode
+static void check_run(check_state_t *state, uint32_t inum, uint32_t start, uint32_t length) {
+    char owner[32];
+    
+    if (length == 0 || start < disk_sb.data_blocks_start ||
+        (uint64_t)start + length > disk_sb.num_blocks) {
+        owner_name(inum, owner, sizeof(owner));
+        report("ERROR: %s has invalid extent %u+%u\n", owner, start, length);
+        check_error(state);
+        return;
+    }
+    
+    uint32_t bit = start - disk_sb.data_blocks_start;
+    int64_t unmarked = bitmap_first_clear(state->data_bitmap, bit, length);
+    if (unmarked >= 0) {
+        owner_name(inum, owner, sizeof(owner));
+        report("ERROR: %s block %llu not marked in bitmap\n", owner,
+               (unsigned long long)(disk_sb.data_blocks_start + unmarked));
+        check_error(state);
+    }
+    int64_t dup = claim_run(state, bit, length);
+    if (dup >= 0) {
+        owner_name(inum, owner, sizeof(owner));
+        report("ERROR: %s block %llu is also used by another inode\n", owner,
+               (unsigned long long)(disk_sb.data_blocks_start + dup));
+        check_error(state);
+    }
+}
+
+// The inode whose block map is being walked
+typedef struct {
+    check_state_t *state;
+    uint32_t inum;
+} check_owner_t;
+
+static void check_owner_run(uint32_t start, uint32_t length, void *arg) {
+    check_owner_t *owner = arg;
+    check_run(owner->state, owner->inum, start, length);
+}
+
+static void check_owner_block(uint32_t block_num, void *arg) {
+    check_owner_run(block_num, 1, arg);
+}
+
+static void collect_leaf(uint32_t block_num, void *arg) {
+    check_owner_t *owner = arg;
+    check_state_t *state = owner->state;
+    
+    check_run(state, 0, block_num, 1);
+    if (state->num_leaves == state->leaf_capacity) {
+        uint32_t capacity = state->leaf_capacity ? state->leaf_capacity * 2 : 64;
+        uint32_t *grown = realloc(state->leaves, capacity * sizeof(uint32_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory checking file system\n");
+            check_error(state);
+            return;
+        }
+        state->leaves = grown;
+        state->leaf_capacity = capacity;
+    }
+    state->leaves[state->num_leaves++] = block_num;
+}
+
+// Pass 2: count the directory entries naming each inode
+static void check_entry(const dirent_t *entry, void *arg) {
+    check_state_t *state = arg;
+    uint32_t inum = entry->inum;
+    
+    // Check inode is in valid range
+    if (inum >= disk_sb.num_inodes) {
+        report("ERROR: File '%s' has invalid inode %u\n", entry->name, inum);
+        check_error(state);
+        return;
+    }
+    __atomic_fetch_add(&state->refs[inum], 1, __ATOMIC_RELAXED);
+    
+    // Check inode is marked allocated
+    if (!bitmap_get(state->inode_bitmap, inum)) {
+        report("ERROR: File '%s' inode %u not marked in bitmap (dangling pointer)\n", 
+               entry->name, inum);
+        check_error(state);
+    }
+}
+
+static void check_leaves(check_state_t *state, uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (dir_for_each_entry(state->leaves[i], check_entry, state) != 0) check_error(state);
+    }
+}
+
+// Pass 3: every inode once, against the reference counts
+static void check_inodes(check_state_t *state, uint32_t first, uint32_t count) {
+    for (uint32_t inum = first; inum < first + count; inum++) {
+        if (inum == 0) continue;  // Root, checked in pass 1
+        
+        uint32_t refs = state->refs[inum];
+        if (!bitmap_get(state->inode_bitmap, inum)) continue;  // Dangling: pass 2
+        if (refs == 0) {
+            report("ERROR: Inode %u is allocated but not referenced (leak)\n", inum);
+            check_error(state);
+        }
+        
+        const inode_t *inode = table_inode(state->inode_table, inum);
+        if (refs > 0 && inode->nlink != refs) {
+            report("ERROR: Inode %u has link count %u but %u directory entries\n",
+                   inum, inode->nlink, refs);
+            check_error(state);
+        }
+        
+        check_owner_t owner;
+        owner.state = state;
+        owner.inum = inum;
+        if (extent_for_each(inode, check_owner_block, check_owner_run, &owner) != 0) {
+            report("ERROR: Inode %u has a corrupt block map\n", inum);
+            check_error(state);
+        }
+    }
+}
+
+// Pass 4: blocks marked in the bitmap that no inode uses
+static void check_unclaimed(check_state_t *state) {
+    uint64_t nbits = disk_sb.data_blocks_count;
+    
+    for (uint64_t base = 0; base < nbits; base += 64) {
+        uint32_t bits = nbits - base < 64 ? (uint32_t)(nbits - base) : 64;
+        uint64_t marked = 0;
+        for (uint32_t byte = 0; byte < (bits + 7) / 8; byte++) {
+            marked |= (uint64_t)state->data_bitmap[base / 8 + byte] << (8 * byte);
+        }
+        if (bits < 64) marked &= (1ULL << bits) - 1;
+        
+        uint64_t leaked = marked & ~state->claimed[base / 64];
+        while (leaked) {
+            report("ERROR: Block %llu is marked in bitmap but not used (leak)\n",
+                   (unsigned long long)(disk_sb.data_blocks_start + base +
+                                        __builtin_ctzll(leaked)));
+            check_error(state);
+            leaked &= leaked - 1;
+        }
+    }
+}
+
+// A check pass split into chunks that worker threads take in turn
+typedef struct {
+    check_state_t *state;
+    void (*fn)(check_state_t *state, uint32_t first, uint32_t count);
+    uint32_t total;
+    uint32_t chunk;
+    uint32_t next;
+} check_job_t;
+
+static void *check_worker(void *arg) {
+    check_job_t *job = arg;
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if (first >= job->total) return NULL;
+        uint32_t count = job->total - first < job->chunk ? job->total - first : job->chunk;
+        job->fn(job->state, first, count);
+    }
+}
+
+// Run fn over [0, total) on up to state->threads threads, the calling
+// thread included
+static void run_pass(check_state_t *state, uint32_t total, uint32_t chunk,
+                     void (*fn)(check_state_t *state, uint32_t first, uint32_t count)) {
+    pthread_t threads[CHECK_MAX_THREADS];
+    int started = 0;
+    
+    check_job_t job;
+    job.state = state;
+    job.fn = fn;
+    job.total = total;
+    job.chunk = chunk;
+    job.next = 0;
+    
+    uint32_t chunks = (total + chunk - 1) / chunk;
+    int helpers = state->threads - 1;
+    if ((uint32_t)helpers > chunks) helpers = chunks > 0 ? (int)chunks - 1 : 0;
+    while (started < helpers && pthread_create(&threads[started], NULL, check_worker, &job) == 0) {
+        started++;
+    }
+    check_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+int check_pick_threads(int requested) {
+    // Workers read blocks in place; without a mapping every read goes
+    // through the buffer cache, which is not shared between threads
+    if (!disk_map_block(disk_sb.num_blocks - 1)) return 1;
+    
+    long threads = requested > 0 ? requested : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > CHECK_MAX_THREADS) threads = CHECK_MAX_THREADS;
+    return (int)threads;
+}
+
+// Check the tree against the bitmaps and inode table in linear passes: the
+// directory's blocks, its entries (counting references per inode), every
+// inode (against those counts, claiming its blocks in a shadow bitmap),
+// then the blocks no inode claimed. Returns the number of errors found, or
+// -1 if the walk could not be completed.
+static int check_tree(const uint8_t *inode_bitmap, const uint8_t *data_bitmap,
+                      const void *inode_table, int threads) {
+    const superblock_t *sb = &disk_sb;
+    const inode_t *root = table_inode(inode_table, 0);
+    
+    check_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.inode_bitmap = inode_bitmap;
+    state.data_bitmap = data_bitmap;
+    state.inode_table = inode_table;
+    state.threads = threads;
+    
+    // Check root directory
+    if (!bitmap_get(inode_bitmap, 0)) {
+        report("ERROR: Root inode not allocated in bitmap\n");
+        state.errors++;
+    }
+    
+    if (root->blocks[0] == 0) {
+        report("ERROR: Root directory has no data block\n");
+        return -1;
+    }
+    
+    state.refs = calloc(sb->num_inodes, sizeof(uint32_t));
+    state.claimed = calloc(((size_t)sb->data_blocks_count + 63) / 64, sizeof(uint64_t));
+    if (!state.refs || !state.claimed) {
+        fprintf(stderr, "Error: Out of memory checking file system\n");
+        free(state.refs);
+        free(state.claimed);
+        return -1;
+    }
+    
+    // Pass 1: every block the directory occupies
+    check_owner_t root_owner;
+    root_owner.state = &state;
+    root_owner.inum = 0;
+    int ret = dir_for_each_block(root, check_owner_block, collect_leaf, &root_owner);
+    
+    if (ret == 0) {
+        run_pass(&state, state.num_leaves, CHECK_LEAF_CHUNK, check_leaves);
+        run_pass(&state, sb->num_inodes, CHECK_INODE_CHUNK, check_inodes);
+        check_unclaimed(&state);
+        ret = state.errors;
+    }
+    
+    free(state.refs);
+    free(state.claimed);
+    free(state.leaves);
+    return ret;
+}
+
+// The superblock's free counts must match the bitmaps. They are derived
+// data, so a mismatch is repaired by recounting rather than reported, unless
+// transactions yet to be installed would overwrite the repair. Returns the
+// number of errors left.
+static int check_summaries(const uint8_t *inode_bitmap, const uint8_t *data_bitmap) {
+    uint8_t block[BLOCK_SIZE];
+    uint8_t rebuilt[BLOCK_SIZE];
+    
+    if (disk_read(SUPERBLOCK_BLOCK, block) != 0) {
+        fprintf(stderr, "Error: Failed to read superblock\n");
+        return 1;
+    }
+    memcpy(rebuilt, block, BLOCK_SIZE);
+    summary_rebuild(rebuilt, inode_bitmap, data_bitmap);
+    if (memcmp(block, rebuilt, BLOCK_SIZE) == 0) return 0;
+    
+    const superblock_t *sb = (const superblock_t *)block;
+    const superblock_t *counted = (const superblock_t *)rebuilt;
+    report("Free counts wrong (inodes %u, blocks %u; counted %u, %u)\n",
+           sb->free_inodes, sb->free_blocks, counted->free_inodes, counted->free_blocks);
+    
+    journal_info_t journal;
+    if (journal_get_info(&journal) != 0 || journal.live_transactions > 0) {
+        report("ERROR: Free counts not rebuilt while transactions are pending (run install)\n");
+        return 1;
+    }
+    if (disk_write(SUPERBLOCK_BLOCK, rebuilt) != 0 || disk_sync() != 0) {
+        fprintf(stderr, "Error: Failed to write superblock\n");
+        return 1;
+    }
+    report("  Rebuilt free counts from the bitmaps\n");
+    return 0;
+}
+
+int check_fs(const uint8_t *inode_bitmap, const uint8_t *data_bitmap, const void *inode_table,
+             int threads, FILE *out) {
+    struct timespec started, finished;
+    
+    const superblock_t *sb = &disk_sb;
+    threads = check_pick_threads(threads);
+    report_out = out;
+    
+    report("Checking file system consistency...\n");
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    
+    int errors = check_tree(inode_bitmap, data_bitmap, inode_table, threads);
+    if (errors >= 0) errors += check_summaries(inode_bitmap, data_bitmap);
+    
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (double)(finished.tv_sec - started.tv_sec) +
+                     (double)(finished.tv_nsec - started.tv_nsec) / 1e9;
+    if (errors >= 0) {
+        report("Checked %u inodes in %.3f s (%.0f inodes/s, %d thread%s)\n", sb->num_inodes,
+               seconds, seconds > 0 ? sb->num_inodes / seconds : 0.0, threads,
+               threads == 1 ? "" : "s");
+    }
+    
+    if (errors == 0) {
+        report("✓ File system is consistent\n");
+    } else if (errors > 0) {
+        report("✗ Found %d error(s)\n", errors);
+    }
+    return errors;
+}
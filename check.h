@@ -0,0 +1,20 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "vsfs.h"
+
+// Consistency check of the installed file system, over its bitmaps and
+// inode table as loaded by the caller. Prints what it finds to `out` (NULL:
+// nothing) and returns the number of errors, or -1 if the check could not
+// be completed. Free counts that disagree with the bitmaps are rebuilt. Up
+// to `threads` workers (0: one per CPU) share the work when the image is
+// mapped.
+int check_fs(const uint8_t *inode_bitmap, const uint8_t *data_bitmap, const void *inode_table,
+             int threads, FILE *out);
+
+// Workers check_fs() uses when asked for `requested`
+int check_pick_threads(int requested);
+
+#endif // CHECK_H
@@ -0,0 +1,64 @@
+#include "crc32c.h"
+#include <string.h>
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// Table-driven fallback, one byte at a time
+static uint32_t table[256];
+static int table_ready = 0;
+
+static void build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[i] = crc;
+    }
+    table_ready = 1;
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+    if (!table_ready) build_table();
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+// SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+int crc32c_hardware(void) {
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    return supported;
+}
+#else
+int crc32c_hardware(void) {
+    return 0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (crc32c_hardware()) return ~crc32c_sse42(crc, data, len);
+#endif
+    return ~crc32c_table(crc, data, len);
+}
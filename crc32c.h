@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C (Castagnoli), as used for journal transaction checksums.
+// Start with crc = 0; feed a buffer in pieces by passing the previous result.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Nonzero when the SSE4.2 crc32 instruction is used
+int crc32c_hardware(void);
+
+#endif // CRC32C_H
@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 200112L
+#include "dir.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// A dirent with its name hash, for sorting a leaf before splitting it
+typedef struct {
+    uint32_t hash;
+    dirent_t entry;
+} hashed_dirent_t;
+
+// Route from the index root to the entry for one leaf
+typedef struct {
+    dir_index_header_t *root;
+    dir_index_header_t *node;     // Index block holding the leaf's entry (the root at levels 0)
+    int root_pos;                 // Root entry leading to node (levels 1)
+    int pos;                      // Entry in node for the leaf
+} dir_path_t;
+
+// Directory locks, shared out by inode number
+#define DIR_LOCKS 64
+
+static pthread_mutex_t dir_locks[DIR_LOCKS];
+static pthread_once_t dir_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_dir_locks(void) {
+    for (int i = 0; i < DIR_LOCKS; i++) pthread_mutex_init(&dir_locks[i], NULL);
+}
+
+void dir_lock(uint32_t inum) {
+    pthread_once(&dir_locks_once, init_dir_locks);
+    pthread_mutex_lock(&dir_locks[inum % DIR_LOCKS]);
+}
+
+void dir_unlock(uint32_t inum) {
+    pthread_mutex_unlock(&dir_locks[inum % DIR_LOCKS]);
+}
+
+// FNV-1a
+uint32_t dir_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME - 1 && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int name_matches(const dirent_t *entry, const char *name) {
+    return entry->inum != 0 && strncmp(entry->name, name, MAX_FILENAME - 1) == 0;
+}
+
+static dir_index_entry_t *index_entries(dir_index_header_t *header) {
+    return (dir_index_entry_t *)(header + 1);
+}
+
+static int index_valid(const dir_index_header_t *header) {
+    return header->magic == DIR_INDEX_MAGIC && header->count > 0 &&
+           header->count <= DIR_INDEX_ENTRIES && header->levels <= 1;
+}
+
+// Last entry whose hash is <= `hash`; entry 0 covers everything below entry 1
+static int index_find(const dir_index_header_t *header, uint32_t hash) {
+    const dir_index_entry_t *entries = (const dir_index_entry_t *)(header + 1);
+    int lo = 0;
+    int hi = header->count - 1;
+    
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (entries[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static dir_index_header_t *get_index(txn_t *txn, uint32_t block_num) {
+    dir_index_header_t *header = txn_get_block(txn, block_num);
+    if (header && !index_valid(header)) {
+        fprintf(stderr, "Error: Corrupt directory index block %u\n", block_num);
+        return NULL;
+    }
+    return header;
+}
+
+static int descend(txn_t *txn, const inode_t *dir, uint32_t hash, dir_path_t *path) {
+    path->root = get_index(txn, dir->blocks[0]);
+    if (!path->root) return -1;
+    
+    path->node = path->root;
+    path->root_pos = 0;
+    if (path->root->levels == 1) {
+        path->root_pos = index_find(path->root, hash);
+        path->node = get_index(txn, index_entries(path->root)[path->root_pos].block);
+        if (!path->node) return -1;
+    }
+    path->pos = index_find(path->node, hash);
+    return 0;
+}
+
+int dir_lookup(txn_t *txn, const inode_t *dir, const char *name, uint32_t *inum) {
+    uint32_t leaf_block = dir->blocks[0];
+    
+    if (dir->flags & INODE_DIR_INDEX) {
+        dir_path_t path;
+        if (descend(txn, dir, dir_hash(name), &path) != 0) return -1;
+        leaf_block = index_entries(path.node)[path.pos].block;
+    }
+    
+    const dirent_t *entries = txn_get_block(txn, leaf_block);
+    if (!entries) return -1;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (name_matches(&entries[i], name)) {
+            *inum = entries[i].inum;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void insert_entry(txn_t *txn, dir_index_header_t *header, int pos,
+                         const dir_index_entry_t *entry) {
+    dir_index_entry_t *entries = index_entries(header);
+    
+    memmove(&entries[pos + 1], &entries[pos], (header->count - pos) * sizeof(dir_index_entry_t));
+    entries[pos] = *entry;
+    header->count++;
+    txn_mark_dirty(txn, &header->count, sizeof(header->count));
+    txn_mark_dirty(txn, &entries[pos], (header->count - pos) * sizeof(dir_index_entry_t));
+}
+
+static void fill_entry(txn_t *txn, inode_t *dir, dirent_t *entry, const char *name,
+                       uint32_t inum) {
+    strncpy(entry->name, name, MAX_FILENAME - 1);
+    entry->name[MAX_FILENAME - 1] = '\0';
+    entry->inum = inum;
+    txn_mark_dirty(txn, entry, sizeof(dirent_t));
+    dir->size += sizeof(dirent_t);
+    txn_mark_dirty(txn, &dir->size, sizeof(dir->size));
+}
+
+// Turn a full plain directory into an index whose only leaf is its old block
+static int convert_to_index(txn_t *txn, inode_t *dir) {
+    uint32_t root_block;
+    dir_index_header_t *root = txn_alloc_block(txn, &root_block);
+    if (!root) return -1;
+    
+    root->magic = DIR_INDEX_MAGIC;
+    root->count = 1;
+    root->levels = 0;
+    dir_index_entry_t *entry = index_entries(root);
+    entry->hash = 0;
+    entry->block = dir->blocks[0];
+    entry->used = DIRENTS_PER_BLOCK;
+    entry->free_hint = DIRENTS_PER_BLOCK;
+    
+    dir->blocks[0] = root_block;
+    dir->flags |= INODE_DIR_INDEX;
+    txn_mark_dirty(txn, &dir->blocks[0], sizeof(dir->blocks[0]));
+    txn_mark_dirty(txn, &dir->flags, sizeof(dir->flags));
+    return 0;
+}
+
+// The root is full of leaf entries: move them all to one index block below it
+static int deepen(txn_t *txn, dir_index_header_t *root) {
+    uint32_t block_num;
+    dir_index_header_t *node = txn_alloc_block(txn, &block_num);
+    if (!node) return -1;
+    
+    memcpy(node, root, BLOCK_SIZE);
+    root->count = 1;
+    root->levels = 1;
+    dir_index_entry_t *entry = index_entries(root);
+    entry->hash = 0;
+    entry->block = block_num;
+    entry->used = 0;
+    entry->free_hint = 0;
+    txn_mark_dirty(txn, root, sizeof(dir_index_header_t) + sizeof(dir_index_entry_t));
+    return 0;
+}
+
+// Split a full index block below the root, moving its upper half to a new one
+static int split_index(txn_t *txn, const dir_path_t *path) {
+    if (path->root->count == DIR_INDEX_ENTRIES) {
+        fprintf(stderr, "Error: Directory index is full\n");
+        return -1;
+    }
+    
+    uint32_t block_num;
+    dir_index_header_t *sibling = txn_alloc_block(txn, &block_num);
+    if (!sibling) return -1;
+    
+    int keep = path->node->count / 2;
+    sibling->magic = DIR_INDEX_MAGIC;
+    sibling->count = path->node->count - keep;
+    sibling->levels = 0;
+    memcpy(index_entries(sibling), &index_entries(path->node)[keep],
+           sibling->count * sizeof(dir_index_entry_t));
+    path->node->count = keep;
+    txn_mark_dirty(txn, &path->node->count, sizeof(path->node->count));
+    
+    dir_index_entry_t entry = { index_entries(sibling)[0].hash, block_num, 0, 0 };
+    insert_entry(txn, path->root, path->root_pos + 1, &entry);
+    return 0;
+}
+
+static int compare_hashed(const void *a, const void *b) {
+    uint32_t x = ((const hashed_dirent_t *)a)->hash;
+    uint32_t y = ((const hashed_dirent_t *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// Split a full leaf by hash, moving the upper half of its entries to a new
+// leaf. Names with equal hashes stay together, so a lookup reads one leaf.
+static int split_leaf(txn_t *txn, dir_index_header_t *node, int pos) {
+    hashed_dirent_t sorted[DIRENTS_PER_BLOCK];
+    dir_index_entry_t *leaf_entry = &index_entries(node)[pos];
+    
+    dirent_t *leaf = txn_get_block(txn, leaf_entry->block);
+    if (!leaf) return -1;
+    
+    int n = 0;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (leaf[i].inum == 0) continue;
+        sorted[n].hash = dir_hash(leaf[i].name);
+        sorted[n].entry = leaf[i];
+        n++;
+    }
+    if (n < 2) {
+        fprintf(stderr, "Error: Corrupt directory index entry for block %u\n", leaf_entry->block);
+        return -1;
+    }
+    qsort(sorted, n, sizeof(hashed_dirent_t), compare_hashed);
+    
+    int split = n / 2;
+    while (split < n && sorted[split].hash == sorted[split - 1].hash) split++;
+    if (split == n) {
+        split = n / 2;
+        while (split > 0 && sorted[split].hash == sorted[split - 1].hash) split--;
+    }
+    if (split == 0) {
+        fprintf(stderr, "Error: Too many names with the same hash in one directory block\n");
+        return -1;
+    }
+    
+    uint32_t block_num;
+    dirent_t *sibling = txn_alloc_block(txn, &block_num);
+    if (!sibling) return -1;
+    
+    memset(leaf, 0, BLOCK_SIZE);
+    for (int i = 0; i < split; i++) leaf[i] = sorted[i].entry;
+    for (int i = split; i < n; i++) sibling[i - split] = sorted[i].entry;
+    txn_mark_dirty(txn, leaf, BLOCK_SIZE);
+    
+    leaf_entry->used = split;
+    leaf_entry->free_hint = split;
+    txn_mark_dirty(txn, &leaf_entry->used, sizeof(leaf_entry->used) + sizeof(leaf_entry->free_hint));
+    
+    dir_index_entry_t entry = { sorted[split].hash, block_num, n - split, n - split };
+    insert_entry(txn, node, pos + 1, &entry);
+    return 0;
+}
+
+int dir_add(txn_t *txn, inode_t *dir, const char *name, uint32_t inum) {
+    if (!(dir->flags & INODE_DIR_INDEX)) {
+        dirent_t *entries = txn_get_block(txn, dir->blocks[0]);
+        if (!entries) return -1;
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inum == 0) {
+                fill_entry(txn, dir, &entries[i], name, inum);
+                return 0;
+            }
+        }
+        
+        // The only block is full: it becomes the first leaf of an index
+        if (convert_to_index(txn, dir) != 0) return -1;
+    }
+    
+    uint32_t hash = dir_hash(name);
+    for (;;) {
+        dir_path_t path;
+        if (descend(txn, dir, hash, &path) != 0) return -1;
+        
+        dir_index_entry_t *leaf_entry = &index_entries(path.node)[path.pos];
+        if (leaf_entry->used < DIRENTS_PER_BLOCK) {
+            dirent_t *leaf = txn_get_block(txn, leaf_entry->block);
+            if (!leaf) return -1;
+            
+            // Entries are never removed, so no slot below the hint is free
+            uint32_t slot = leaf_entry->free_hint;
+            while (slot < DIRENTS_PER_BLOCK && leaf[slot].inum != 0) slot++;
+            if (slot == DIRENTS_PER_BLOCK) {
+                fprintf(stderr, "Error: Corrupt directory index entry for block %u\n",
+                        leaf_entry->block);
+                return -1;
+            }
+            
+            fill_entry(txn, dir, &leaf[slot], name, inum);
+            leaf_entry->used++;
+            leaf_entry->free_hint = slot + 1;
+            txn_mark_dirty(txn, &leaf_entry->used,
+                           sizeof(leaf_entry->used) + sizeof(leaf_entry->free_hint));
+            return 0;
+        }
+        
+        // Split the leaf, first making room for its new entry in the index
+        int ret;
+        if (path.node->count < DIR_INDEX_ENTRIES) {
+            ret = split_leaf(txn, path.node, path.pos);
+        } else if (path.node == path.root) {
+            ret = deepen(txn, path.root);
+        } else {
+            ret = split_index(txn, &path);
+        }
+        if (ret != 0) return -1;
+    }
+}
+
+int dir_for_each_entry(uint32_t leaf_block, dir_entry_fn entry_fn, void *arg) {
+    uint8_t buffer[BLOCK_SIZE];
+    
+    const dirent_t *entries = disk_map_or_read(leaf_block, 1, buffer);
+    if (!entries) {
+        fprintf(stderr, "Error: Failed to read directory block %u\n", leaf_block);
+        return -1;
+    }
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inum != 0) entry_fn(&entries[i], arg);
+    }
+    return 0;
+}
+
+static const dir_index_header_t *read_index(uint32_t block_num, void *buffer) {
+    const dir_index_header_t *header = disk_map_or_read(block_num, 1, buffer);
+    if (!header) {
+        fprintf(stderr, "Error: Failed to read directory block %u\n", block_num);
+        return NULL;
+    }
+    if (!index_valid(header)) {
+        fprintf(stderr, "Error: Corrupt directory index block %u\n", block_num);
+        return NULL;
+    }
+    return header;
+}
+
+int dir_find(const inode_t *dir, const char *name, uint32_t *inum) {
+    uint8_t buffer[BLOCK_SIZE];
+    uint32_t leaf_block = dir->blocks[0];
+    
+    if (dir->flags & INODE_DIR_INDEX) {
+        uint32_t hash = dir_hash(name);
+        const dir_index_header_t *node = read_index(dir->blocks[0], buffer);
+        if (!node) return -1;
+        if (node->levels == 1) {
+            uint32_t child = ((const dir_index_entry_t *)(node + 1))[index_find(node, hash)].block;
+            node = read_index(child, buffer);
+            if (!node) return -1;
+        }
+        leaf_block = ((const dir_index_entry_t *)(node + 1))[index_find(node, hash)].block;
+    }
+    
+    const dirent_t *entries = disk_map_or_read(leaf_block, 1, buffer);
+    if (!entries) {
+        fprintf(stderr, "Error: Failed to read directory block %u\n", leaf_block);
+        return -1;
+    }
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (name_matches(&entries[i], name)) {
+            *inum = entries[i].inum;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Walk the index, handing index blocks to index_fn and each leaf to leaf_fn;
+// stops when leaf_fn fails
+static int walk_index(const inode_t *dir, dir_block_fn index_fn,
+                      int (*leaf_fn)(uint32_t block_num, void *arg), void *arg) {
+    uint8_t root_buffer[BLOCK_SIZE];
+    uint8_t node_buffer[BLOCK_SIZE];
+    
+    if (!(dir->flags & INODE_DIR_INDEX)) return leaf_fn(dir->blocks[0], arg);
+    
+    const dir_index_header_t *root = read_index(dir->blocks[0], root_buffer);
+    if (!root) return -1;
+    if (index_fn) index_fn(dir->blocks[0], arg);
+    
+    const dir_index_entry_t *children = (const dir_index_entry_t *)(root + 1);
+    for (int i = 0; i < root->count; i++) {
+        if (root->levels == 0) {
+            if (leaf_fn(children[i].block, arg) != 0) return -1;
+            continue;
+        }
+        
+        const dir_index_header_t *node = read_index(children[i].block, node_buffer);
+        if (!node) return -1;
+        if (index_fn) index_fn(children[i].block, arg);
+        
+        const dir_index_entry_t *leaves = (const dir_index_entry_t *)(node + 1);
+        for (int j = 0; j < node->count; j++) {
+            if (leaf_fn(leaves[j].block, arg) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// The caller's callbacks, for the walk_index() visitors below
+typedef struct {
+    dir_block_fn index_fn;
+    dir_block_fn leaf_fn;
+    dir_entry_fn entry_fn;
+    void *arg;
+} dir_walk_t;
+
+static void visit_index(uint32_t block_num, void *arg) {
+    dir_walk_t *walk = arg;
+    if (walk->index_fn) walk->index_fn(block_num, walk->arg);
+}
+
+static int visit_leaf(uint32_t block_num, void *arg) {
+    dir_walk_t *walk = arg;
+    if (walk->leaf_fn) walk->leaf_fn(block_num, walk->arg);
+    if (!walk->entry_fn) return 0;
+    return dir_for_each_entry(block_num, walk->entry_fn, walk->arg);
+}
+
+int dir_for_each(const inode_t *dir, dir_block_fn block_fn, dir_entry_fn entry_fn, void *arg) {
+    dir_walk_t walk;
+    walk.index_fn = block_fn;
+    walk.leaf_fn = block_fn;
+    walk.entry_fn = entry_fn;
+    walk.arg = arg;
+    return walk_index(dir, visit_index, visit_leaf, &walk);
+}
+
+int dir_for_each_block(const inode_t *dir, dir_block_fn index_fn, dir_block_fn leaf_fn,
+                       void *arg) {
+    dir_walk_t walk;
+    walk.index_fn = index_fn;
+    walk.leaf_fn = leaf_fn;
+    walk.entry_fn = NULL;
+    walk.arg = arg;
+    return walk_index(dir, visit_index, visit_leaf, &walk);
+}
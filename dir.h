@@ -0,0 +1,41 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include <stdint.h>
+#include "vsfs.h"
+#include "journal.h"
+
+// Hash of a directory entry name (over the stored, possibly truncated, name)
+uint32_t dir_hash(const char *name);
+
+// Transactional directory operations. `dir` points into a block held by
+// `txn`. dir_lookup() returns 1 and sets *inum when `name` exists, 0 when it
+// does not, and -1 on error. dir_add() inserts an entry for a name the caller
+// knows is absent, splitting index leaves as needed; a plain directory whose
+// only block fills up is converted to an indexed one.
+int dir_lookup(txn_t *txn, const inode_t *dir, const char *name, uint32_t *inum);
+int dir_add(txn_t *txn, inode_t *dir, const char *name, uint32_t inum);
+
+// Per-directory lock (by inode number) for callers sharing a transaction:
+// held from the lookup that finds a name absent until it has been added
+void dir_lock(uint32_t inum);
+void dir_unlock(uint32_t inum);
+
+// dir_lookup() on the directory as it is on disk, without a transaction
+int dir_find(const inode_t *dir, const char *name, uint32_t *inum);
+
+// Read-only walk of a directory as it is on disk (ls, check): block_fn sees
+// every directory block (index blocks and leaves), entry_fn every entry in
+// use. Either may be NULL. Returns -1 if a block cannot be read or an index
+// block is corrupt.
+typedef void (*dir_block_fn)(uint32_t block_num, void *arg);
+typedef void (*dir_entry_fn)(const dirent_t *entry, void *arg);
+int dir_for_each(const inode_t *dir, dir_block_fn block_fn, dir_entry_fn entry_fn, void *arg);
+
+// The same walk in two halves, so the leaves can be shared out: the blocks
+// alone (leaves are not read), then the entries of one leaf block
+int dir_for_each_block(const inode_t *dir, dir_block_fn index_fn, dir_block_fn leaf_fn,
+                       void *arg);
+int dir_for_each_entry(uint32_t leaf_block, dir_entry_fn entry_fn, void *arg);
+
+#endif // DIR_H
@@ -1,61 +1,824 @@
+#define _GNU_SOURCE
 #include "disk.h"
+#include "cache.h"
+#include "uring.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
 
-FILE *disk_fp = NULL;
+// Max iovecs handed to a single preadv/pwritev call
+#define DISK_MAX_IOV 64
 
-int disk_open(const char *filename) {
-    disk_fp = fopen(filename, "r+b");
-    if (!disk_fp) {
+// Writer threads for batches when io_uring is unavailable
+#define DISK_MAX_WORKERS 16
+
+int disk_fd = -1;
+superblock_t disk_sb;
+
+static int disk_flags = 0;
+static uint8_t *bounce_block = NULL;  // Aligned staging block for O_DIRECT
+
+// mmap backend: the whole image mapped shared, plus the range of blocks
+// written since the last barrier (msync'd at the barrier)
+static uint8_t *disk_map = NULL;
+static uint32_t map_blocks = 0;
+static uint32_t map_dirty_lo = UINT32_MAX;
+static uint32_t map_dirty_hi = 0;
+
+// Batched writes: writes kept in flight, and the io_uring ring (state 0 until
+// first used, 1 when set up, -1 when io_uring is unavailable)
+static uint32_t queue_depth = DISK_DEFAULT_QUEUE_DEPTH;
+static uring_t ring;
+static int ring_state = 0;
+
+// I/O counters since disk_open(); batch writer threads update them too, so
+// every update is atomic
+static disk_stats_t io_stats;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// End of a region of the image, in bytes. Until a superblock is loaded,
+// everything past block 0 counts as data.
+static uint64_t region_end(int region) {
+    uint32_t end;
+    switch (region) {
+    case DISK_REGION_SUPERBLOCK: end = SUPERBLOCK_BLOCK + 1; break;
+    case DISK_REGION_JOURNAL: end = disk_sb.inode_bitmap_block; break;
+    case DISK_REGION_BITMAPS: end = disk_sb.inode_table_start; break;
+    case DISK_REGION_INODE_TABLE: end = disk_sb.data_blocks_start; break;
+    default: return UINT64_MAX;
+    }
+    if (region != DISK_REGION_SUPERBLOCK && disk_sb.magic != VSFS_MAGIC) return 0;
+    return (uint64_t)end * BLOCK_SIZE;
+}
+
+// Count one transfer of `bytes` at byte `offset`, split over the regions it
+// touches
+static void count_transfer(int write, uint64_t offset, uint64_t bytes, uint64_t ns) {
+    stat_add(write ? &io_stats.writes : &io_stats.reads, 1);
+    stat_add(write ? &io_stats.bytes_written : &io_stats.bytes_read, bytes);
+    stat_add(write ? &io_stats.write_ns : &io_stats.read_ns, ns);
+    
+    uint64_t end = offset + bytes;
+    for (int r = 0; r < DISK_REGIONS && offset < end; r++) {
+        uint64_t limit = region_end(r);
+        if (offset >= limit) continue;
+        uint64_t n = (end < limit ? end : limit) - offset;
+        disk_region_stats_t *region = &io_stats.regions[r];
+        stat_add(write ? &region->bytes_written : &region->bytes_read, n);
+        offset += n;
+    }
+}
+
+static void count_flush(uint64_t ns) {
+    stat_add(&io_stats.flushes, 1);
+    stat_add(&io_stats.flush_ns, ns);
+}
+
+static int map_image(void) {
+    struct stat st;
+    if (fstat(disk_fd, &st) != 0) {
+        perror("disk_open: fstat failed");
+        return -1;
+    }
+    
+    map_blocks = (uint32_t)(st.st_size / BLOCK_SIZE);
+    if (map_blocks == 0) {
+        fprintf(stderr, "disk_open: image too small to map\n");
+        return -1;
+    }
+    
+    void *map = mmap(NULL, (size_t)map_blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, disk_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("disk_open: mmap failed");
+        map_blocks = 0;
+        return -1;
+    }
+    disk_map = map;
+    return 0;
+}
+
+int disk_open(const char *filename, int flags) {
+    int oflags = O_RDWR;
+    if (flags & DISK_MMAP) {
+        flags &= ~DISK_DIRECT;  // Page-cache mapping; O_DIRECT is meaningless
+    }
+    if (flags & DISK_DIRECT) {
+        oflags |= O_DIRECT;
+    }
+    
+    disk_fd = open(filename, oflags);
+    if (disk_fd < 0 && (flags & DISK_DIRECT) && errno == EINVAL) {
+        // Filesystems such as tmpfs refuse O_DIRECT; fall back to buffered I/O
+        fprintf(stderr, "Warning: O_DIRECT not supported for '%s', using buffered I/O\n",
+                filename);
+        flags &= ~DISK_DIRECT;
+        disk_fd = open(filename, O_RDWR);
+    }
+    if (disk_fd < 0) {
         perror("Failed to open disk image");
         return -1;
     }
+    
+    if (flags & DISK_DIRECT) {
+        if (posix_memalign((void **)&bounce_block, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+            perror("disk_open: posix_memalign failed");
+            close(disk_fd);
+            disk_fd = -1;
+            return -1;
+        }
+    }
+    
+    disk_flags = flags;
+    memset(&io_stats, 0, sizeof(io_stats));
+    if (flags & DISK_MMAP) {
+        // Blocks are served straight from the mapping; no buffer cache
+        if (map_image() != 0) {
+            disk_close();
+            return -1;
+        }
+        disk_load_superblock();
+        return 0;
+    }
+    if (bcache_init() != 0) {
+        disk_close();
+        return -1;
+    }
+    disk_load_superblock();
+    return 0;
+}
+
+// Regions must be in order, back to back, and large enough for their counts
+static int geometry_valid(const superblock_t *sb) {
+    return sb->magic == VSFS_MAGIC &&
+           sb->journal_blocks >= MIN_JOURNAL_BLOCKS &&
+           sb->inode_bitmap_block == JOURNAL_START + sb->journal_blocks &&
+           sb->data_bitmap_block == sb->inode_bitmap_block + sb->inode_bitmap_blocks &&
+           sb->inode_table_start == sb->data_bitmap_block + sb->data_bitmap_blocks &&
+           sb->data_blocks_start == sb->inode_table_start + sb->inode_table_blocks &&
+           (uint64_t)sb->data_blocks_start + sb->data_blocks_count == sb->num_blocks &&
+           sb->num_inodes > 0 && sb->data_blocks_count > 0 &&
+           (uint64_t)sb->inode_bitmap_blocks * BITS_PER_BLOCK >= sb->num_inodes &&
+           (uint64_t)sb->data_bitmap_blocks * BITS_PER_BLOCK >= sb->data_blocks_count &&
+           (uint64_t)sb->inode_table_blocks * INODES_PER_BLOCK >= sb->num_inodes &&
+           sb->free_inodes <= sb->num_inodes && sb->free_blocks <= sb->data_blocks_count &&
+           sb->group_blocks > 0 &&
+           summary_groups(sb, 0) + summary_groups(sb, 1) <= SUMMARY_SLOTS;
+}
+
+int disk_load_superblock(void) {
+    uint8_t block[BLOCK_SIZE] BLOCK_ALIGNED;
+    
+    memset(&disk_sb, 0, sizeof(disk_sb));
+    if (disk_read(SUPERBLOCK_BLOCK, block) != 0) return -1;
+    
+    superblock_t sb;
+    memcpy(&sb, block, sizeof(sb));
+    if (!geometry_valid(&sb)) return -1;
+    disk_sb = sb;
     return 0;
 }
 
 void disk_close(void) {
-    if (disk_fp) {
-        fclose(disk_fp);
-        disk_fp = NULL;
+    if (disk_map) {
+        munmap(disk_map, (size_t)map_blocks * BLOCK_SIZE);
+        disk_map = NULL;
+        map_blocks = 0;
+        map_dirty_lo = UINT32_MAX;
+        map_dirty_hi = 0;
+    }
+    if (disk_fd >= 0) {
+        bcache_flush();
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    bcache_destroy();
+    if (ring_state == 1) uring_close(&ring);
+    ring_state = 0;
+    memset(&disk_sb, 0, sizeof(disk_sb));
+    free(bounce_block);
+    bounce_block = NULL;
+    disk_flags = 0;
+}
+
+// Copy a run of blocks to or from the mapping
+static int map_rw(int write, uint32_t start, uint32_t count, void *buffer) {
+    if (start >= map_blocks || count > map_blocks - start) {
+        errno = EIO;  // Ran off the end of the image
+        return -1;
+    }
+    
+    uint8_t *block = disk_map + (size_t)start * BLOCK_SIZE;
+    size_t bytes = (size_t)count * BLOCK_SIZE;
+    uint64_t begin = clock_ns();
+    if (write) {
+        memcpy(block, buffer, bytes);
+        if (start < map_dirty_lo) map_dirty_lo = start;
+        if (start + count > map_dirty_hi) map_dirty_hi = start + count;
+    } else {
+        memcpy(buffer, block, bytes);
+    }
+    count_transfer(write, (uint64_t)start * BLOCK_SIZE, bytes, clock_ns() - begin);
+    return 0;
+}
+
+static int needs_bounce(const void *buffer) {
+    return (disk_flags & DISK_DIRECT) && ((uintptr_t)buffer % BLOCK_SIZE) != 0;
+}
+
+// Drop the first `n` bytes from an iovec array
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// Transfer the bytes described by an iovec array at a byte offset, resuming
+// after short transfers. The iovec array is consumed.
+static int disk_rw_iov(int write, off_t offset, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        uint64_t begin = clock_ns();
+        ssize_t n;
+        if (write) {
+            n = iovcnt == 1 ? pwrite(disk_fd, iov->iov_base, iov->iov_len, offset)
+                            : pwritev(disk_fd, iov, iovcnt, offset);
+        } else {
+            n = iovcnt == 1 ? pread(disk_fd, iov->iov_base, iov->iov_len, offset)
+                            : preadv(disk_fd, iov, iovcnt, offset);
+        }
+        stat_add(&io_stats.syscalls, 1);
+        if (n > 0) count_transfer(write, (uint64_t)offset, (uint64_t)n, clock_ns() - begin);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;  // Ran off the end of the image
+            return -1;
+        }
+        
+        offset += n;
+        iov_advance(&iov, &iovcnt, (size_t)n);
+    }
+    
+    return 0;
+}
+
+static off_t block_offset(uint32_t block_num) {
+    return (off_t)block_num * BLOCK_SIZE;
+}
+
+static int disk_rw(int write, uint32_t start, uint32_t count, void *buffer) {
+    if (disk_fd < 0) return -1;
+    if (disk_map) return map_rw(write, start, count, buffer);
+    
+    if (needs_bounce(buffer)) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t *block = (uint8_t *)buffer + (size_t)i * BLOCK_SIZE;
+            struct iovec iov = { bounce_block, BLOCK_SIZE };
+            if (write) memcpy(bounce_block, block, BLOCK_SIZE);
+            if (disk_rw_iov(write, block_offset(start + i), &iov, 1) != 0) return -1;
+            if (!write) memcpy(block, bounce_block, BLOCK_SIZE);
+        }
+        return 0;
+    }
+    
+    struct iovec iov = { buffer, (size_t)count * BLOCK_SIZE };
+    return disk_rw_iov(write, block_offset(start), &iov, 1);
+}
+
+static int disk_rw_vec(int write, uint32_t start, void *const buffers[], uint32_t count) {
+    if (disk_fd < 0) return -1;
+    if (disk_map) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (map_rw(write, start + i, 1, buffers[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    
+    struct iovec iov[DISK_MAX_IOV];
+    uint32_t done = 0;
+    
+    while (done < count) {
+        int n = 0;
+        while (done + n < count && n < DISK_MAX_IOV && !needs_bounce(buffers[done + n])) {
+            iov[n].iov_base = buffers[done + n];
+            iov[n].iov_len = BLOCK_SIZE;
+            n++;
+        }
+        
+        if (n == 0) {
+            // Unaligned buffer under O_DIRECT: stage it through the bounce block
+            if (disk_rw(write, start + done, 1, buffers[done]) != 0) return -1;
+            done++;
+            continue;
+        }
+        
+        if (disk_rw_iov(write, block_offset(start + done), iov, n) != 0) return -1;
+        done += n;
+    }
+    
+    return 0;
+}
+
+int disk_raw_read(uint32_t block_num, void *buffer) {
+    if (disk_rw(0, block_num, 1, buffer) != 0) {
+        perror("disk_read: pread failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_raw_read_blocks(uint32_t start, uint32_t count, void *buffer) {
+    if (disk_rw(0, start, count, buffer) != 0) {
+        perror("disk_read_blocks: pread failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_raw_writev(uint32_t start, const void *const buffers[], uint32_t count) {
+    if (disk_rw_vec(1, start, (void *const *)buffers, count) != 0) {
+        perror("disk_write: pwritev failed");
+        return -1;
     }
+    return 0;
+}
+
+// Cached single-block transfers. If every cache buffer is pinned the block
+// cannot be resident, so going straight to disk stays coherent.
+static int cached_read(uint32_t block_num, void *buffer) {
+    void *cached = bcache_get(block_num);
+    if (!cached) return disk_raw_read(block_num, buffer);
+    memcpy(buffer, cached, BLOCK_SIZE);
+    bcache_put(cached);
+    return 0;
+}
+
+static int cached_write(uint32_t block_num, const void *buffer) {
+    void *cached = bcache_get_new(block_num);
+    if (!cached) return disk_raw_writev(block_num, &buffer, 1);
+    memcpy(cached, buffer, BLOCK_SIZE);
+    bcache_mark_dirty(cached);
+    bcache_put(cached);
+    return 0;
 }
 
 int disk_read(uint32_t block_num, void *buffer) {
-    if (!disk_fp) return -1;
+    if (bcache_enabled()) return cached_read(block_num, buffer);
+    return disk_raw_read(block_num, buffer);
+}
+
+int disk_write(uint32_t block_num, const void *buffer) {
+    if (bcache_enabled()) return cached_write(block_num, buffer);
+    return disk_raw_writev(block_num, &buffer, 1);
+}
+
+int disk_read_blocks(uint32_t start, uint32_t count, void *buffer) {
+    if (bcache_enabled()) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (cached_read(start + i, (uint8_t *)buffer + (size_t)i * BLOCK_SIZE) != 0) return -1;
+        }
+        return 0;
+    }
+    if (disk_rw(0, start, count, buffer) != 0) {
+        perror("disk_read_blocks: pread failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_write_blocks(uint32_t start, uint32_t count, const void *buffer) {
+    if (bcache_enabled()) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (cached_write(start + i, (const uint8_t *)buffer + (size_t)i * BLOCK_SIZE) != 0) return -1;
+        }
+        return 0;
+    }
+    if (disk_rw(1, start, count, (void *)buffer) != 0) {
+        perror("disk_write_blocks: pwrite failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_readv(uint32_t start, void *const buffers[], uint32_t count) {
+    if (bcache_enabled()) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (cached_read(start + i, buffers[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    if (disk_rw_vec(0, start, buffers, count) != 0) {
+        perror("disk_readv: preadv failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_writev(uint32_t start, const void *const buffers[], uint32_t count) {
+    if (bcache_enabled()) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (cached_write(start + i, buffers[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    return disk_raw_writev(start, buffers, count);
+}
+
+const void *disk_map_block(uint32_t block_num) {
+    if (!disk_map || block_num >= map_blocks) return NULL;
+    return disk_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+const void *disk_map_or_read(uint32_t start, uint32_t count, void *buffer) {
+    if (disk_map && start < map_blocks && count <= map_blocks - start) {
+        return disk_map + (size_t)start * BLOCK_SIZE;
+    }
+    return disk_read_blocks(start, count, buffer) == 0 ? buffer : NULL;
+}
+
+void disk_advise_sequential(uint32_t start, uint32_t count) {
+    if (!disk_map || start >= map_blocks) return;
+    if (count > map_blocks - start) count = map_blocks - start;
+    uint8_t *addr = disk_map + (size_t)start * BLOCK_SIZE;
+    madvise(addr, (size_t)count * BLOCK_SIZE, MADV_SEQUENTIAL);
+    madvise(addr, (size_t)count * BLOCK_SIZE, MADV_WILLNEED);
+}
+
+// File data moved by the kernel. It never goes through the buffer cache,
+// which only holds metadata, and O_DIRECT images are left to the caller.
+int disk_copy_in(int fd, off_t *offset, uint32_t start, uint64_t length, uint64_t *done) {
+    *done = 0;
+    if (disk_fd < 0) return -1;
+    if (disk_flags & DISK_DIRECT) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    
+    uint32_t blocks = (uint32_t)((length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    bcache_forget(start, blocks);
+    off_t out = block_offset(start);
+    while (*done < length) {
+        uint64_t begin = clock_ns();
+        ssize_t n = copy_file_range(fd, offset, disk_fd, &out, length - *done, 0);
+        stat_add(&io_stats.syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EIO;  // The source ended early
+            return -1;
+        }
+        count_transfer(1, (uint64_t)(out - n), (uint64_t)n, clock_ns() - begin);
+        *done += (uint64_t)n;
+    }
     
-    if (fseek(disk_fp, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("disk_read: fseek failed");
+    // Written through the file, but a barrier only flushes what the mapping
+    // has been told about
+    if (disk_map) {
+        if (start < map_dirty_lo) map_dirty_lo = start;
+        if (start + blocks > map_dirty_hi) map_dirty_hi = start + blocks;
+    }
+    return 0;
+}
+
+int disk_send_out(int fd, uint32_t start, uint64_t length, uint64_t *done) {
+    *done = 0;
+    if (disk_fd < 0) return -1;
+    if (disk_flags & DISK_DIRECT) {
+        errno = EOPNOTSUPP;
         return -1;
     }
     
-    size_t bytes_read = fread(buffer, 1, BLOCK_SIZE, disk_fp);
-    if (bytes_read != BLOCK_SIZE) {
-        perror("disk_read: fread failed");
+    off_t in = block_offset(start);
+    while (*done < length) {
+        uint64_t begin = clock_ns();
+        ssize_t n = sendfile(fd, disk_fd, &in, length - *done);
+        stat_add(&io_stats.syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EIO;  // Ran off the end of the image
+            return -1;
+        }
+        count_transfer(0, (uint64_t)(in - n), (uint64_t)n, clock_ns() - begin);
+        *done += (uint64_t)n;
+    }
+    return 0;
+}
+
+// fdatasync(), counted
+static int sync_data(void) {
+    uint64_t begin = clock_ns();
+    int ret = fdatasync(disk_fd);
+    stat_add(&io_stats.syscalls, 1);
+    count_flush(clock_ns() - begin);
+    return ret;
+}
+
+// Push blocks written through the mapping out to the image
+static int map_flush(void) {
+    if (!disk_map || map_dirty_lo >= map_dirty_hi) return 0;
+    uint64_t begin = clock_ns();
+    int ret = msync(disk_map + (size_t)map_dirty_lo * BLOCK_SIZE,
+                    (size_t)(map_dirty_hi - map_dirty_lo) * BLOCK_SIZE, MS_SYNC);
+    stat_add(&io_stats.syscalls, 1);
+    count_flush(clock_ns() - begin);
+    if (ret != 0) {
+        perror("disk_barrier: msync failed");
+        return -1;
+    }
+    map_dirty_lo = UINT32_MAX;
+    map_dirty_hi = 0;
+    return 0;
+}
+
+int disk_barrier(void) {
+    if (disk_fd < 0) return -1;
+    if (disk_map) return map_flush();
+    if (bcache_flush() != 0) return -1;
+    if (sync_data() != 0) {
+        perror("disk_barrier: fdatasync failed");
+        return -1;
+    }
+    return 0;
+}
+
+int disk_sync(void) {
+    if (disk_fd < 0) return -1;
+    if (map_flush() != 0) return -1;
+    if (bcache_flush() != 0) return -1;
+    uint64_t begin = clock_ns();
+    int ret = fsync(disk_fd);
+    stat_add(&io_stats.syscalls, 1);
+    count_flush(clock_ns() - begin);
+    if (ret != 0) {
+        perror("disk_sync: fsync failed");
         return -1;
     }
+    return 0;
+}
+
+// Batched writes. A batch is cut into pieces of up to DISK_MAX_IOV blocks,
+// each one vectored write; pieces complete in any order.
+typedef struct {
+    off_t offset;
+    struct iovec *iov;
+    int iovcnt;
+} disk_piece_t;
+
+void disk_set_queue_depth(uint32_t depth) {
+    if (depth < 1) depth = 1;
+    if (depth > DISK_MAX_QUEUE_DEPTH) depth = DISK_MAX_QUEUE_DEPTH;
+    queue_depth = depth;
+}
+
+// Set up the ring on first use; 0 when io_uring can be used
+static int ring_ready(void) {
+    if (ring_state == 0) {
+        ring_state = uring_open(&ring, queue_depth) == 0 ? 1 : -1;
+    }
+    return ring_state == 1 ? 0 : -1;
+}
+
+// Cut the runs into pieces. A block whose buffer an O_DIRECT disk cannot
+// take is written at once, through the bounce block.
+static int build_pieces(const disk_run_t *runs, int nruns, struct iovec *iov,
+                        disk_piece_t *pieces, uint32_t *npieces) {
+    uint32_t used = 0;
+    uint32_t n = 0;
     
+    for (int r = 0; r < nruns; r++) {
+        const disk_run_t *run = &runs[r];
+        for (uint32_t i = 0; i < run->count; ) {
+            if (needs_bounce(run->buffers[i])) {
+                if (disk_rw(1, run->start + i, 1, (void *)run->buffers[i]) != 0) return -1;
+                i++;
+                continue;
+            }
+            
+            disk_piece_t *piece = &pieces[n++];
+            piece->offset = block_offset(run->start + i);
+            piece->iov = &iov[used];
+            piece->iovcnt = 0;
+            while (i < run->count && piece->iovcnt < DISK_MAX_IOV &&
+                   !needs_bounce(run->buffers[i])) {
+                iov[used].iov_base = (void *)run->buffers[i];
+                iov[used].iov_len = BLOCK_SIZE;
+                used++;
+                piece->iovcnt++;
+                i++;
+            }
+        }
+    }
+    *npieces = n;
     return 0;
 }
 
-int disk_write(uint32_t block_num, const void *buffer) {
-    if (!disk_fp) return -1;
+// Keep up to queue_depth pieces in flight on the ring. The barrier, an
+// fdatasync marked IOSQE_IO_DRAIN, goes in with the last pieces: the kernel
+// starts it only once every write before it has completed, so the whole
+// batch costs as little as one io_uring_enter().
+static int write_pieces_uring(disk_piece_t *pieces, uint32_t count, int barrier) {
+    uint64_t begin = clock_ns();
+    uint32_t next = 0;
+    uint32_t inflight = 0;
+    int barrier_queued = !barrier;
+    int resync = 0;
+    int error = 0;
     
-    if (fseek(disk_fp, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("disk_write: fseek failed");
-        return -1;
+    while (inflight > 0 || (!error && (next < count || !barrier_queued))) {
+        while (!error && next < count && inflight < queue_depth &&
+               uring_prep_writev(&ring, disk_fd, pieces[next].iov, pieces[next].iovcnt,
+                                 pieces[next].offset, next) == 0) {
+            next++;
+            inflight++;
+        }
+        if (!error && next == count && !barrier_queued &&
+            uring_prep_drain_fdatasync(&ring, disk_fd, UINT64_MAX) == 0) {
+            barrier_queued = 1;
+            inflight++;
+        }
+        
+        // The kernel may still be writing from the pieces' buffers, so a
+        // failed submit stops queuing but keeps reaping what is in flight
+        stat_add(&io_stats.syscalls, 1);
+        if (uring_submit(&ring, 1) != 0) {
+            if (!error) error = errno;
+            inflight -= uring_unqueue(&ring);
+        }
+        
+        uring_cqe_t cqe;
+        while (uring_next_cqe(&ring, &cqe)) {
+            inflight--;
+            if (cqe.res < 0) {
+                if (!error) error = -cqe.res;
+                continue;
+            }
+            if (cqe.user_data == UINT64_MAX) {
+                count_flush(0);
+                continue;
+            }
+            
+            // Entries overlap, so the batch's time is counted as a whole
+            disk_piece_t *piece = &pieces[cqe.user_data];
+            count_transfer(1, (uint64_t)piece->offset, (uint64_t)cqe.res, 0);
+            
+            // Finish a short write in line; it may have missed the barrier
+            iov_advance(&piece->iov, &piece->iovcnt, (size_t)cqe.res);
+            if (piece->iovcnt > 0) {
+                if (disk_rw_iov(1, piece->offset + cqe.res, piece->iov, piece->iovcnt) != 0 &&
+                    !error) {
+                    error = errno;
+                }
+                resync = 1;
+            }
+        }
     }
     
-    size_t bytes_written = fwrite(buffer, 1, BLOCK_SIZE, disk_fp);
-    if (bytes_written != BLOCK_SIZE) {
-        perror("disk_write: fwrite failed");
+    stat_add(&io_stats.write_ns, clock_ns() - begin);
+    if (error) {
+        errno = error;
         return -1;
     }
+    if (barrier && resync && sync_data() != 0) return -1;
+    return 0;
+}
+
+// Thread fallback: up to queue_depth threads (the caller among them) take
+// pieces in turn and write them synchronously
+typedef struct {
+    disk_piece_t *pieces;
+    uint32_t count;
+    uint32_t next;                    // Next piece to take (atomic)
+    int error;                        // errno of the first failure (atomic)
+} disk_batch_t;
+
+static void *batch_worker(void *arg) {
+    disk_batch_t *batch = arg;
+    
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count) break;
+        
+        disk_piece_t *piece = &batch->pieces[i];
+        if (disk_rw_iov(1, piece->offset, piece->iov, piece->iovcnt) != 0) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&batch->error, &expected, errno, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int write_pieces_threads(disk_piece_t *pieces, uint32_t count, int barrier) {
+    pthread_t threads[DISK_MAX_WORKERS];
+    int started = 0;
+    
+    disk_batch_t batch;
+    batch.pieces = pieces;
+    batch.count = count;
+    batch.next = 0;
+    batch.error = 0;
+    
+    uint32_t workers = count < queue_depth ? count : queue_depth;
+    if (workers > DISK_MAX_WORKERS) workers = DISK_MAX_WORKERS;
+    while ((uint32_t)started + 1 < workers &&
+           pthread_create(&threads[started], NULL, batch_worker, &batch) == 0) {
+        started++;
+    }
+    batch_worker(&batch);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
     
-    fflush(disk_fp);
+    if (batch.error) {
+        errno = batch.error;
+        return -1;
+    }
+    if (barrier && sync_data() != 0) return -1;
     return 0;
 }
 
-int bitmap_get(uint8_t *bitmap, uint32_t index) {
+static int write_batch_mapped(const disk_run_t *runs, int nruns, int barrier) {
+    for (int r = 0; r < nruns; r++) {
+        for (uint32_t i = 0; i < runs[r].count; i++) {
+            if (map_rw(1, runs[r].start + i, 1, (void *)runs[r].buffers[i]) != 0) return -1;
+        }
+    }
+    return barrier ? map_flush() : 0;
+}
+
+int disk_write_batch(const disk_run_t *runs, int nruns, int flags) {
+    int barrier = (flags & DISK_BATCH_BARRIER) != 0;
+    if (disk_fd < 0) return -1;
+    
+    // The batch bypasses the buffer cache: cached copies of its blocks are
+    // dropped, and other dirty blocks go out ahead of its barrier
+    uint32_t blocks = 0;
+    for (int r = 0; r < nruns; r++) {
+        bcache_forget(runs[r].start, runs[r].count);
+        blocks += runs[r].count;
+    }
+    if (disk_map) {
+        if (write_batch_mapped(runs, nruns, barrier) == 0) return 0;
+        perror("disk_write_batch: write failed");
+        return -1;
+    }
+    if (barrier && bcache_flush() != 0) return -1;
+    
+    struct iovec *iov = malloc(((size_t)blocks + 1) * sizeof(struct iovec));
+    disk_piece_t *pieces = malloc(((size_t)blocks + 1) * sizeof(disk_piece_t));
+    uint32_t npieces = 0;
+    int ret = -1;
+    if (!iov || !pieces) {
+        errno = ENOMEM;
+    } else if (build_pieces(runs, nruns, iov, pieces, &npieces) == 0) {
+        if (queue_depth > 1 && ring_ready() == 0) {
+            ret = write_pieces_uring(pieces, npieces, barrier);
+        } else {
+            ret = write_pieces_threads(pieces, npieces, barrier);
+        }
+    }
+    if (ret != 0) perror("disk_write_batch: write failed");
+    free(iov);
+    free(pieces);
+    return ret;
+}
+
+void disk_get_stats(disk_stats_t *stats) {
+    // Every field is a uint64_t counter
+    const uint64_t *from = (const uint64_t *)&io_stats;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+int bitmap_get(const uint8_t *bitmap, uint32_t index) {
     uint32_t byte_offset = index / 8;
     uint32_t bit_offset = index % 8;
     return (bitmap[byte_offset] >> bit_offset) & 1;
@@ -73,11 +836,142 @@ void bitmap_clear(uint8_t *bitmap, uint32_t index) {
     bitmap[byte_offset] &= ~(1 << bit_offset);
 }
 
-int bitmap_find_free(uint8_t *bitmap, uint32_t max_bits) {
-    for (uint32_t i = 0; i < max_bits; i++) {
-        if (!bitmap_get(bitmap, i)) {
-            return i;
+// Bitmap bit i is bit i % 64 of word i / 64. Bytes at or past `nbytes` are
+// not read and count as zero.
+static uint64_t load_word(const uint8_t *bitmap, uint64_t word, uint64_t nbytes) {
+    uint64_t value = 0;
+    uint64_t offset = word * 8;
+    uint64_t len = nbytes - offset < 8 ? nbytes - offset : 8;
+    
+    memcpy(&value, bitmap + offset, len);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Skip 32-byte stretches of set bits. Returns the first byte of a stretch
+// that is not all set, or where fewer than 32 bytes are left.
+__attribute__((target("avx2")))
+static uint64_t skip_full_avx2(const uint8_t *bitmap, uint64_t byte, uint64_t end_byte) {
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    while (byte + 32 <= end_byte) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + byte));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, ones)) != -1) break;
+        byte += 32;
+    }
+    return byte;
+}
+
+static int have_avx2(void) {
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return supported;
+}
+#endif
+
+// First bit in [from, end) that is set (want_set) or clear, or -1
+static int64_t scan_bits(const uint8_t *bitmap, uint64_t from, uint64_t end, int want_set) {
+    uint64_t nbytes = (end + 7) / 8;
+    uint64_t i = from;
+    
+    while (i < end) {
+#if defined(__x86_64__) && defined(__GNUC__)
+        // Full regions are common when searching for a clear bit
+        if (!want_set && i % 64 == 0 && have_avx2()) {
+            i = skip_full_avx2(bitmap, i / 8, end / 8) * 8;
+            if (i >= end) break;
         }
+#endif
+        uint64_t word = load_word(bitmap, i / 64, nbytes);
+        if (!want_set) word = ~word;
+        word &= ~0ULL << (i % 64);
+        uint64_t base = i - i % 64;
+        if (end - base < 64) word &= (1ULL << (end - base)) - 1;
+        if (word) return (int64_t)(base + __builtin_ctzll(word));
+        i = base + 64;
+    }
+    return -1;
+}
+
+int64_t bitmap_first_clear(const uint8_t *bitmap, uint32_t start, uint32_t count) {
+    return scan_bits(bitmap, start, (uint64_t)start + count, 0);
+}
+
+int bitmap_find_free(const uint8_t *bitmap, uint32_t max_bits) {
+    return (int)scan_bits(bitmap, 0, max_bits, 0);
+}
+
+uint32_t bitmap_count(const uint8_t *bitmap, uint32_t start, uint32_t count) {
+    uint64_t end = (uint64_t)start + count;
+    uint64_t nbytes = (end + 7) / 8;
+    uint32_t set = 0;
+    
+    for (uint64_t base = start - start % 64; base < end; base += 64) {
+        uint64_t word = load_word(bitmap, base / 64, nbytes);
+        if (base < start) word &= ~0ULL << (start - base);
+        if (end - base < 64) word &= (1ULL << (end - base)) - 1;
+        set += (uint32_t)__builtin_popcountll(word);
+    }
+    return set;
+}
+
+int64_t bitmap_find_free_run(const uint8_t *bitmap, uint32_t start, uint32_t max_bits,
+                             uint32_t len) {
+    uint64_t i = start;
+    
+    if (len == 0) return -1;
+    while (i + len <= max_bits) {
+        int64_t first = scan_bits(bitmap, i, max_bits, 0);
+        if (first < 0 || (uint64_t)first + len > max_bits) return -1;
+        
+        // The run ends early at the next set bit; resume just past it
+        int64_t used = scan_bits(bitmap, (uint64_t)first, (uint64_t)first + len, 1);
+        if (used < 0) return first;
+        i = (uint64_t)used + 1;
     }
     return -1;
 }
+
+uint32_t summary_groups(const superblock_t *sb, int data) {
+    uint32_t blocks = data ? sb->data_bitmap_blocks : sb->inode_bitmap_blocks;
+    return (blocks + sb->group_blocks - 1) / sb->group_blocks;
+}
+
+uint32_t *summary_free(void *sb_block, int data, uint64_t bit) {
+    const superblock_t *sb = sb_block;
+    uint32_t group = (uint32_t)(bit / BITS_PER_BLOCK / sb->group_blocks);
+    uint32_t *slots = (uint32_t *)((uint8_t *)sb_block + SUMMARY_OFFSET);
+    return &slots[data ? summary_groups(sb, 0) + group : group];
+}
+
+// Free bits of one bitmap, in total and per group
+static uint32_t count_free(void *sb_block, int data, const uint8_t *bitmap) {
+    const superblock_t *sb = sb_block;
+    uint64_t nbits = data ? sb->data_blocks_count : sb->num_inodes;
+    uint64_t group_bits = (uint64_t)sb->group_blocks * BITS_PER_BLOCK;
+    uint32_t total = 0;
+    
+    for (uint64_t first = 0; first < nbits; first += group_bits) {
+        uint32_t bits = (uint32_t)(nbits - first < group_bits ? nbits - first : group_bits);
+        uint32_t used = bitmap ? bitmap_count(bitmap, (uint32_t)first, bits) : 0;
+        *summary_free(sb_block, data, first) = bits - used;
+        total += bits - used;
+    }
+    return total;
+}
+
+void summary_rebuild(void *sb_block, const uint8_t *inode_bitmap, const uint8_t *data_bitmap) {
+    superblock_t *sb = sb_block;
+    sb->free_inodes = count_free(sb_block, 0, inode_bitmap);
+    sb->free_blocks = count_free(sb_block, 1, data_bitmap);
+}
+
+const inode_t *table_inode(const void *inode_table, uint32_t inum) {
+    const uint8_t *block = (const uint8_t *)inode_table +
+                           (size_t)(inum / INODES_PER_BLOCK) * BLOCK_SIZE;
+    return (const inode_t *)block + inum % INODES_PER_BLOCK;
+}
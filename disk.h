@@ -1,23 +1,150 @@
 #ifndef DISK_H
 #define DISK_H
 
-#include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "vsfs.h"
 
-// Global disk file pointer
-extern FILE *disk_fp;
+// Flags for disk_open()
+#define DISK_DIRECT 0x1       // Bypass the page cache (O_DIRECT)
+#define DISK_MMAP   0x2       // Map the whole image; enables disk_map_block()
 
-// Disk I/O functions
-int disk_open(const char *filename);
+// Stack/static block buffers that may be handed to an O_DIRECT disk
+#define BLOCK_ALIGNED __attribute__((aligned(BLOCK_SIZE)))
+
+// Global disk file descriptor
+extern int disk_fd;
+
+// File system geometry, read from the superblock by disk_open(). It is all
+// zero (magic != VSFS_MAGIC) when the image is not formatted or the
+// superblock is invalid; mkfs calls disk_load_superblock() after writing it.
+extern superblock_t disk_sb;
+int disk_load_superblock(void);
+
+// Disk I/O functions. Reads and writes go through the buffer cache
+// (cache.h); dirty blocks reach the image at the next barrier/sync/close.
+int disk_open(const char *filename, int flags);
 void disk_close(void);
 int disk_read(uint32_t block_num, void *buffer);
 int disk_write(uint32_t block_num, const void *buffer);
 
+// Multi-block I/O: a run of `count` consecutive blocks starting at `start`
+int disk_read_blocks(uint32_t start, uint32_t count, void *buffer);
+int disk_write_blocks(uint32_t start, uint32_t count, const void *buffer);
+int disk_readv(uint32_t start, void *const buffers[], uint32_t count);
+int disk_writev(uint32_t start, const void *const buffers[], uint32_t count);
+
+// Uncached I/O, used by the buffer cache to fill and write back blocks, and
+// to read regions only ever written by disk_write_batch() in one request
+int disk_raw_read(uint32_t block_num, void *buffer);
+int disk_raw_read_blocks(uint32_t start, uint32_t count, void *buffer);
+int disk_raw_writev(uint32_t start, const void *const buffers[], uint32_t count);
+
+// Zero-copy access (DISK_MMAP backend). disk_map_block() returns a pointer
+// into the mapping, or NULL on other backends; blocks that follow in the
+// image follow in memory. disk_map_or_read() maps a run of blocks when it
+// can and otherwise reads it into `buffer`, returning NULL on error.
+const void *disk_map_block(uint32_t block_num);
+const void *disk_map_or_read(uint32_t start, uint32_t count, void *buffer);
+void disk_advise_sequential(uint32_t start, uint32_t count);
+
+// File data moved by the kernel without a copy through user space:
+// disk_copy_in() copies `length` bytes of `fd`, from *offset (which it
+// advances), into the image at block `start` (copy_file_range);
+// disk_send_out() sends `length` bytes of the image from block `start` to
+// `fd` (sendfile). Both bypass the buffer cache; *done reports the bytes
+// moved. They fail with errno EOPNOTSUPP on an O_DIRECT image, or with what
+// the kernel reports (EXDEV, EINVAL, ...) when it cannot do this for these
+// files, and the caller then copies through a buffer.
+int disk_copy_in(int fd, off_t *offset, uint32_t start, uint64_t length, uint64_t *done);
+int disk_send_out(int fd, uint32_t start, uint64_t length, uint64_t *done);
+
+// Durability: disk_barrier() makes every write issued so far durable before
+// any later write; disk_sync() additionally flushes file metadata.
+int disk_barrier(void);
+int disk_sync(void);
+
+// Batched writes: a set of block runs written together, with as many writes
+// in flight as the queue depth allows (io_uring when the kernel has it,
+// writer threads otherwise). Blocks within a batch complete in no particular
+// order. With DISK_BATCH_BARRIER the call returns once the batch, and every
+// write issued before it, is durable. The runs bypass the buffer cache.
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+    const void *const *buffers;       // One block per buffer
+} disk_run_t;
+
+#define DISK_BATCH_BARRIER 0x1
+
+#define DISK_DEFAULT_QUEUE_DEPTH 64
+#define DISK_MAX_QUEUE_DEPTH 4096
+
+int disk_write_batch(const disk_run_t *runs, int nruns, int flags);
+// Writes kept in flight by disk_write_batch() (1: one at a time, in order)
+void disk_set_queue_depth(uint32_t depth);
+
+// I/O counters since disk_open(). Reads and writes are requests: system
+// calls, io_uring entries, or copies through the mapping; `syscalls` counts
+// the calls that move or flush data (preads and pwrites, vectored or not,
+// fdatasync/fsync/msync and io_uring_enter). Times are cumulative wall time
+// in nanoseconds, summed over threads; a batch on io_uring counts as one
+// stretch of write time. Bytes are also broken down by region of the image.
+enum {
+    DISK_REGION_SUPERBLOCK,
+    DISK_REGION_JOURNAL,
+    DISK_REGION_BITMAPS,              // Inode and data bitmaps
+    DISK_REGION_INODE_TABLE,
+    DISK_REGION_DATA,
+    DISK_REGIONS
+};
+
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} disk_region_stats_t;
+
+typedef struct {
+    uint64_t syscalls;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t flushes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_ns;
+    uint64_t write_ns;
+    uint64_t flush_ns;
+    disk_region_stats_t regions[DISK_REGIONS];
+} disk_stats_t;
+
+void disk_get_stats(disk_stats_t *stats);
+
 // Bitmap operations
-int bitmap_get(uint8_t *bitmap, uint32_t index);
+int bitmap_get(const uint8_t *bitmap, uint32_t index);
 void bitmap_set(uint8_t *bitmap, uint32_t index);
 void bitmap_clear(uint8_t *bitmap, uint32_t index);
-int bitmap_find_free(uint8_t *bitmap, uint32_t max_bits);
+// Searches go a 64-bit word at a time (32 bytes at a time over full regions
+// with AVX2) rather than a bit at a time.
+int bitmap_find_free(const uint8_t *bitmap, uint32_t max_bits);
+// First clear bit in [start, start + count), or -1 if the range is all set
+int64_t bitmap_first_clear(const uint8_t *bitmap, uint32_t start, uint32_t count);
+// Number of set bits in [start, start + count)
+uint32_t bitmap_count(const uint8_t *bitmap, uint32_t start, uint32_t count);
+// First of `len` consecutive clear bits at or after `start`, below
+// `max_bits`, or -1 if there is no such run
+int64_t bitmap_find_free_run(const uint8_t *bitmap, uint32_t start, uint32_t max_bits,
+                             uint32_t len);
+
+// Free-count summaries, in a copy of the superblock block (see
+// SUMMARY_OFFSET). `data` selects the data bitmap over the inode bitmap.
+uint32_t summary_groups(const superblock_t *sb, int data);
+// Free count of the group holding bitmap bit `bit`
+uint32_t *summary_free(void *sb_block, int data, uint64_t bit);
+// Recount the totals and every group from the bitmaps (NULL: all clear)
+void summary_rebuild(void *sb_block, const uint8_t *inode_bitmap, const uint8_t *data_bitmap);
+
+// Inode `inum` of an inode table loaded into memory. Inodes never straddle a
+// block, so the table is not one flat inode_t array.
+const inode_t *table_inode(const void *inode_table, uint32_t inum);
 
 #endif // DISK_H
@@ -0,0 +1,273 @@
+#include "extent.h"
+#include "disk.h"
+#include <stdio.h>
+#include <string.h>
+
+static extent_root_t *extent_root(inode_t *inode) {
+    return (extent_root_t *)inode->blocks;
+}
+
+static extent_t *index_extents(extent_index_header_t *header) {
+    return (extent_t *)(header + 1);
+}
+
+static uint32_t inline_count(const extent_root_t *root) {
+    return root->count < INODE_INLINE_EXTENTS ? root->count : INODE_INLINE_EXTENTS;
+}
+
+static int index_valid(const extent_index_header_t *header) {
+    return header->magic == EXTENT_INDEX_MAGIC && header->count > 0 &&
+           header->count <= EXTENTS_PER_INDEX;
+}
+
+void extent_init(inode_t *inode) {
+    memset(inode->blocks, 0, sizeof(inode->blocks));
+    inode->flags |= INODE_EXTENTS;
+}
+
+// Legacy inodes: fill the next free direct pointers
+static int append_direct(txn_t *txn, inode_t *inode, uint32_t start, uint32_t count) {
+    uint32_t used = 0;
+    while (used < DIRECT_POINTERS && inode->blocks[used] != 0) used++;
+    
+    if (count > DIRECT_POINTERS - used) {
+        fprintf(stderr, "Error: File needs more than %d direct blocks\n", DIRECT_POINTERS);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        inode->blocks[used + i] = start + i;
+    }
+    txn_mark_dirty(txn, &inode->blocks[used], count * sizeof(uint32_t));
+    return 0;
+}
+
+int extent_append(txn_t *txn, inode_t *inode, uint32_t start, uint32_t count) {
+    if (count == 0) return 0;
+    if (!(inode->flags & INODE_EXTENTS)) return append_direct(txn, inode, start, count);
+    
+    extent_root_t *root = extent_root(inode);
+    extent_index_header_t *tail = NULL;
+    extent_t *last = NULL;
+    
+    if (root->count > INODE_INLINE_EXTENTS) {
+        tail = txn_get_block(txn, root->last_index);
+        if (!tail) return -1;
+        if (!index_valid(tail)) {
+            fprintf(stderr, "Error: Corrupt extent index block %u\n", root->last_index);
+            return -1;
+        }
+        last = &index_extents(tail)[tail->count - 1];
+    } else if (root->count > 0) {
+        last = &root->extents[root->count - 1];
+    }
+    
+    // A run that continues the last extent on disk just lengthens it
+    if (last && last->start + last->length == start) {
+        last->length += count;
+        txn_mark_dirty(txn, &last->length, sizeof(last->length));
+        return 0;
+    }
+    
+    extent_t extent;
+    extent.logical = last ? last->logical + last->length : 0;
+    extent.start = start;
+    extent.length = count;
+    
+    if (root->count < INODE_INLINE_EXTENTS) {
+        root->extents[root->count] = extent;
+        txn_mark_dirty(txn, &root->extents[root->count], sizeof(extent_t));
+    } else {
+        // Spill over: start a new index block when there is none or it is full
+        if (!tail || tail->count == EXTENTS_PER_INDEX) {
+            uint32_t block_num;
+            extent_index_header_t *fresh = txn_alloc_block(txn, &block_num);
+            if (!fresh) return -1;
+            fresh->magic = EXTENT_INDEX_MAGIC;
+            
+            if (tail) {
+                tail->next = block_num;
+                txn_mark_dirty(txn, &tail->next, sizeof(tail->next));
+            } else {
+                root->index_block = block_num;
+                txn_mark_dirty(txn, &root->index_block, sizeof(root->index_block));
+            }
+            root->last_index = block_num;
+            txn_mark_dirty(txn, &root->last_index, sizeof(root->last_index));
+            tail = fresh;
+        }
+        index_extents(tail)[tail->count] = extent;
+        txn_mark_dirty(txn, &index_extents(tail)[tail->count], sizeof(extent_t));
+        tail->count++;
+        txn_mark_dirty(txn, &tail->count, sizeof(tail->count));
+    }
+    
+    root->count++;
+    txn_mark_dirty(txn, &root->count, sizeof(root->count));
+    return 0;
+}
+
+// Keep the part of `extent` before file block `keep` and free the rest.
+// Returns 1 if some of it is kept, 0 if it is all freed, or -1.
+static int trim_extent(txn_t *txn, extent_t *extent, uint32_t keep) {
+    if (extent->logical >= keep) {
+        return txn_free_data(txn, extent->start, extent->length) == 0 ? 0 : -1;
+    }
+    
+    uint32_t length = keep - extent->logical;
+    if (extent->length > length) {
+        if (txn_free_data(txn, extent->start + length, extent->length - length) != 0) return -1;
+        extent->length = length;
+        txn_mark_dirty(txn, &extent->length, sizeof(extent->length));
+    }
+    return 1;
+}
+
+// Index block `block_num` as `txn` sees it, or as installed when txn is NULL
+static const extent_index_header_t *read_index(txn_t *txn, uint32_t block_num, void *buffer) {
+    const extent_index_header_t *header = txn ? txn_peek_block(txn, block_num, buffer)
+                                              : disk_map_or_read(block_num, 1, buffer);
+    if (!header) {
+        fprintf(stderr, "Error: Failed to read extent index block %u\n", block_num);
+        return NULL;
+    }
+    if (!index_valid(header)) {
+        fprintf(stderr, "Error: Corrupt extent index block %u\n", block_num);
+        return NULL;
+    }
+    return header;
+}
+
+static int walk_extents(txn_t *txn, const inode_t *inode, extent_block_fn index_fn,
+                        extent_run_fn run_fn, void *arg) {
+    uint8_t buffer[BLOCK_SIZE];
+    
+    if (!(inode->flags & INODE_EXTENTS)) {
+        for (int i = 0; i < DIRECT_POINTERS; i++) {
+            if (inode->blocks[i] != 0 && run_fn) run_fn(inode->blocks[i], 1, arg);
+        }
+        return 0;
+    }
+    
+    const extent_root_t *root = (const extent_root_t *)inode->blocks;
+    uint32_t seen = inline_count(root);
+    for (uint32_t i = 0; i < seen; i++) {
+        if (run_fn) run_fn(root->extents[i].start, root->extents[i].length, arg);
+    }
+    
+    uint32_t next = root->count > INODE_INLINE_EXTENTS ? root->index_block : 0;
+    while (next != 0) {
+        const extent_index_header_t *index = read_index(txn, next, buffer);
+        if (!index) return -1;
+        seen += index->count;
+        if (seen > root->count) break;
+        
+        if (index_fn) index_fn(next, arg);
+        const extent_t *extents = (const extent_t *)(index + 1);
+        for (uint32_t i = 0; i < index->count; i++) {
+            if (run_fn) run_fn(extents[i].start, extents[i].length, arg);
+        }
+        next = index->next;
+    }
+    
+    if (seen != root->count) {
+        fprintf(stderr, "Error: Extent count %u does not match the extent index\n", root->count);
+        return -1;
+    }
+    return 0;
+}
+
+int extent_for_each(const inode_t *inode, extent_block_fn index_fn, extent_run_fn run_fn,
+                    void *arg) {
+    return walk_extents(NULL, inode, index_fn, run_fn, arg);
+}
+
+int extent_for_each_txn(txn_t *txn, const inode_t *inode, extent_run_fn run_fn, void *arg) {
+    return walk_extents(txn, inode, NULL, run_fn, arg);
+}
+
+int extent_has_index(const inode_t *inode) {
+    const extent_root_t *root = (const extent_root_t *)inode->blocks;
+    return (inode->flags & INODE_EXTENTS) && root->count > INODE_INLINE_EXTENTS;
+}
+
+int extent_truncate(txn_t *txn, inode_t *inode, uint32_t keep) {
+    if (!(inode->flags & INODE_EXTENTS)) {
+        for (uint32_t i = keep; i < DIRECT_POINTERS; i++) {
+            if (inode->blocks[i] == 0) continue;
+            if (txn_free_data(txn, inode->blocks[i], 1) != 0) return -1;
+            inode->blocks[i] = 0;
+            txn_mark_dirty(txn, &inode->blocks[i], sizeof(inode->blocks[i]));
+        }
+        return 0;
+    }
+    
+    extent_root_t *root = extent_root(inode);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < inline_count(root); i++) {
+        int ret = trim_extent(txn, &root->extents[i], keep);
+        if (ret < 0) return -1;
+        kept += (uint32_t)ret;
+    }
+    
+    // Index blocks are only read until one has extents to trim; blocks past
+    // the last one kept are freed with their runs
+    uint8_t buffer[BLOCK_SIZE];
+    uint32_t last = 0;
+    uint32_t last_next = 0;
+    uint32_t next = root->count > INODE_INLINE_EXTENTS ? root->index_block : 0;
+    while (next != 0) {
+        uint32_t block_num = next;
+        const extent_index_header_t *index = read_index(txn, block_num, buffer);
+        if (!index) return -1;
+        next = index->next;
+        
+        const extent_t *extents = (const extent_t *)(index + 1);
+        const extent_t *final = &extents[index->count - 1];
+        if (extents[0].logical >= keep) {
+            for (uint32_t i = 0; i < index->count; i++) {
+                if (txn_free_data(txn, extents[i].start, extents[i].length) != 0) return -1;
+            }
+            if (txn_free_data(txn, block_num, 1) != 0) return -1;
+            continue;
+        }
+        
+        last = block_num;
+        last_next = next;
+        if (final->logical + final->length <= keep) {
+            kept += index->count;
+            continue;
+        }
+        
+        extent_index_header_t *tail = txn_get_block(txn, block_num);
+        if (!tail) return -1;
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < tail->count; i++) {
+            int ret = trim_extent(txn, &index_extents(tail)[i], keep);
+            if (ret < 0) return -1;
+            count += (uint32_t)ret;
+        }
+        tail->count = count;
+        txn_mark_dirty(txn, &tail->count, sizeof(tail->count));
+        kept += count;
+    }
+    
+    if (last != 0 && last_next != 0) {
+        extent_index_header_t *tail = txn_get_block(txn, last);
+        if (!tail) return -1;
+        tail->next = 0;
+        txn_mark_dirty(txn, &tail->next, sizeof(tail->next));
+    }
+    if (last == 0 && root->index_block != 0) {
+        root->index_block = 0;
+        txn_mark_dirty(txn, &root->index_block, sizeof(root->index_block));
+    }
+    if (root->last_index != last) {
+        root->last_index = last;
+        txn_mark_dirty(txn, &root->last_index, sizeof(root->last_index));
+    }
+    if (root->count != kept) {
+        root->count = kept;
+        txn_mark_dirty(txn, &root->count, sizeof(root->count));
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+#include "vsfs.h"
+#include "journal.h"
+
+// Block mapping for file inodes, in either format: legacy direct pointers,
+// or extents (INODE_EXTENTS).
+
+// Start `inode` out as an empty extent-mapped file
+void extent_init(inode_t *inode);
+
+// Append `count` disk blocks starting at `start` as the file's next blocks.
+// `inode` points into a block held by `txn`. A run that continues the last
+// extent just lengthens it; otherwise a new extent is added, spilling into
+// a new index block when the inode and the last index block are full.
+int extent_append(txn_t *txn, inode_t *inode, uint32_t start, uint32_t count);
+
+// Free every block of the file past its first `keep`, shortening or dropping
+// extents and the index blocks left empty. Index blocks are journaled, so
+// the caller checkpoints first when the file has any (extent_has_index()).
+int extent_truncate(txn_t *txn, inode_t *inode, uint32_t keep);
+
+// Whether some of the file's extents spill into index blocks
+int extent_has_index(const inode_t *inode);
+
+// Read-only walk of a file's block map (check): index_fn sees every
+// spill-over index block and run_fn every run of data blocks (for legacy
+// inodes, each direct pointer is a run of one). Either may be NULL. Work is
+// proportional to the number of extents, not blocks. Returns -1 if an index
+// block cannot be read or is corrupt.
+typedef void (*extent_block_fn)(uint32_t block_num, void *arg);
+typedef void (*extent_run_fn)(uint32_t start, uint32_t length, void *arg);
+int extent_for_each(const inode_t *inode, extent_block_fn index_fn, extent_run_fn run_fn,
+                    void *arg);
+
+// The runs of a file as `txn` sees them, including index blocks that are
+// only in the journal so far (writing file data)
+int extent_for_each_txn(txn_t *txn, const inode_t *inode, extent_run_fn run_fn, void *arg);
+
+#endif // EXTENT_H
@@ -0,0 +1,529 @@
+#define _POSIX_C_SOURCE 200809L
+#include "file.h"
+#include "journal.h"
+#include "disk.h"
+#include "dir.h"
+#include "extent.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// New runs one chunk may allocate, which bounds the bitmap blocks its
+// transaction touches
+#define FILE_MAX_RUNS 16
+
+// The superblock, the inode's table block, a bitmap block per new run, and
+// the last extent index block with up to two new ones and their bitmap block
+#define FILE_CREDITS (6 + FILE_MAX_RUNS)
+
+// A rewrite's last chunk also frees the blocks past the new size: a bitmap
+// block per run, up to every data bitmap block, and the index block the
+// extents end in
+#define REWRITE_CREDITS (FILE_CREDITS + 1 + disk_sb.data_bitmap_blocks)
+
+// Blocks a lookup may add: the root inode's table block, two index levels
+// and a leaf
+#define LOOKUP_CREDITS 4
+
+// Runs of disk blocks, in file order; runs that follow each other on disk
+// are merged
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} block_run_t;
+
+typedef struct {
+    block_run_t *runs;
+    int count;
+    int capacity;
+    uint64_t blocks;
+    int failed;
+} run_list_t;
+
+// Where a write's data comes from. A regular file is read at `offset`, by
+// the kernel while it can; anything else is read in order into `buffer`,
+// where the bytes a chunk could not take wait for the next one.
+typedef struct {
+    int fd;
+    int regular;
+    int zero_copy;
+    off_t offset;
+    uint64_t remaining;               // Regular file: bytes left
+    int eof;
+    uint8_t *buffer;                  // FILE_CHUNK_BLOCKS blocks, block aligned
+    size_t buffered;
+} source_t;
+
+static void add_run(uint32_t start, uint32_t length, void *arg) {
+    run_list_t *list = arg;
+    list->blocks += length;
+    if (list->count > 0) {
+        block_run_t *last = &list->runs[list->count - 1];
+        if (last->start + last->count == start) {
+            last->count += length;
+            return;
+        }
+    }
+    
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        block_run_t *grown = realloc(list->runs, capacity * sizeof(block_run_t));
+        if (!grown) {
+            list->failed = 1;
+            return;
+        }
+        list->runs = grown;
+        list->capacity = capacity;
+    }
+    list->runs[list->count].start = start;
+    list->runs[list->count].count = length;
+    list->count++;
+}
+
+// The kernel cannot move data between these two files; copy it through a
+// buffer instead
+static int kernel_refused(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+static void *alloc_chunk_buffer(void) {
+    void *buffer;
+    if (posix_memalign(&buffer, BLOCK_SIZE, (size_t)FILE_CHUNK_BLOCKS * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Error: Out of memory for file data\n");
+        return NULL;
+    }
+    return buffer;
+}
+
+// Read `length` bytes of a regular file at `offset`
+static int pread_full(int fd, void *buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, (uint8_t *)buffer + done, length - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Failed to read source file");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: Source file ended early\n");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, (const uint8_t *)buffer + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Failed to write file data");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// Top up a stream's buffer (whose data starts `head` bytes in) to `room`
+// bytes, or to the end of the stream
+static int fill_stream(source_t *src, uint32_t head, size_t room) {
+    while (!src->eof && src->buffered < room) {
+        ssize_t n = read(src->fd, src->buffer + head + src->buffered, room - src->buffered);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Failed to read source");
+            return -1;
+        }
+        if (n == 0) src->eof = 1;
+        src->buffered += (size_t)n;
+    }
+    return 0;
+}
+
+// Inode number of `name` as the journal has it, creating the file first
+// when it does not exist
+static int64_t find_or_create(const char *name) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        txn_t *txn = txn_begin(LOOKUP_CREDITS);
+        if (!txn) return -1;
+        
+        // Root inode is always inode 0
+        uint32_t inum = 0;
+        int found = -1;
+        inode_t *inode_block = txn_get_block(txn, disk_sb.inode_table_start);
+        if (inode_block) {
+            dir_lock(0);
+            found = dir_lookup(txn, &inode_block[0], name, &inum);
+            dir_unlock(0);
+        }
+        txn_abort(txn);
+        
+        if (found != 0) return found > 0 ? (int64_t)inum : -1;
+        if (attempt == 0 && create(name) != 0) return -1;
+    }
+    return -1;
+}
+
+// Disk blocks for file blocks [first, first + count) of `inode`: blocks the
+// file has already (rewriting it, or room left in its last block), then new
+// runs appended to its block map. Returns how many blocks were mapped, fewer
+// when the disk is full or FILE_MAX_RUNS runs were allocated, or -1.
+static int64_t map_chunk(txn_t *txn, inode_t *inode, uint64_t first, uint32_t count,
+                         run_list_t *pieces) {
+    run_list_t file;
+    memset(&file, 0, sizeof(file));
+    if (extent_for_each_txn(txn, inode, add_run, &file) != 0 || file.failed) {
+        if (file.failed) fprintf(stderr, "Error: Out of memory mapping file\n");
+        free(file.runs);
+        return -1;
+    }
+    
+    uint64_t logical = 0;
+    uint32_t mapped = 0;
+    for (int i = 0; i < file.count && mapped < count; i++) {
+        const block_run_t *run = &file.runs[i];
+        uint64_t from = first + mapped;
+        if (from < logical + run->count) {
+            uint32_t skip = (uint32_t)(from - logical);
+            uint32_t n = run->count - skip;
+            if (n > count - mapped) n = count - mapped;
+            add_run(run->start + skip, n, pieces);
+            mapped += n;
+        }
+        logical += run->count;
+    }
+    free(file.runs);
+    if (first > logical) {
+        fprintf(stderr, "Error: File size is past its last block\n");
+        return -1;
+    }
+    
+    for (int r = 0; r < FILE_MAX_RUNS && mapped < count; r++) {
+        uint32_t got;
+        int64_t bit = txn_alloc_data_upto(txn, count - mapped, &got);
+        if (bit < 0) break;
+        
+        uint32_t start = disk_sb.data_blocks_start + (uint32_t)bit;
+        if (extent_append(txn, inode, start, got) != 0) return -1;
+        add_run(start, got, pieces);
+        mapped += got;
+    }
+    
+    if (pieces->failed) {
+        fprintf(stderr, "Error: Out of memory mapping file\n");
+        return -1;
+    }
+    if (mapped == 0) {
+        fprintf(stderr, "Error: No free data blocks\n");
+        return -1;
+    }
+    return mapped;
+}
+
+// Put the existing bytes of the partial block in front of a chunk (an
+// append to a file that ends mid-block) in front of its data
+static int read_head(uint32_t block_num, uint8_t *block, uint32_t head) {
+    uint8_t current[BLOCK_SIZE] BLOCK_ALIGNED;
+    if (disk_raw_read(block_num, current) != 0) return -1;
+    memcpy(block, current, head);
+    return 0;
+}
+
+// Copy a chunk from a regular file with copy_file_range(). Returns 1 when
+// the kernel cannot, so the caller writes the chunk through the buffer
+// instead (which rewrites anything copied so far).
+static int copy_chunk(source_t *src, const run_list_t *pieces, uint32_t head, uint64_t length) {
+    off_t offset = src->offset;
+    uint64_t left = length;
+    uint32_t skip = 0;
+    
+    if (head > 0) {
+        uint8_t block[BLOCK_SIZE] BLOCK_ALIGNED;
+        uint32_t n = BLOCK_SIZE - head;
+        if (n > left) n = (uint32_t)left;
+        if (read_head(pieces->runs[0].start, block, head) != 0 ||
+            pread_full(src->fd, block + head, n, offset) != 0) {
+            return -1;
+        }
+        memset(block + head + n, 0, BLOCK_SIZE - head - n);
+        
+        const void *buffers[1] = { block };
+        disk_run_t run = { pieces->runs[0].start, 1, buffers };
+        if (disk_write_batch(&run, 1, 0) != 0) return -1;
+        offset += n;
+        left -= n;
+        skip = 1;
+    }
+    
+    for (int i = 0; i < pieces->count && left > 0; i++) {
+        uint64_t bytes = (uint64_t)(pieces->runs[i].count - skip) * BLOCK_SIZE;
+        if (bytes > left) bytes = left;
+        uint64_t done;
+        if (bytes > 0 &&
+            disk_copy_in(src->fd, &offset, pieces->runs[i].start + skip, bytes, &done) != 0) {
+            if (kernel_refused(errno)) return 1;
+            perror("Failed to copy file data");
+            return -1;
+        }
+        left -= bytes;
+        skip = 0;
+    }
+    
+    // Ordered mode: the data is durable before the metadata commits
+    return disk_barrier() == 0 ? 0 : -1;
+}
+
+// Write a chunk from the buffer, all its runs in one batch with a barrier
+static int buffer_chunk(source_t *src, const run_list_t *pieces, uint32_t head, uint64_t length) {
+    if (!src->buffer) {
+        src->buffer = alloc_chunk_buffer();
+        if (!src->buffer) return -1;
+    }
+    uint8_t *buffer = src->buffer;
+    if (src->regular && pread_full(src->fd, buffer + head, length, src->offset) != 0) return -1;
+    if (head > 0 && read_head(pieces->runs[0].start, buffer, head) != 0) return -1;
+    
+    // The last block is written whole; past the end of the file it is zero
+    uint32_t count = (uint32_t)((head + length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    memset(buffer + head + length, 0, (size_t)count * BLOCK_SIZE - head - length);
+    
+    const void **buffers = malloc(count * sizeof(void *));
+    disk_run_t *runs = malloc(pieces->count * sizeof(disk_run_t));
+    if (!buffers || !runs) {
+        fprintf(stderr, "Error: Out of memory writing file data\n");
+        free(buffers);
+        free(runs);
+        return -1;
+    }
+    
+    uint32_t used = 0;
+    int nruns = 0;
+    for (int i = 0; i < pieces->count && used < count; i++) {
+        uint32_t n = pieces->runs[i].count;
+        if (n > count - used) n = count - used;
+        for (uint32_t j = 0; j < n; j++) {
+            buffers[used + j] = buffer + (size_t)(used + j) * BLOCK_SIZE;
+        }
+        runs[nruns].start = pieces->runs[i].start;
+        runs[nruns].count = n;
+        runs[nruns].buffers = buffers + used;
+        nruns++;
+        used += n;
+    }
+    
+    int ret = disk_write_batch(runs, nruns, DISK_BATCH_BARRIER);
+    free(buffers);
+    free(runs);
+    return ret;
+}
+
+// Write the next chunk of data at file offset `pos`, durably, mapping its
+// blocks in the transaction. Returns the bytes written (0 once the source
+// is exhausted), or -1.
+static int64_t write_chunk(txn_t *txn, inode_t *inode, source_t *src, uint64_t pos) {
+    uint32_t head = pos % BLOCK_SIZE;
+    size_t room = (size_t)FILE_CHUNK_BLOCKS * BLOCK_SIZE - head;
+    uint64_t length;
+    
+    if (src->regular) {
+        length = src->remaining < room ? src->remaining : room;
+    } else {
+        if (fill_stream(src, head, room) != 0) return -1;
+        length = src->buffered;
+    }
+    if (length == 0) return 0;
+    if (pos + length > UINT32_MAX) {
+        fprintf(stderr, "Error: Files are limited to 4 GiB\n");
+        return -1;
+    }
+    
+    uint32_t count = (uint32_t)((head + length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    run_list_t pieces;
+    memset(&pieces, 0, sizeof(pieces));
+    int64_t mapped = map_chunk(txn, inode, pos / BLOCK_SIZE, count, &pieces);
+    if (mapped <= 0) {
+        free(pieces.runs);
+        return -1;
+    }
+    
+    // What did not fit waits for the next chunk
+    if ((uint32_t)mapped < count) length = (uint64_t)mapped * BLOCK_SIZE - head;
+    
+    int ret = 1;
+    if (src->zero_copy) {
+        ret = copy_chunk(src, &pieces, head, length);
+        if (ret > 0) src->zero_copy = 0;
+    }
+    if (ret > 0) ret = buffer_chunk(src, &pieces, head, length);
+    free(pieces.runs);
+    if (ret != 0) return -1;
+    
+    if (src->regular) {
+        src->offset += (off_t)length;
+        src->remaining -= length;
+    } else {
+        src->buffered -= length;
+        memmove(src->buffer, src->buffer + head + length, src->buffered);
+    }
+    return (int64_t)length;
+}
+
+int64_t file_write(const char *name, int fd, int append) {
+    int64_t inum = find_or_create(name);
+    if (inum < 0) return -1;
+    
+    source_t src;
+    memset(&src, 0, sizeof(src));
+    src.fd = fd;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src.regular = 1;
+        src.zero_copy = 1;
+        src.offset = lseek(fd, 0, SEEK_CUR);
+        if (src.offset < 0) src.offset = 0;
+        src.remaining = st.st_size > src.offset ? (uint64_t)(st.st_size - src.offset) : 0;
+    } else {
+        src.buffer = alloc_chunk_buffer();
+        if (!src.buffer) return -1;
+    }
+    
+    uint32_t table_block = disk_sb.inode_table_start + (uint32_t)(inum / INODES_PER_BLOCK);
+    uint64_t pos = 0;
+    int64_t total = 0;
+    uint32_t credits = FILE_CREDITS;
+    if (!append) {
+        credits = REWRITE_CREDITS < TXN_MAX_BLOCKS ? REWRITE_CREDITS : TXN_MAX_BLOCKS;
+    }
+    for (int first = 1; ; first = 0) {
+        txn_t *txn = txn_begin(credits);
+        if (!txn) {
+            total = -1;
+            break;
+        }
+        
+        inode_t *inode_block = txn_get_block(txn, table_block);
+        inode_t *inode = inode_block ? &inode_block[inum % INODES_PER_BLOCK] : NULL;
+        if (inode && inode->type != T_FILE) {
+            fprintf(stderr, "Error: '%s' is not a file\n", name);
+            inode = NULL;
+        }
+        if (!inode) {
+            txn_abort(txn);
+            total = -1;
+            break;
+        }
+        if (first && append) pos = inode->size;
+        
+        int64_t length = write_chunk(txn, inode, &src, pos);
+        if (length < 0) {
+            txn_abort(txn);
+            total = -1;
+            break;
+        }
+        
+        // With nothing (left) to write, an append is done
+        if (length == 0 && append) {
+            txn_abort(txn);
+            break;
+        }
+        
+        // A rewrite's last chunk frees whatever the old contents had past
+        // the new size. Index blocks may have journaled copies that would
+        // be installed over the blocks once reused, so install them first.
+        int last = length == 0 || (src.regular ? src.remaining == 0 : src.eof && src.buffered == 0);
+        if (last && !append) {
+            uint64_t size = pos + (uint64_t)length;
+            uint32_t keep = size > 0 ? (uint32_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+            if ((extent_has_index(inode) && journal_checkpoint() != 0) ||
+                extent_truncate(txn, inode, keep) != 0) {
+                txn_abort(txn);
+                total = -1;
+                break;
+            }
+        }
+        
+        inode->size = (uint32_t)(pos + length);
+        txn_mark_dirty(txn, &inode->size, sizeof(inode->size));
+        if (txn_commit(txn) != 0) {
+            total = -1;
+            break;
+        }
+        pos += length;
+        total += length;
+        if (last) break;
+    }
+    
+    free(src.buffer);
+    return total;
+}
+
+// Send bytes [from, length) of a run starting at block `start` through the
+// buffer
+static int send_buffered(int fd, uint32_t start, uint64_t from, uint64_t length,
+                         uint8_t **buffer) {
+    if (!*buffer) {
+        *buffer = alloc_chunk_buffer();
+        if (!*buffer) return -1;
+    }
+    
+    while (from < length) {
+        uint32_t skip = from % BLOCK_SIZE;
+        uint64_t blocks = (length - from + skip + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t n = blocks < FILE_CHUNK_BLOCKS ? (uint32_t)blocks : FILE_CHUNK_BLOCKS;
+        if (disk_raw_read_blocks(start + (uint32_t)(from / BLOCK_SIZE), n, *buffer) != 0) return -1;
+        
+        uint64_t bytes = (uint64_t)n * BLOCK_SIZE - skip;
+        if (bytes > length - from) bytes = length - from;
+        if (write_all(fd, *buffer + skip, bytes) != 0) return -1;
+        from += bytes;
+    }
+    return 0;
+}
+
+int64_t file_read(const inode_t *inode, int fd) {
+    run_list_t file;
+    memset(&file, 0, sizeof(file));
+    if (extent_for_each(inode, NULL, add_run, &file) != 0 || file.failed) {
+        if (file.failed) fprintf(stderr, "Error: Out of memory mapping file\n");
+        free(file.runs);
+        return -1;
+    }
+    if (inode->size > file.blocks * BLOCK_SIZE) {
+        fprintf(stderr, "Error: File size is past its last block\n");
+        free(file.runs);
+        return -1;
+    }
+    
+    uint8_t *buffer = NULL;
+    uint64_t left = inode->size;
+    int zero_copy = 1;
+    int ret = 0;
+    for (int i = 0; i < file.count && left > 0 && ret == 0; i++) {
+        uint64_t bytes = (uint64_t)file.runs[i].count * BLOCK_SIZE;
+        if (bytes > left) bytes = left;
+        left -= bytes;
+        
+        uint64_t done = 0;
+        if (zero_copy) {
+            if (disk_send_out(fd, file.runs[i].start, bytes, &done) == 0) continue;
+            if (!kernel_refused(errno)) {
+                perror("Failed to send file data");
+                ret = -1;
+                break;
+            }
+            zero_copy = 0;
+        }
+        ret = send_buffered(fd, file.runs[i].start, done, bytes, &buffer);
+    }
+    
+    free(buffer);
+    free(file.runs);
+    return ret == 0 ? (int64_t)inode->size : -1;
+}
@@ -0,0 +1,35 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include "vsfs.h"
+
+// File data, in ordered mode: data blocks are written in place, outside the
+// journal, and made durable before the transaction that gives them to the
+// file (its block map and size) commits. A crash can leave a write's data
+// in blocks the file does not point at yet, never a file pointing at blocks
+// whose data was not written.
+//
+// Data moves in runs of up to FILE_CHUNK_BLOCKS blocks, one transaction per
+// run, so a large file takes several transactions and a crash leaves a
+// prefix of it. A write is therefore not atomic: a rewrite overwrites the
+// file's blocks in place and sets the size chunk by chunk, so a crash can
+// leave new data followed by old. Its last chunk frees the blocks past the
+// new size (after installing the journal, so that no freed block keeps a
+// journaled extent index image that install could write over new data).
+#define FILE_CHUNK_BLOCKS 4096
+
+// Write everything read from `fd` (to its end) into the root directory file
+// `name`, creating it when it does not exist: from the start, replacing its
+// contents (freeing the blocks it no longer needs), or after its end with
+// `append`. More than FILE_CHUNK_BLOCKS blocks take several transactions,
+// so a crash can leave part of the write. A regular file is copied by the
+// kernel (copy_file_range) when the disk allows it; anything else goes
+// through a buffer. Returns the number of bytes written, or -1.
+int64_t file_write(const char *name, int fd, int append);
+
+// Write the contents of a file, as installed, to `fd` (sendfile when the disk
+// allows it). Returns the number of bytes, or -1.
+int64_t file_read(const inode_t *inode, int fd);
+
+#endif // FILE_H
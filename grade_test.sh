@@ -27,8 +27,9 @@ fi
 
 # Crash Recovery (25 points)
 ./mkfs.vsfs grade.img > /dev/null 2>&1
-./vsfs grade.img create f1.txt > /dev/null 2>&1
-./vsfs grade.img create f2.txt 2>&1 | grep -q "Not enough journal space"
+for i in 1 2 3 4 5 6; do
+    ./vsfs --journal-hwm=0 grade.img create f$i.txt 2>&1
+done | grep -q "Not enough journal space"
 if [ $? -eq 0 ]; then
     ./vsfs grade.img install > /dev/null 2>&1
     ./vsfs grade.img check 2>&1 | grep -q "consistent"
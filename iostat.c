@@ -0,0 +1,98 @@
+#include "iostat.h"
+#include "disk.h"
+#include "cache.h"
+#include "journal.h"
+#include <inttypes.h>
+#include <string.h>
+
+static const char *const region_names[DISK_REGIONS] = {
+    "superblock", "journal", "bitmaps", "inode_table", "data"
+};
+
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void iostat_print(FILE *out) {
+    disk_stats_t disk;
+    bcache_stats_t cache;
+    journal_stats_t journal;
+    disk_get_stats(&disk);
+    bcache_get_stats(&cache);
+    journal_get_stats(&journal);
+    
+    fprintf(out, "I/O Statistics:\n");
+    fprintf(out, "  Requests:     %" PRIu64 " reads, %" PRIu64 " writes, %" PRIu64
+            " flushes (%" PRIu64 " syscalls)\n",
+            disk.reads, disk.writes, disk.flushes, disk.syscalls);
+    fprintf(out, "  Bytes:        %" PRIu64 " read, %" PRIu64 " written\n",
+            disk.bytes_read, disk.bytes_written);
+    fprintf(out, "  Time:         %.3f ms reading, %.3f ms writing, %.3f ms flushing\n",
+            ms(disk.read_ns), ms(disk.write_ns), ms(disk.flush_ns));
+    fprintf(out, "  %-12s %14s %14s\n", "Region", "Read (B)", "Written (B)");
+    for (int r = 0; r < DISK_REGIONS; r++) {
+        fprintf(out, "  %-12s %14" PRIu64 " %14" PRIu64 "\n", region_names[r],
+                disk.regions[r].bytes_read, disk.regions[r].bytes_written);
+    }
+    fprintf(out, "  Cache:        %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+            " evictions, %" PRIu64 " writebacks\n",
+            cache.hits, cache.misses, cache.evictions, cache.writebacks);
+    fprintf(out, "  Journal:      %" PRIu64 " transactions, %" PRIu64 " records, %" PRIu64
+            " bytes written, %.3f ms committing\n",
+            journal.transactions, journal.records, journal.bytes_written, ms(journal.commit_ns));
+    fprintf(out, "  Checkpoints:  %" PRIu64 " (%" PRIu64 " blocks written home, %.3f ms)\n",
+            journal.checkpoints, journal.checkpoint_blocks, ms(journal.checkpoint_ns));
+    fprintf(out, "  Lookups:      %" PRIu64 " blocks read through the journal, %" PRIu64
+            " records looked at\n", journal.lookups, journal.lookup_records);
+}
+
+void iostat_print_json(FILE *out) {
+    disk_stats_t disk;
+    bcache_stats_t cache;
+    journal_stats_t journal;
+    disk_get_stats(&disk);
+    bcache_get_stats(&cache);
+    journal_get_stats(&journal);
+    
+    fprintf(out, "{\"disk\": {\"syscalls\": %" PRIu64 ", \"reads\": %" PRIu64
+            ", \"writes\": %" PRIu64 ", \"flushes\": %" PRIu64 ", \"bytes_read\": %" PRIu64
+            ", \"bytes_written\": %" PRIu64 ", \"read_ns\": %" PRIu64 ", \"write_ns\": %" PRIu64
+            ", \"flush_ns\": %" PRIu64 ", \"regions\": {",
+            disk.syscalls, disk.reads, disk.writes, disk.flushes, disk.bytes_read,
+            disk.bytes_written, disk.read_ns, disk.write_ns, disk.flush_ns);
+    for (int r = 0; r < DISK_REGIONS; r++) {
+        fprintf(out, "%s\"%s\": {\"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 "}",
+                r ? ", " : "", region_names[r],
+                disk.regions[r].bytes_read, disk.regions[r].bytes_written);
+    }
+    fprintf(out, "}}, \"cache\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+            ", \"evictions\": %" PRIu64 ", \"writebacks\": %" PRIu64 "}",
+            cache.hits, cache.misses, cache.evictions, cache.writebacks);
+    fprintf(out, ", \"journal\": {\"transactions\": %" PRIu64 ", \"records\": %" PRIu64
+            ", \"bytes_written\": %" PRIu64 ", \"commit_ns\": %" PRIu64
+            ", \"checkpoints\": %" PRIu64 ", \"checkpoint_blocks\": %" PRIu64
+            ", \"checkpoint_ns\": %" PRIu64 ", \"lookups\": %" PRIu64
+            ", \"lookup_records\": %" PRIu64 "}}\n",
+            journal.transactions, journal.records, journal.bytes_written, journal.commit_ns,
+            journal.checkpoints, journal.checkpoint_blocks, journal.checkpoint_ns,
+            journal.lookups, journal.lookup_records);
+}
+
+int iostat_dump(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        iostat_print_json(stderr);
+        return 0;
+    }
+    
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("Failed to open iostat output");
+        return -1;
+    }
+    iostat_print_json(fp);
+    if (fclose(fp) != 0) {
+        perror("Failed to write iostat output");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <stdio.h>
+
+// Report of the I/O counters kept by the disk layer, the buffer cache and
+// the journal (disk_get_stats(), bcache_get_stats(), journal_get_stats()):
+// as text for people, or as one JSON object for monitoring
+void iostat_print(FILE *out);
+void iostat_print_json(FILE *out);
+
+// Environment variable naming where commands dump the JSON report when they
+// exit: a file (overwritten), or "-" for stderr
+#define IOSTAT_ENV "VSFS_IOSTAT"
+
+// Write the JSON report to `path` ("-": stderr). Returns -1 on error.
+int iostat_dump(const char *path);
+
+#endif // IOSTAT_H
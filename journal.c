@@ -1,303 +1,1576 @@
+#define _POSIX_C_SOURCE 200112L
 #include "journal.h"
 #include "disk.h"
+#include "crc32c.h"
+#include "dir.h"
+#include "extent.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
-// Helper function to find the next free position in journal
-static int find_journal_end(void) {
-    uint8_t block[BLOCK_SIZE];
+// One logged change: a full block image, or a byte range (delta) of a block
+typedef struct {
+    uint32_t dest;            // Destination block
+    uint32_t jblock;          // Absolute block holding the image or delta bytes
+    uint16_t offset;          // Delta: byte offset within dest
+    uint16_t length;          // Delta: byte count (0 = full block image)
+    uint16_t data_offset;     // Delta: byte offset of the bytes within jblock
+    int txn;                  // Transaction the record belongs to
+    int next;                 // Next delta record of the same block, or -1
+} journal_record_t;
+
+// Where the current contents of one destination block are in the records:
+// its newest full image (-1 for the home location) and the chain of deltas
+// logged after it. Once the block has been read, `current` holds its
+// contents and later deltas are applied to it as they are logged, so a
+// block that gets a delta in every transaction (the superblock, a bitmap)
+// is not rebuilt from a growing chain.
+typedef struct {
+    uint32_t dest;
+    int used;
+    int base;
+    int first_delta;
+    int last_delta;
+    uint8_t *current;
+} journal_index_t;
+
+// Live journal contents, in log order
+typedef struct {
+    journal_superblock_t jsb;         // Journal superblock as read
+    uint32_t used;                    // Log blocks held by live transactions
+    int transactions;                 // Live transactions found
+    uint32_t torn;                    // Sequence of a discarded torn transaction, or 0
+    int num_records;
+    int max_records;
+    journal_record_t *records;
+    
+    // Destination blocks of the records, hashed by block number (open
+    // addressing; capacity is a power of two, at most half full)
+    uint32_t num_dests;
+    uint32_t index_capacity;
+    journal_index_t *index;
+    
+    // The log, read ahead: log block i is at log + i * BLOCK_SIZE. On the
+    // mmap backend it is the mapping; otherwise it is log_copy, whose blocks
+    // are read in on first use when `fetched` does not mark them yet.
+    const uint8_t *log;
+    uint8_t *log_copy;
+    uint8_t *fetched;
+} journal_scan_t;
+
+// A block a transaction has touched, with the byte ranges that were modified
+typedef struct {
+    uint32_t block_num;
+    int nranges;
+    uint32_t lo[TXN_MAX_RANGES];
+    uint32_t hi[TXN_MAX_RANGES];
+} txn_block_t;
+
+// A transaction, shared by every handle (txn_t) that joins it while it runs.
+// Handles change different bytes of its blocks; the block list itself is
+// guarded by `lock`, the rest by the manager lock.
+typedef struct transaction {
+    pthread_mutex_t lock;
+    int nblocks;
+    txn_block_t blocks[TXN_MAX_BLOCKS];
+    uint8_t *data;                    // TXN_MAX_BLOCKS block buffers
+    
+    struct transaction *prev;         // Frozen transaction read through, or NULL
+    uint32_t reserved;                // Credits of the handles still inside
+    int handles;                      // Handles still inside
+    int waiting;                      // Handles waiting for the commit
+    int full;                         // Freeze as soon as possible
+    int failed;                       // A handle left changes it could not finish
+    int done;                         // Committed or discarded; `status` is valid
+    int status;
+    int refs;
+} transaction_t;
+
+// One caller's part in the running transaction
+struct txn {
+    transaction_t *t;
+    uint32_t credits;
+    int dirty;                        // Marked bytes that cannot be taken back
+};
+
+// Transaction manager. Handles join the running transaction; the committer
+// thread freezes it once a handle waits for it (new handles wait while the
+// ones inside finish), then logs it while the next transaction runs.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;              // For the committer
+    pthread_cond_t changed;           // For handles: a transaction was frozen or done
+    transaction_t *running;
+    transaction_t *locked;            // Frozen, with handles still inside
+    transaction_t *committing;        // Being logged; new transactions read through it
+    int started;
+    int stopping;
+    pthread_t committer;
+} tm = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+// The journal as this process has left it, loaded on first use and kept
+// current by every append and checkpoint. io_lock guards it and serializes
+// the disk I/O of transactions, which may come from several threads.
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static journal_scan_t live;
+static int live_loaded = 0;
+
+// Allocation locks for the inode (0) and data (1) bitmaps
+static pthread_mutex_t alloc_locks[2] = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Journal fill level (percent of the log) that triggers an in-line
+// checkpoint before appending; 0 disables automatic checkpointing
+static uint32_t high_water_percent = JOURNAL_DEFAULT_HIGH_WATER;
+
+// Blocks with at most this many modified bytes are logged as deltas
+static uint32_t delta_max_bytes = JOURNAL_DEFAULT_DELTA_MAX;
+
+// Where progress goes (journal_set_events())
+static journal_event_fn event_fn = NULL;
+static void *event_arg = NULL;
+
+static void report(const journal_event_t *event) {
+    if (event_fn) event_fn(event, event_arg);
+}
+
+// Checkpoints made by this process
+static uint32_t installs = 0;
+
+// Counters for journal_get_stats(), updated under io_lock
+static journal_stats_t stats;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int is_journal_block(const uint8_t *block, uint32_t type, uint32_t sequence) {
+    const journal_header_t *header = (const journal_header_t *)block;
+    return header->magic == JOURNAL_MAGIC && header->type == type &&
+           header->sequence == sequence;
+}
+
+// Absolute block number of a log offset (the log wraps around)
+static uint32_t log_block(const journal_superblock_t *jsb, uint32_t offset) {
+    return jsb->log_start + offset % jsb->log_blocks;
+}
+
+static uint32_t log_used(const journal_superblock_t *jsb) {
+    if (jsb->head_sequence == jsb->tail_sequence) return 0;
+    uint32_t used = (jsb->head + jsb->log_blocks - jsb->tail) % jsb->log_blocks;
+    return used == 0 ? jsb->log_blocks : used;
+}
+
+static int read_journal_superblock(journal_superblock_t *jsb) {
+    uint8_t block[BLOCK_SIZE] BLOCK_ALIGNED;
+    
+    if (disk_read(JOURNAL_START, block) != 0) {
+        fprintf(stderr, "Error: Failed to read journal superblock\n");
+        return -1;
+    }
+    memcpy(jsb, block, sizeof(*jsb));
+    if (jsb->magic != JOURNAL_MAGIC || jsb->type != JOURNAL_SUPERBLOCK ||
+        jsb->log_start != JOURNAL_START + 1 ||
+        jsb->log_blocks == 0 || jsb->log_blocks + 1 > disk_sb.journal_blocks) {
+        fprintf(stderr, "Error: Invalid journal superblock (re-run mkfs.vsfs)\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_journal_superblock(const journal_superblock_t *jsb) {
+    uint8_t block[BLOCK_SIZE] BLOCK_ALIGNED;
+    
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, jsb, sizeof(*jsb));
+    if (disk_write(JOURNAL_START, block) != 0) {
+        fprintf(stderr, "Error: Failed to write journal superblock\n");
+        return -1;
+    }
+    stats.bytes_written += BLOCK_SIZE;
+    return 0;
+}
+
+// The runs covering `count` blocks written into the log at a log offset:
+// two when they wrap past the end. Returns the number of runs.
+static int log_runs(const journal_superblock_t *jsb, uint32_t offset,
+                    const void *const buffers[], uint32_t count, disk_run_t runs[2]) {
+    uint32_t pos = offset % jsb->log_blocks;
+    uint32_t first = jsb->log_blocks - pos;
+    if (first > count) first = count;
+    
+    runs[0].start = jsb->log_start + pos;
+    runs[0].count = first;
+    runs[0].buffers = buffers;
+    if (first == count) return 1;
+    runs[1].start = jsb->log_start;
+    runs[1].count = count - first;
+    runs[1].buffers = buffers + first;
+    return 2;
+}
+
+static void index_reset(journal_scan_t *scan);
+
+static void scan_release(journal_scan_t *scan) {
+    index_reset(scan);
+    free(scan->records);
+    free(scan->index);
+    free(scan->log_copy);
+    free(scan->fetched);
+    scan->records = NULL;
+    scan->num_records = 0;
+    scan->max_records = 0;
+    scan->index = NULL;
+    scan->num_dests = 0;
+    scan->index_capacity = 0;
+    scan->log = NULL;
+    scan->log_copy = NULL;
+    scan->fetched = NULL;
+}
+
+// Read `count` log blocks from log offset `pos` (not wrapping) into the copy
+static int read_log_blocks(journal_scan_t *scan, uint32_t pos, uint32_t count) {
+    if (count == 0) return 0;
+    if (disk_raw_read_blocks(scan->jsb.log_start + pos, count,
+                             scan->log_copy + (size_t)pos * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Error: Failed to read journal blocks %u-%u\n", pos, pos + count - 1);
+        return -1;
+    }
+    memset(scan->fetched + pos, 1, count);
+    return 0;
+}
+
+// Set up the scan's view of the log. Everything the head hint counts as live
+// is read at once, in one request (two if it wraps), so replay reads the
+// journal sequentially and never interleaves with writes home. The log is
+// only written by disk_write_batch(), so the buffer cache has no copy of it.
+static int load_log(journal_scan_t *scan) {
+    const journal_superblock_t *jsb = &scan->jsb;
+    
+    if (disk_map_block(jsb->log_start + jsb->log_blocks - 1)) {
+        scan->log = disk_map_block(jsb->log_start);
+        return 0;
+    }
     
-    // Scan through journal blocks to find first empty spot
-    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
-        if (disk_read(JOURNAL_START + i, block) != 0) {
+    if (posix_memalign((void **)&scan->log_copy, BLOCK_SIZE,
+                       (size_t)jsb->log_blocks * BLOCK_SIZE) != 0) {
+        scan->log_copy = NULL;
+    }
+    scan->fetched = calloc(jsb->log_blocks, 1);
+    if (!scan->log_copy || !scan->fetched) {
+        fprintf(stderr, "Error: Out of memory reading journal\n");
+        return -1;
+    }
+    scan->log = scan->log_copy;
+    
+    uint32_t tail = jsb->tail % jsb->log_blocks;
+    uint32_t used = log_used(jsb);
+    uint32_t first = jsb->log_blocks - tail;
+    if (first > used) first = used;
+    if (read_log_blocks(scan, tail, first) != 0) return -1;
+    return read_log_blocks(scan, 0, used - first);
+}
+
+// Block `pos` of the log. Blocks past the head hint (a transaction whose
+// superblock update was lost) are read one at a time.
+static const uint8_t *log_fetch(journal_scan_t *scan, uint32_t pos) {
+    pos %= scan->jsb.log_blocks;
+    if (scan->fetched && !scan->fetched[pos] && read_log_blocks(scan, pos, 1) != 0) {
+        return NULL;
+    }
+    return scan->log + (size_t)pos * BLOCK_SIZE;
+}
+
+static journal_index_t *index_slot(journal_index_t *index, uint32_t capacity, uint32_t dest) {
+    uint32_t slot = (dest * 2654435761u) & (capacity - 1);
+    while (index[slot].used && index[slot].dest != dest) slot = (slot + 1) & (capacity - 1);
+    return &index[slot];
+}
+
+// The index entry of `dest`, or NULL when no record writes it
+static journal_index_t *index_find(const journal_scan_t *scan, uint32_t dest) {
+    if (scan->num_dests == 0) return NULL;
+    journal_index_t *entry = index_slot(scan->index, scan->index_capacity, dest);
+    return entry->used ? entry : NULL;
+}
+
+// The index entry of `dest`, added (with no records yet) when it is new
+static journal_index_t *index_add(journal_scan_t *scan, uint32_t dest) {
+    if (2 * (scan->num_dests + 1) > scan->index_capacity) {
+        uint32_t capacity = scan->index_capacity ? scan->index_capacity * 2 : 256;
+        journal_index_t *grown = calloc(capacity, sizeof(journal_index_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory scanning journal\n");
+            return NULL;
+        }
+        for (uint32_t i = 0; i < scan->index_capacity; i++) {
+            if (scan->index[i].used) {
+                *index_slot(grown, capacity, scan->index[i].dest) = scan->index[i];
+            }
+        }
+        free(scan->index);
+        scan->index = grown;
+        scan->index_capacity = capacity;
+    }
+    
+    journal_index_t *entry = index_slot(scan->index, scan->index_capacity, dest);
+    if (!entry->used) {
+        entry->dest = dest;
+        entry->used = 1;
+        entry->base = -1;
+        entry->first_delta = -1;
+        entry->last_delta = -1;
+        scan->num_dests++;
+    }
+    return entry;
+}
+
+// Forget every record, as a checkpoint does
+static void index_reset(journal_scan_t *scan) {
+    for (uint32_t i = 0; i < scan->index_capacity; i++) free(scan->index[i].current);
+    if (scan->index) memset(scan->index, 0, scan->index_capacity * sizeof(journal_index_t));
+    scan->num_dests = 0;
+    scan->num_records = 0;
+}
+
+static int add_record(journal_scan_t *scan, const journal_record_t *record) {
+    journal_index_t *entry = index_add(scan, record->dest);
+    if (!entry) return -1;
+    if (scan->num_records == scan->max_records) {
+        int max = scan->max_records ? scan->max_records * 2 : 64;
+        journal_record_t *grown = realloc(scan->records, max * sizeof(journal_record_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory scanning journal\n");
             return -1;
         }
+        scan->records = grown;
+        scan->max_records = max;
+    }
+    
+    // A full image supersedes everything logged for the block before it
+    int i = scan->num_records++;
+    scan->records[i] = *record;
+    scan->records[i].next = -1;
+    if (record->length == 0) {
+        entry->base = i;
+        entry->first_delta = -1;
+        entry->last_delta = -1;
+        free(entry->current);
+        entry->current = NULL;
+        return 0;
+    }
+    
+    if (entry->current) {
+        const uint8_t *delta_block = log_fetch(scan, record->jblock - scan->jsb.log_start);
+        if (!delta_block) return -1;
+        memcpy(entry->current + record->offset, delta_block + record->data_offset,
+               record->length);
+    }
+    if (entry->first_delta < 0) {
+        entry->first_delta = i;
+    } else {
+        scan->records[entry->last_delta].next = i;
+    }
+    entry->last_delta = i;
+    return 0;
+}
+
+// Add the records of the transaction whose descriptor is `desc_block`, at
+// log offset `pos`, as the scan's next transaction. Full images take one
+// data block each, in tag order; delta bytes are packed into the blocks
+// after them, never straddling a block.
+static int add_records(journal_scan_t *scan, const uint8_t *desc_block, uint32_t pos) {
+    const journal_header_t *desc = (const journal_header_t *)desc_block;
+    const journal_tag_t *tags = (const journal_tag_t *)(desc_block + sizeof(journal_header_t));
+    uint32_t nr_tags = desc->nr_tags;
+    uint32_t nr_blocks = desc->nr_blocks;
+    uint32_t full_blocks = 0;
+    for (uint32_t i = 0; i < nr_tags; i++) {
+        if (tags[i].length == 0) full_blocks++;
+    }
+    
+    uint32_t next_full = 0;
+    uint32_t delta_block = full_blocks;
+    uint32_t delta_offset = 0;
+    for (uint32_t i = 0; i < nr_tags; i++) {
+        journal_record_t record;
+        record.dest = tags[i].block_num;
+        record.offset = tags[i].offset;
+        record.length = tags[i].length;
+        record.data_offset = 0;
+        record.txn = scan->transactions;
         
-        // Check if block is empty (all zeros)
-        int is_empty = 1;
-        for (int j = 0; j < BLOCK_SIZE; j++) {
-            if (block[j] != 0) {
-                is_empty = 0;
-                break;
+        if (record.length == 0) {
+            record.jblock = log_block(&scan->jsb, pos + 1 + next_full++);
+        } else {
+            if (record.offset + record.length > BLOCK_SIZE) {
+                fprintf(stderr, "Error: Corrupt delta tag in transaction %u\n", desc->sequence);
+                return -1;
+            }
+            if (delta_offset + record.length > BLOCK_SIZE) {
+                delta_block++;
+                delta_offset = 0;
             }
+            record.jblock = log_block(&scan->jsb, pos + 1 + delta_block);
+            record.data_offset = delta_offset;
+            delta_offset += record.length;
+        }
+        if (delta_block >= nr_blocks && record.length != 0) {
+            fprintf(stderr, "Error: Corrupt delta tag in transaction %u\n", desc->sequence);
+            return -1;
         }
+        if (add_record(scan, &record) != 0) return -1;
+    }
+    return 0;
+}
+
+// Collect every live transaction from the journal tail. The log ends at the
+// first transaction that is out of sequence or fails its checksum; on return
+// the scan's head fields hold the real end of the log. The caller releases
+// the scan with scan_release(), also on failure.
+static int scan_journal(journal_scan_t *scan) {
+    memset(scan, 0, sizeof(*scan));
+    if (read_journal_superblock(&scan->jsb) != 0) return -1;
+    if (load_log(scan) != 0) return -1;
+    
+    journal_superblock_t *jsb = &scan->jsb;
+    uint32_t hint_sequence = jsb->head_sequence;
+    uint32_t offset = jsb->tail;
+    uint32_t sequence = jsb->tail_sequence;
+    
+    for (;;) {
+        uint32_t pos = offset % jsb->log_blocks;
+        const uint8_t *desc_block = log_fetch(scan, pos);
+        if (!desc_block) return -1;
         
-        if (is_empty) {
-            return i;
+        const journal_header_t *desc = (const journal_header_t *)desc_block;
+        uint32_t nr_tags = desc->nr_tags;
+        uint32_t nr_blocks = desc->nr_blocks;
+        if (!is_journal_block(desc_block, JOURNAL_DESCRIPTOR, sequence) ||
+            nr_tags == 0 || nr_tags > JOURNAL_TAGS_PER_BLOCK ||
+            nr_blocks == 0 || scan->used + nr_blocks + 2 > jsb->log_blocks) {
+            break;
         }
+        
+        // The commit block's checksum covers the descriptor and every data
+        // block, so a transaction that was only partly written is rejected
+        uint32_t crc = crc32c(0, desc_block, BLOCK_SIZE);
+        const uint8_t *block = NULL;
+        for (uint32_t i = 1; i <= nr_blocks + 1; i++) {
+            block = log_fetch(scan, pos + i);
+            if (!block) return -1;
+            if (i <= nr_blocks) crc = crc32c(crc, block, BLOCK_SIZE);
+        }
+        const journal_header_t *commit = (const journal_header_t *)block;
+        if (!is_journal_block(block, JOURNAL_COMMIT, sequence) ||
+            commit->nr_tags != nr_tags || commit->nr_blocks != nr_blocks ||
+            commit->checksum != crc) {
+            break;
+        }
+        
+        if (add_records(scan, desc_block, pos) != 0) return -1;
+        scan->transactions++;
+        scan->used += nr_blocks + 2;
+        offset = pos + nr_blocks + 2;
+        sequence++;
     }
     
-    return JOURNAL_BLOCKS; // Journal full
+    // A transaction the head hint already counts was torn by a crash
+    if ((int32_t)(hint_sequence - sequence) > 0) scan->torn = sequence;
+    jsb->head = offset % jsb->log_blocks;
+    jsb->head_sequence = sequence;
+    return 0;
 }
 
-// Helper function to write a journal record at a specific journal block offset
-// For DATA records: header in one block, full 4K data in next block (uses 2 blocks)
-// For COMMIT records: just header (uses 1 block)
-static int write_journal_record_data(int journal_block_offset, uint32_t dest_block, void *data) {
-    uint8_t block[BLOCK_SIZE];
-    memset(block, 0, BLOCK_SIZE);
-    
-    // Write header block
-    journal_header_t header;
-    header.type = JOURNAL_DATA;
-    header.block_num = dest_block;
-    header.size = BLOCK_SIZE;
+// Read the current contents of a block: the newest live full image (or the
+// home location), with every later delta applied on top. Journal copies come
+// from the scan's view of the log, not the disk.
+static int journal_read_block(journal_scan_t *scan, uint32_t block_num, void *buffer) {
+    uint32_t log_start = scan->jsb.log_start;
+    journal_index_t *entry = index_find(scan, block_num);
+    stats.lookups++;
+    if (entry && entry->current) {
+        memcpy(buffer, entry->current, BLOCK_SIZE);
+        return 0;
+    }
     
-    memcpy(block, &header, sizeof(journal_header_t));
-    if (disk_write(JOURNAL_START + journal_block_offset, block) != 0) {
+    if (entry && entry->base >= 0) {
+        stats.lookup_records++;
+        const uint8_t *image = log_fetch(scan, scan->records[entry->base].jblock - log_start);
+        if (!image) return -1;
+        memcpy(buffer, image, BLOCK_SIZE);
+    } else if (disk_read(block_num, buffer) != 0) {
         return -1;
     }
     
-    // Write full data block
-    if (disk_write(JOURNAL_START + journal_block_offset + 1, data) != 0) {
-        return -1;
+    for (int i = entry ? entry->first_delta : -1; i >= 0; i = scan->records[i].next) {
+        const journal_record_t *record = &scan->records[i];
+        stats.lookup_records++;
+        const uint8_t *delta_block = log_fetch(scan, record->jblock - log_start);
+        if (!delta_block) return -1;
+        memcpy((uint8_t *)buffer + record->offset, delta_block + record->data_offset,
+               record->length);
     }
     
+    // Keep blocks with deltas; without the copy they are simply read again
+    if (entry && entry->first_delta >= 0) {
+        entry->current = malloc(BLOCK_SIZE);
+        if (entry->current) memcpy(entry->current, buffer, BLOCK_SIZE);
+    }
     return 0;
 }
 
-static int write_journal_commit(int journal_block_offset) {
-    uint8_t block[BLOCK_SIZE];
+static void make_journal_header(uint8_t *block, uint32_t type, uint32_t sequence,
+                                uint32_t nr_tags, uint32_t nr_blocks) {
     memset(block, 0, BLOCK_SIZE);
     
     journal_header_t header;
-    header.type = JOURNAL_COMMIT;
-    header.block_num = 0;
-    header.size = 0;
+    header.magic = JOURNAL_MAGIC;
+    header.type = type;
+    header.sequence = sequence;
+    header.nr_tags = nr_tags;
+    header.nr_blocks = nr_blocks;
+    header.checksum = 0;
     
     memcpy(block, &header, sizeof(journal_header_t));
-    return disk_write(JOURNAL_START + journal_block_offset, block);
 }
 
-// Create a new file (write to journal only)
-int create(const char *filename) {
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    uint8_t root_dir_block[BLOCK_SIZE];
-    inode_t inode_table[INODES_PER_BLOCK * INODE_TABLE_BLOCKS];
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Write every live transaction home and release its journal space.
+// Returns the number of blocks written, or -1 on error.
+static int checkpoint(journal_scan_t *scan, int verbose) {
+    uint64_t begin = clock_ns();
+    if (verbose) {
+        for (int i = 0; i < scan->num_records; i++) {
+            if (i + 1 == scan->num_records || scan->records[i + 1].txn != scan->records[i].txn) {
+                journal_event_t event = { .type = JOURNAL_EVENT_COMMITTED };
+                event.sequence = scan->jsb.tail_sequence + scan->records[i].txn;
+                report(&event);
+            }
+        }
+    }
     
-    printf("Creating file: %s\n", filename);
+    // Coalesce: each destination block is written once, with its final
+    // contents, and destinations are written in ascending block order
+    int survivors = 0;
+    uint32_t *dests = malloc((scan->num_dests + 1) * sizeof(uint32_t));
+    if (!dests) {
+        fprintf(stderr, "Error: Out of memory installing journal\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < scan->index_capacity; i++) {
+        if (scan->index[i].used) dests[survivors++] = scan->index[i].dest;
+    }
+    qsort(dests, survivors, sizeof(uint32_t), compare_u32);
     
-    // Read current state
-    if (disk_read(INODE_BITMAP_BLOCK, inode_bitmap) != 0) return -1;
-    if (disk_read(DATA_BITMAP_BLOCK, data_bitmap) != 0) return -1;
+    uint8_t *images = NULL;
+    const void **buffers = malloc((survivors + 1) * sizeof(void *));
+    disk_run_t *runs = malloc((survivors + 1) * sizeof(disk_run_t));
+    if (!buffers || !runs || (survivors > 0 &&
+        posix_memalign((void **)&images, BLOCK_SIZE, (size_t)survivors * BLOCK_SIZE) != 0)) {
+        fprintf(stderr, "Error: Out of memory installing journal\n");
+        free(buffers);
+        free(runs);
+        free(dests);
+        return -1;
+    }
     
-    // Read inode table
-    for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {
-        if (disk_read(INODE_TABLE_START + i, 
-                     ((uint8_t*)inode_table) + i * BLOCK_SIZE) != 0) {
-            return -1;
+    int ret = survivors;
+    for (int i = 0; i < survivors; i++) {
+        if (journal_read_block(scan, dests[i], images + (size_t)i * BLOCK_SIZE) != 0) {
+            fprintf(stderr, "Error: Failed to read journaled copy of block %u\n", dests[i]);
+            ret = -1;
+            break;
+        }
+        buffers[i] = images + (size_t)i * BLOCK_SIZE;
+        if (verbose) {
+            journal_event_t event = { .type = JOURNAL_EVENT_APPLYING, .block = dests[i] };
+            report(&event);
         }
     }
     
-    // Root inode is always inode 0
-    inode_t *root_inode = &inode_table[0];
+    // Each run of consecutive destination blocks is one vectored write; the
+    // runs go out as one batch, all in flight together, and home locations
+    // are durable before the journal copies are discarded
+    int nruns = 0;
+    for (int i = 0; i < survivors; ) {
+        int len = 1;
+        while (i + len < survivors && dests[i + len] == dests[i] + len) len++;
+        runs[nruns].start = dests[i];
+        runs[nruns].count = len;
+        runs[nruns].buffers = buffers + i;
+        nruns++;
+        i += len;
+    }
+    if (ret >= 0 && disk_write_batch(runs, nruns, DISK_BATCH_BARRIER) != 0) {
+        fprintf(stderr, "Error: Failed to write %d blocks home\n", survivors);
+        ret = -1;
+    }
+    free(images);
+    free(buffers);
+    free(runs);
+    free(dests);
+    if (ret < 0) return -1;
     
-    // Read root directory data
-    if (root_inode->blocks[0] == 0) {
-        fprintf(stderr, "Error: Root directory has no data block\n");
+    // Release the journal: advancing the tail retires every installed
+    // transaction, and their sequence numbers are never live again
+    if (verbose) {
+        journal_event_t event = { .type = JOURNAL_EVENT_RELEASING };
+        report(&event);
+    }
+    scan->jsb.tail = scan->jsb.head;
+    scan->jsb.tail_sequence = scan->jsb.head_sequence;
+    if (write_journal_superblock(&scan->jsb) != 0) return -1;
+    if (disk_sync() != 0) return -1;
+    
+    scan->used = 0;
+    index_reset(scan);
+    scan->transactions = 0;
+    installs++;
+    stats.checkpoints++;
+    stats.checkpoint_blocks += ret;
+    stats.checkpoint_ns += clock_ns() - begin;
+    return ret;
+}
+
+// Append one transaction at the journal head. Descriptor, data and commit go
+// out as one batch with a single barrier: the checksum in the commit
+// block makes the transaction count only once all of it is durable.
+// `desc_block` must already hold the tags.
+static int journal_append(journal_scan_t *scan, uint8_t *desc_block, uint32_t nr_tags,
+                          const void *const blocks[], uint32_t nr_blocks) {
+    uint8_t commit_block[BLOCK_SIZE] BLOCK_ALIGNED;
+    uint8_t jsb_block[BLOCK_SIZE] BLOCK_ALIGNED;
+    journal_superblock_t *jsb = &scan->jsb;
+    
+    uint32_t needed = nr_blocks + 2;
+    if (needed > jsb->log_blocks) {
+        fprintf(stderr, "Error: Transaction too large for journal (need %u blocks, journal has %u)\n",
+                needed, jsb->log_blocks);
         return -1;
     }
-    if (disk_read(root_inode->blocks[0], root_dir_block) != 0) return -1;
     
-    // Check if file already exists
-    dirent_t *entries = (dirent_t *)root_dir_block;
-    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inum != 0 && strcmp(entries[i].name, filename) == 0) {
-            fprintf(stderr, "Error: File '%s' already exists\n", filename);
+    // Past the high-water mark, make room by checkpointing in line
+    if (high_water_percent > 0 && scan->used > 0 &&
+        (scan->used + needed) * 100 > jsb->log_blocks * high_water_percent) {
+        int transactions = scan->transactions;
+        jsb->forced_checkpoints++;
+        int written = checkpoint(scan, 0);
+        if (written < 0) {
+            fprintf(stderr, "Error: Automatic checkpoint failed\n");
             return -1;
         }
+        journal_event_t event = { .type = JOURNAL_EVENT_CHECKPOINTED };
+        event.transactions = (uint32_t)transactions;
+        event.blocks = (uint32_t)written;
+        report(&event);
     }
     
-    // Find free inode
-    int free_inum = bitmap_find_free(inode_bitmap, MAX_INODES);
-    if (free_inum < 0) {
-        fprintf(stderr, "Error: No free inodes\n");
+    if (needed > jsb->log_blocks - scan->used) {
+        fprintf(stderr, "Error: Not enough journal space (need %u blocks, have %u available)\n",
+                needed, jsb->log_blocks - scan->used);
         return -1;
     }
     
-    // Find free data block for the new file
-    int free_data_block = bitmap_find_free(data_bitmap, DATA_BLOCKS_COUNT);
-    if (free_data_block < 0) {
-        fprintf(stderr, "Error: No free data blocks\n");
+    const void **records = malloc(needed * sizeof(void *));
+    if (!records) {
+        fprintf(stderr, "Error: Out of memory writing journal\n");
         return -1;
     }
     
-    // Find free directory entry
-    int free_dirent = -1;
-    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inum == 0) {
-            free_dirent = i;
-            break;
+    // Header fields are filled in here; the tags are already in place
+    journal_header_t *desc = (journal_header_t *)desc_block;
+    desc->magic = JOURNAL_MAGIC;
+    desc->type = JOURNAL_DESCRIPTOR;
+    desc->sequence = jsb->head_sequence;
+    desc->nr_tags = nr_tags;
+    desc->nr_blocks = nr_blocks;
+    desc->checksum = 0;
+    make_journal_header(commit_block, JOURNAL_COMMIT, jsb->head_sequence, nr_tags, nr_blocks);
+    
+    uint32_t crc = crc32c(0, desc_block, BLOCK_SIZE);
+    for (uint32_t i = 0; i < nr_blocks; i++) crc = crc32c(crc, blocks[i], BLOCK_SIZE);
+    ((journal_header_t *)commit_block)->checksum = crc;
+    
+    records[0] = desc_block;
+    memcpy(records + 1, blocks, nr_blocks * sizeof(void *));
+    records[1 + nr_blocks] = commit_block;
+    
+    // The head is only a hint, so the superblock goes out in the same batch
+    // as the transaction and shares its barrier
+    journal_superblock_t next = *jsb;
+    next.head = (jsb->head + needed) % jsb->log_blocks;
+    next.head_sequence++;
+    memset(jsb_block, 0, BLOCK_SIZE);
+    memcpy(jsb_block, &next, sizeof(next));
+    
+    disk_run_t runs[3];
+    const void *jsb_buffers[1] = { jsb_block };
+    int nruns = log_runs(jsb, jsb->head, records, needed, runs);
+    runs[nruns].start = JOURNAL_START;
+    runs[nruns].count = 1;
+    runs[nruns].buffers = jsb_buffers;
+    nruns++;
+    
+    uint64_t begin = clock_ns();
+    int ret = disk_write_batch(runs, nruns, DISK_BATCH_BARRIER);
+    stats.commit_ns += clock_ns() - begin;
+    if (ret == 0 && scan->log_copy) {
+        // The copy of the log stays current (a mapping already is)
+        for (uint32_t i = 0; i < needed; i++) {
+            uint32_t pos = (jsb->head + i) % jsb->log_blocks;
+            memcpy(scan->log_copy + (size_t)pos * BLOCK_SIZE, records[i], BLOCK_SIZE);
+            scan->fetched[pos] = 1;
         }
     }
-    if (free_dirent < 0) {
-        fprintf(stderr, "Error: Directory full\n");
+    free(records);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Failed to write transaction to journal\n");
         return -1;
     }
     
-    // Now create the journal entries
-    int journal_pos = find_journal_end();
-    if (journal_pos < 0) {
-        fprintf(stderr, "Error: Failed to find journal position\n");
+    uint32_t start = jsb->head;
+    *jsb = next;
+    stats.transactions++;
+    stats.records += nr_tags;
+    stats.bytes_written += (uint64_t)(needed + 1) * BLOCK_SIZE;
+    
+    // The scan stays current, so later reads and checkpoints can use it
+    if (add_records(scan, desc_block, start) != 0) return -1;
+    scan->transactions++;
+    scan->used += needed;
+    journal_event_t event = { .type = JOURNAL_EVENT_LOGGED, .sequence = jsb->head_sequence - 1 };
+    event.first = start;
+    event.last = (start + needed - 1) % jsb->log_blocks;
+    report(&event);
+    return 0;
+}
+
+// Load the live journal on first use; io_lock must be held
+static int load_live(void) {
+    if (live_loaded) return 0;
+    if (scan_journal(&live) != 0) {
+        fprintf(stderr, "Error: Failed to scan journal\n");
+        scan_release(&live);
         return -1;
     }
-    // Each DATA record takes 2 blocks, COMMIT takes 1
-    // We need: 5 DATA records (10 blocks) + 1 COMMIT (1 block) = 11 blocks total
-    if (journal_pos + 11 > JOURNAL_BLOCKS) {
-        fprintf(stderr, "Error: Not enough journal space (need 11 blocks, have %d available)\n", 
-                JOURNAL_BLOCKS - journal_pos);
-        return -1;
+    live_loaded = 1;
+    return 0;
+}
+
+static int find_block(const transaction_t *t, uint32_t block_num) {
+    for (int i = 0; i < t->nblocks; i++) {
+        if (t->blocks[i].block_num == block_num) return i;
+    }
+    return -1;
+}
+
+// A transaction that reads through `prev` (which may be NULL). The manager
+// lock must be held.
+static transaction_t *new_transaction(transaction_t *prev) {
+    transaction_t *t = calloc(1, sizeof(transaction_t));
+    if (!t) {
+        fprintf(stderr, "Error: Out of memory starting transaction\n");
+        return NULL;
+    }
+    if (posix_memalign((void **)&t->data, BLOCK_SIZE, (size_t)TXN_MAX_BLOCKS * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Error: Out of memory starting transaction\n");
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->prev = prev;
+    if (prev) prev->refs++;
+    t->refs = 1;                      // The manager's, dropped once it is done
+    return t;
+}
+
+// Drop a reference to a transaction; the manager lock must be held
+static void put_transaction(transaction_t *t) {
+    if (--t->refs > 0) return;
+    if (t->prev) put_transaction(t->prev);
+    pthread_mutex_destroy(&t->lock);
+    free(t->data);
+    free(t);
+}
+
+// Current contents of a block the transaction does not hold yet. The frozen
+// transaction it follows has the newest copy of every block it touched (and
+// is not changed any more); the journal or home location has the rest.
+static int read_current(const transaction_t *t, uint32_t block_num, void *buffer) {
+    const transaction_t *prev = t->prev;
+    int i = prev ? find_block(prev, block_num) : -1;
+    if (i >= 0) {
+        memcpy(buffer, prev->data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
     }
     
-    printf("  Allocating inode %d, data block %d\n", free_inum, free_data_block);
+    pthread_mutex_lock(&io_lock);
+    int ret = load_live();
+    if (ret == 0) ret = journal_read_block(&live, block_num, buffer);
+    pthread_mutex_unlock(&io_lock);
+    return ret;
+}
+
+// Log a frozen transaction. Only what was marked is logged, as byte-range
+// deltas when small.
+static int commit_transaction(transaction_t *t) {
+    uint8_t desc_block[BLOCK_SIZE] BLOCK_ALIGNED;
+    const void *blocks[2 * TXN_MAX_BLOCKS];
+    uint8_t *deltas = NULL;
+    uint32_t nr_tags = 0;
+    uint32_t nr_full = 0;
+    uint32_t delta_bytes = 0;
+    int use_delta[TXN_MAX_BLOCKS];
     
-    // Prepare modified blocks
-    // 1. Inode bitmap
-    bitmap_set(inode_bitmap, free_inum);
+    memset(desc_block, 0, BLOCK_SIZE);
+    journal_tag_t *tags = (journal_tag_t *)(desc_block + sizeof(journal_header_t));
     
-    // 2. Data bitmap
-    bitmap_set(data_bitmap, free_data_block);
+    // Full images first: one tag and one data block per block
+    for (int i = 0; i < t->nblocks; i++) {
+        const txn_block_t *block = &t->blocks[i];
+        uint32_t dirty = 0;
+        for (int r = 0; r < block->nranges; r++) dirty += block->hi[r] - block->lo[r];
+        
+        use_delta[i] = dirty > 0 && dirty <= delta_max_bytes;
+        if (dirty == 0 || use_delta[i]) {
+            delta_bytes += use_delta[i] ? dirty : 0;
+            continue;
+        }
+        tags[nr_tags].block_num = block->block_num;
+        tags[nr_tags].offset = 0;
+        tags[nr_tags].length = 0;
+        nr_tags++;
+        blocks[nr_full++] = t->data + (size_t)i * BLOCK_SIZE;
+    }
     
-    // 3. Inode table - create new inode
-    inode_t *new_inode = &inode_table[free_inum];
-    memset(new_inode, 0, sizeof(inode_t));
-    new_inode->type = T_FILE;
-    new_inode->size = 0;
-    new_inode->nlink = 1;
-    new_inode->blocks[0] = DATA_BLOCKS_START + free_data_block;
+    // Then the deltas: byte ranges packed into the blocks after the images
+    uint32_t nr_blocks = nr_full;
+    if (delta_bytes > 0) {
+        size_t delta_size = (size_t)TXN_MAX_BLOCKS * BLOCK_SIZE;
+        if (posix_memalign((void **)&deltas, BLOCK_SIZE, delta_size) != 0) {
+            fprintf(stderr, "Error: Out of memory committing transaction\n");
+            return -1;
+        }
+        memset(deltas, 0, delta_size);
+        
+        uint8_t *delta_block = deltas;
+        uint32_t offset = 0;
+        blocks[nr_blocks++] = delta_block;
+        for (int i = 0; i < t->nblocks; i++) {
+            if (!use_delta[i]) continue;
+            const txn_block_t *block = &t->blocks[i];
+            for (int r = 0; r < block->nranges; r++) {
+                uint32_t length = block->hi[r] - block->lo[r];
+                if (offset + length > BLOCK_SIZE) {
+                    delta_block += BLOCK_SIZE;
+                    blocks[nr_blocks++] = delta_block;
+                    offset = 0;
+                }
+                memcpy(delta_block + offset, t->data + (size_t)i * BLOCK_SIZE + block->lo[r],
+                       length);
+                tags[nr_tags].block_num = block->block_num;
+                tags[nr_tags].offset = block->lo[r];
+                tags[nr_tags].length = length;
+                nr_tags++;
+                offset += length;
+            }
+        }
+    }
     
-    // 4. Root directory - add entry
-    strncpy(entries[free_dirent].name, filename, MAX_FILENAME - 1);
-    entries[free_dirent].name[MAX_FILENAME - 1] = '\0';
-    entries[free_dirent].inum = free_inum;
-    root_inode->size += sizeof(dirent_t);
+    int ret = 0;
+    if (nr_tags > 0) {
+        pthread_mutex_lock(&io_lock);
+        ret = load_live();
+        if (ret == 0) ret = journal_append(&live, desc_block, nr_tags, blocks, nr_blocks);
+        pthread_mutex_unlock(&io_lock);
+    }
     
-    // Write journal records
-    int journal_start = journal_pos;
+    free(deltas);
+    return ret;
+}
+
+// The committer: freeze the running transaction once a handle waits for it
+// (or it is full), let the handles inside finish, then log it while new
+// handles fill the next one
+static void *committer_main(void *arg) {
+    (void)arg;
     
-    // DATA record 1: Inode bitmap
-    if (write_journal_record_data(journal_pos, INODE_BITMAP_BLOCK, inode_bitmap) != 0) {
-        fprintf(stderr, "Error: Failed to write inode bitmap to journal\n");
+    pthread_mutex_lock(&tm.lock);
+    for (;;) {
+        transaction_t *t = tm.running;
+        if (!t || (t->waiting == 0 && !t->full)) {
+            if (tm.stopping) break;
+            pthread_cond_wait(&tm.wake, &tm.lock);
+            continue;
+        }
+        
+        tm.running = NULL;
+        tm.locked = t;
+        while (t->handles > 0) pthread_cond_wait(&tm.wake, &tm.lock);
+        tm.locked = NULL;
+        
+        // What this transaction read through must have been logged first
+        if (t->prev && t->prev->status != 0) t->failed = 1;
+        tm.committing = t->failed ? NULL : t;
+        pthread_cond_broadcast(&tm.changed);
+        pthread_mutex_unlock(&tm.lock);
+        
+        int status = t->failed ? -1 : commit_transaction(t);
+        
+        pthread_mutex_lock(&tm.lock);
+        if (tm.committing == t) tm.committing = NULL;
+        t->status = status;
+        t->done = 1;
+        pthread_cond_broadcast(&tm.changed);
+        put_transaction(t);
+    }
+    pthread_mutex_unlock(&tm.lock);
+    return NULL;
+}
+
+// Start the committer on first use; the manager lock must be held
+static int start_committer(void) {
+    if (tm.started) return 0;
+    if (pthread_create(&tm.committer, NULL, committer_main, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to start the journal committer\n");
         return -1;
     }
-    journal_pos += 2;
+    tm.started = 1;
+    return 0;
+}
+
+// Join the running transaction, starting one if there is none, with room
+// for `credits` more blocks. Waits while a frozen transaction still has
+// handles inside, and while the running one is full. The manager lock must
+// be held.
+static transaction_t *join_running(uint32_t credits) {
+    for (;;) {
+        transaction_t *t = tm.running;
+        if (!t && !tm.locked) {
+            t = new_transaction(tm.committing);
+            if (!t) return NULL;
+            tm.running = t;
+        }
+        
+        if (t) {
+            pthread_mutex_lock(&t->lock);
+            int room = t->nblocks + t->reserved + credits <= TXN_MAX_BLOCKS;
+            pthread_mutex_unlock(&t->lock);
+            if (room && !t->full) {
+                t->handles++;
+                t->reserved += credits;
+                t->refs++;
+                return t;
+            }
+            t->full = 1;
+            pthread_cond_signal(&tm.wake);
+        }
+        pthread_cond_wait(&tm.changed, &tm.lock);
+    }
+}
+
+// Take a handle out of its transaction; the manager lock must be held
+static void leave_transaction(txn_t *txn) {
+    transaction_t *t = txn->t;
+    t->handles--;
+    t->reserved -= txn->credits;
+    pthread_cond_signal(&tm.wake);
+}
+
+txn_t *txn_begin(uint32_t credits) {
+    txn_t *txn = calloc(1, sizeof(txn_t));
+    if (!txn) {
+        fprintf(stderr, "Error: Out of memory starting transaction\n");
+        return NULL;
+    }
+    txn->credits = credits < TXN_MAX_BLOCKS ? credits : TXN_MAX_BLOCKS;
     
-    // DATA record 2: Data bitmap
-    if (write_journal_record_data(journal_pos, DATA_BITMAP_BLOCK, data_bitmap) != 0) {
-        fprintf(stderr, "Error: Failed to write data bitmap to journal\n");
-        return -1;
+    pthread_mutex_lock(&tm.lock);
+    if (start_committer() == 0) txn->t = join_running(txn->credits);
+    pthread_mutex_unlock(&tm.lock);
+    
+    if (!txn->t) {
+        free(txn);
+        return NULL;
     }
-    journal_pos += 2;
+    return txn;
+}
+
+void txn_abort(txn_t *txn) {
+    if (!txn) return;
+    transaction_t *t = txn->t;
     
-    // DATA records 3-4: Inode table blocks
-    for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {
-        if (write_journal_record_data(journal_pos, INODE_TABLE_START + i,
-                                     ((uint8_t*)inode_table) + i * BLOCK_SIZE) != 0) {
-            fprintf(stderr, "Error: Failed to write inode table block %d to journal\n", i);
-            return -1;
+    // Other handles share the blocks, so changes cannot be taken back one
+    // handle at a time: the whole transaction fails with them
+    pthread_mutex_lock(&tm.lock);
+    if (txn->dirty) {
+        t->failed = 1;
+        t->full = 1;
+    }
+    leave_transaction(txn);
+    put_transaction(t);
+    pthread_mutex_unlock(&tm.lock);
+    free(txn);
+}
+
+int txn_commit(txn_t *txn) {
+    transaction_t *t = txn->t;
+    
+    pthread_mutex_lock(&tm.lock);
+    leave_transaction(txn);
+    t->waiting++;
+    while (!t->done) pthread_cond_wait(&tm.changed, &tm.lock);
+    int status = t->status;
+    int failed = t->failed;
+    put_transaction(t);
+    pthread_mutex_unlock(&tm.lock);
+    free(txn);
+    
+    if (failed) fprintf(stderr, "Error: Transaction aborted; nothing in it was logged\n");
+    return status;
+}
+
+void *txn_get_block(txn_t *txn, uint32_t block_num) {
+    transaction_t *t = txn->t;
+    uint8_t *data = NULL;
+    
+    pthread_mutex_lock(&t->lock);
+    int i = find_block(t, block_num);
+    if (i >= 0) {
+        data = t->data + (size_t)i * BLOCK_SIZE;
+    } else if (t->nblocks == TXN_MAX_BLOCKS) {
+        fprintf(stderr, "Error: Transaction touches too many blocks (max %d)\n", TXN_MAX_BLOCKS);
+    } else {
+        data = t->data + (size_t)t->nblocks * BLOCK_SIZE;
+        if (read_current(t, block_num, data) == 0) {
+            txn_block_t *block = &t->blocks[t->nblocks++];
+            block->block_num = block_num;
+            block->nranges = 0;
+        } else {
+            data = NULL;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return data;
+}
+
+// Record bytes [lo, hi) of a block as modified
+static void add_range(txn_block_t *block, uint32_t lo, uint32_t hi) {
+    // Merge with an overlapping or adjacent range, else add a new one; when
+    // out of slots, grow the closest range to cover the new one
+    int target = -1;
+    uint32_t best_gap = UINT32_MAX;
+    for (int i = 0; i < block->nranges; i++) {
+        uint32_t gap = hi < block->lo[i] ? block->lo[i] - hi :
+                       lo > block->hi[i] ? lo - block->hi[i] : 0;
+        if (gap < best_gap) {
+            best_gap = gap;
+            target = i;
         }
-        journal_pos += 2;
     }
     
-    // DATA record 5: Root directory
-    if (write_journal_record_data(journal_pos, root_inode->blocks[0], root_dir_block) != 0) {
-        fprintf(stderr, "Error: Failed to write root directory to journal\n");
-        return -1;
+    if (target < 0 || (best_gap > 0 && block->nranges < TXN_MAX_RANGES)) {
+        block->lo[block->nranges] = lo;
+        block->hi[block->nranges] = hi;
+        block->nranges++;
+        return;
     }
-    journal_pos += 2;
     
-    // COMMIT record
-    if (write_journal_commit(journal_pos) != 0) {
-        fprintf(stderr, "Error: Failed to write commit record\n");
-        return -1;
+    if (lo < block->lo[target]) block->lo[target] = lo;
+    if (hi > block->hi[target]) block->hi[target] = hi;
+    
+    // The grown range may now overlap others
+    for (int i = 0; i < block->nranges; i++) {
+        if (i == target || block->hi[i] < block->lo[target] || block->lo[i] > block->hi[target]) {
+            continue;
+        }
+        if (block->lo[i] < block->lo[target]) block->lo[target] = block->lo[i];
+        if (block->hi[i] > block->hi[target]) block->hi[target] = block->hi[i];
+        block->nranges--;
+        block->lo[i] = block->lo[block->nranges];
+        block->hi[i] = block->hi[block->nranges];
+        if (target == block->nranges) target = i;
+        i = -1;
     }
-    journal_pos += 1;
+}
+
+void txn_mark_dirty(txn_t *txn, const void *ptr, size_t len) {
+    transaction_t *t = txn->t;
+    size_t pos = (const uint8_t *)ptr - t->data;
+    uint32_t lo = pos % BLOCK_SIZE;
     
-    printf("  Transaction logged to journal (blocks %d-%d)\n", 
-           journal_start, journal_pos - 1);
+    pthread_mutex_lock(&t->lock);
+    add_range(&t->blocks[pos / BLOCK_SIZE], lo, lo + len);
+    txn->dirty = 1;
+    pthread_mutex_unlock(&t->lock);
+}
+
+const void *txn_peek_block(txn_t *txn, uint32_t block_num, void *buffer) {
+    transaction_t *t = txn->t;
     
-    return 0;
+    pthread_mutex_lock(&t->lock);
+    int i = find_block(t, block_num);
+    pthread_mutex_unlock(&t->lock);
+    if (i >= 0) return t->data + (size_t)i * BLOCK_SIZE;
+    if (read_current(t, block_num, buffer) != 0) return NULL;
+    return buffer;
 }
 
-// Install journaled transactions to the file system
-int install(void) {
-    uint8_t header_block[BLOCK_SIZE];
-    uint8_t data_block[BLOCK_SIZE];
-    journal_header_t *header;
+// Allocate `len` consecutive free bits of the inode (data = 0) or data
+// bitmap. The search starts at the superblock's rotor and wraps around,
+// skipping groups whose free count is too low without reading their bitmap
+// blocks; the rotor and free counts are updated in the same transaction. A
+// run never spans two bitmap blocks. The bitmap's allocation lock must be
+// held.
+static int64_t claim_bits(txn_t *txn, int data, uint32_t len) {
+    uint8_t block[BLOCK_SIZE] BLOCK_ALIGNED;
+    uint8_t *sb_block = txn_get_block(txn, SUPERBLOCK_BLOCK);
+    if (!sb_block) return -1;
     
-    printf("Installing journal transactions...\n");
+    superblock_t *sb = (superblock_t *)sb_block;
+    uint32_t first_block = data ? sb->data_bitmap_block : sb->inode_bitmap_block;
+    uint32_t nbits = data ? sb->data_blocks_count : sb->num_inodes;
+    uint32_t *rotor = data ? &sb->data_rotor : &sb->inode_rotor;
+    uint32_t *total = data ? &sb->free_blocks : &sb->free_inodes;
+    uint32_t nblocks = (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint32_t goal = *rotor < nbits ? *rotor : 0;
     
-    int transactions = 0;
-    int records_applied = 0;
-    int journal_idx = 0;
+    if (*total < len) return -1;
     
-    // Scan through journal
-    while (journal_idx < JOURNAL_BLOCKS) {
-        // Read journal block (header)
-        if (disk_read(JOURNAL_START + journal_idx, header_block) != 0) {
-            fprintf(stderr, "Error: Failed to read journal block %d\n", journal_idx);
-            return -1;
-        }
+    // The goal's block is visited again from its start after wrapping
+    for (uint32_t i = 0; i <= nblocks; i++) {
+        uint32_t b = (goal / BITS_PER_BLOCK + i) % nblocks;
+        uint64_t first_bit = (uint64_t)b * BITS_PER_BLOCK;
+        uint32_t *group = summary_free(sb_block, data, first_bit);
+        if (*group < len) continue;
         
-        header = (journal_header_t *)header_block;
+        uint32_t from = i == 0 ? goal % BITS_PER_BLOCK : 0;
+        uint32_t bits = nbits - b * BITS_PER_BLOCK;
+        if (bits > BITS_PER_BLOCK) bits = BITS_PER_BLOCK;
         
-        // Check if we've reached empty space
-        if (header->type == 0) {
-            break;
-        }
+        // Blocks already in the transaction hold its earlier allocations. A
+        // bitmap block is only added to it once a free run is found there,
+        // so a search over many full blocks does not use up its slots.
+        const uint8_t *bitmap = txn_peek_block(txn, first_block + b, block);
+        if (!bitmap) return -1;
         
-        // Process based on type
-        if (header->type == JOURNAL_DATA) {
-            // Ensure we have room for data block
-            if (journal_idx + 1 >= JOURNAL_BLOCKS) {
-                fprintf(stderr, "Error: Incomplete DATA record at journal block %d\n", journal_idx);
-                break;
-            }
-            
-            // Read the data block (next journal block)
-            if (disk_read(JOURNAL_START + journal_idx + 1, data_block) != 0) {
-                fprintf(stderr, "Error: Failed to read data block at journal %d\n", journal_idx + 1);
-                return -1;
-            }
-            
-            uint32_t dest_block_num = header->block_num;
-            printf("  Applying DATA record: block %d\n", dest_block_num);
-            
-            // Write the data to its destination
-            if (disk_write(dest_block_num, data_block) != 0) {
-                fprintf(stderr, "Error: Failed to write block %d\n", dest_block_num);
-                return -1;
-            }
-            
-            records_applied++;
-            journal_idx += 2; // DATA record uses 2 blocks
-            
-        } else if (header->type == JOURNAL_COMMIT) {
-            printf("  Found COMMIT record (transaction %d complete)\n", transactions + 1);
-            transactions++;
-            journal_idx += 1; // COMMIT uses 1 block
-            
-        } else {
-            fprintf(stderr, "Warning: Unknown journal record type %d at block %d\n", 
-                   header->type, journal_idx);
-            break;
+        int64_t bit = bitmap_find_free_run(bitmap, from, bits, len);
+        if (bit < 0) continue;
+        
+        uint8_t *owned = txn_get_block(txn, first_block + b);
+        if (!owned) return -1;
+        for (uint32_t j = 0; j < len; j++) bitmap_set(owned, (uint32_t)bit + j);
+        txn_mark_dirty(txn, &owned[bit / 8], (bit + len - 1) / 8 - bit / 8 + 1);
+        
+        uint64_t next = first_bit + bit + len;
+        *rotor = next < nbits ? (uint32_t)next : 0;
+        *total -= len;
+        *group -= len;
+        txn_mark_dirty(txn, rotor, sizeof(*rotor));
+        txn_mark_dirty(txn, total, sizeof(*total));
+        txn_mark_dirty(txn, group, sizeof(*group));
+        return (int64_t)(first_bit + bit);
+    }
+    return -1;
+}
+
+// Handles allocate concurrently: each bitmap (with its rotor and free
+// counts) is searched by one thread at a time
+static int64_t alloc_bits(txn_t *txn, int data, uint32_t len) {
+    pthread_mutex_lock(&alloc_locks[data]);
+    int64_t bit = claim_bits(txn, data, len);
+    pthread_mutex_unlock(&alloc_locks[data]);
+    return bit;
+}
+
+// Give back `len` bits from `bit`, all in one bitmap block
+static int free_bits(txn_t *txn, int data, uint64_t bit, uint32_t len) {
+    int ret = -1;
+    
+    pthread_mutex_lock(&alloc_locks[data]);
+    uint8_t *sb_block = txn_get_block(txn, SUPERBLOCK_BLOCK);
+    superblock_t *sb = (superblock_t *)sb_block;
+    uint8_t *bitmap = NULL;
+    if (sb_block) {
+        uint32_t first_block = data ? sb->data_bitmap_block : sb->inode_bitmap_block;
+        bitmap = txn_get_block(txn, first_block + (uint32_t)(bit / BITS_PER_BLOCK));
+    }
+    if (bitmap) {
+        uint32_t from = bit % BITS_PER_BLOCK;
+        for (uint32_t j = 0; j < len; j++) bitmap_clear(bitmap, from + j);
+        txn_mark_dirty(txn, &bitmap[from / 8], (from + len - 1) / 8 - from / 8 + 1);
+        
+        uint32_t *total = data ? &sb->free_blocks : &sb->free_inodes;
+        uint32_t *group = summary_free(sb_block, data, bit);
+        *total += len;
+        *group += len;
+        txn_mark_dirty(txn, total, sizeof(*total));
+        txn_mark_dirty(txn, group, sizeof(*group));
+        ret = 0;
+    }
+    pthread_mutex_unlock(&alloc_locks[data]);
+    return ret;
+}
+
+int64_t txn_alloc_inode(txn_t *txn) {
+    int64_t inum = alloc_bits(txn, 0, 1);
+    if (inum < 0) fprintf(stderr, "Error: No free inodes\n");
+    return inum;
+}
+
+int64_t txn_alloc_data(txn_t *txn, uint32_t count) {
+    int64_t bit = alloc_bits(txn, 1, count);
+    if (bit < 0) fprintf(stderr, "Error: No free data blocks\n");
+    return bit;
+}
+
+int64_t txn_alloc_data_upto(txn_t *txn, uint32_t max, uint32_t *count) {
+    // A run never spans two bitmap blocks
+    uint32_t len = max < BITS_PER_BLOCK ? max : BITS_PER_BLOCK;
+    for (; len > 0; len /= 2) {
+        int64_t bit = alloc_bits(txn, 1, len);
+        if (bit >= 0) {
+            *count = len;
+            return bit;
         }
     }
+    return -1;
+}
+
+int txn_free_data(txn_t *txn, uint32_t start, uint32_t count) {
+    uint64_t bit = start - disk_sb.data_blocks_start;
+    while (count > 0) {
+        uint32_t len = BITS_PER_BLOCK - (uint32_t)(bit % BITS_PER_BLOCK);
+        if (len > count) len = count;
+        if (free_bits(txn, 1, bit, len) != 0) return -1;
+        bit += len;
+        count -= len;
+    }
+    return 0;
+}
+
+void *txn_alloc_block(txn_t *txn, uint32_t *block_num) {
+    int64_t bit = txn_alloc_data(txn, 1);
+    if (bit < 0) return NULL;
+    
+    *block_num = disk_sb.data_blocks_start + (uint32_t)bit;
+    uint8_t *block = txn_get_block(txn, *block_num);
+    if (!block) return NULL;
+    memset(block, 0, BLOCK_SIZE);
+    txn_mark_dirty(txn, block, BLOCK_SIZE);
+    return block;
+}
+
+void journal_set_high_water(uint32_t percent) {
+    high_water_percent = percent > 100 ? 100 : percent;
+}
+
+void journal_set_delta_max(uint32_t bytes) {
+    delta_max_bytes = bytes > BLOCK_SIZE ? BLOCK_SIZE : bytes;
+}
+
+void journal_set_events(journal_event_fn fn, void *arg) {
+    event_fn = fn;
+    event_arg = arg;
+}
+
+uint32_t journal_installs(void) {
+    return installs;
+}
+
+void journal_get_stats(journal_stats_t *out) {
+    pthread_mutex_lock(&io_lock);
+    *out = stats;
+    pthread_mutex_unlock(&io_lock);
+}
+
+int journal_get_info(journal_info_t *info) {
+    journal_superblock_t jsb;
+    
+    pthread_mutex_lock(&io_lock);
+    int ret = read_journal_superblock(&jsb);
+    pthread_mutex_unlock(&io_lock);
+    if (ret != 0) return -1;
+    
+    info->log_blocks = jsb.log_blocks;
+    info->used_blocks = log_used(&jsb);
+    info->live_transactions = jsb.head_sequence - jsb.tail_sequence;
+    info->forced_checkpoints = jsb.forced_checkpoints;
+    return 0;
+}
+
+// Initialize an empty journal (used by mkfs, once disk_sb is loaded)
+int journal_format(void) {
+    journal_superblock_t jsb;
+    
+    memset(&jsb, 0, sizeof(jsb));
+    jsb.magic = JOURNAL_MAGIC;
+    jsb.type = JOURNAL_SUPERBLOCK;
+    jsb.log_start = JOURNAL_START + 1;
+    jsb.log_blocks = disk_sb.journal_blocks - 1;
+    jsb.tail_sequence = 1;
+    jsb.head_sequence = 1;
+    return write_journal_superblock(&jsb);
+}
+
+// Create a new file (write to journal only)
+int create(const char *filename) {
+    return create_batch(&filename, 1);
+}
+
+// A file being created: its name, and the inode and data block allocated
+// for it (-1 until they are)
+typedef struct {
+    const char *name;
+    int64_t inum;
+    int64_t data;
+} new_file_t;
+
+// Blocks a group of creates may add to a transaction: the superblock, the
+// bitmap blocks, the root inode's table block and the directory index root,
+// then per name at worst its inode's table block, an index node, a leaf,
+// and the new leaf and index node of a split
+#define CREATE_FIXED_CREDITS 8
+#define CREATE_NAME_CREDITS 5
+#define CREATE_GROUP_FILES ((TXN_MAX_BLOCKS - CREATE_FIXED_CREDITS) / CREATE_NAME_CREDITS)
+
+static uint32_t create_credits(int count) {
+    return CREATE_FIXED_CREDITS + CREATE_NAME_CREDITS * (uint32_t)count;
+}
+
+// Allocate and fill in the inode of one new file. Nothing here needs the
+// directory lock, so concurrent creators do this side by side.
+static int create_inode(txn_t *txn, new_file_t *file) {
+    // Prepare modified blocks, marking exactly the bytes that change
+    // 1. Inode bitmap - allocate an inode
+    file->inum = txn_alloc_inode(txn);
+    if (file->inum < 0) return -1;
+    
+    // 2. Data bitmap - allocate a data block for the new file
+    file->data = txn_alloc_data(txn, 1);
+    if (file->data < 0) return -1;
+    
+    inode_t *inode_block = txn_get_block(txn, disk_sb.inode_table_start +
+                                              file->inum / INODES_PER_BLOCK);
+    if (!inode_block) return -1;
+    
+    // 3. Inode table - create new inode
+    uint32_t block = disk_sb.data_blocks_start + (uint32_t)file->data;
+    inode_t *new_inode = &inode_block[file->inum % INODES_PER_BLOCK];
+    memset(new_inode, 0, sizeof(inode_t));
+    new_inode->type = T_FILE;
+    new_inode->size = 0;
+    new_inode->nlink = 1;
+    extent_init(new_inode);
+    txn_mark_dirty(txn, new_inode, sizeof(inode_t));
+    if (extent_append(txn, new_inode, block, 1) != 0) return -1;
+    
+    journal_event_t event = { .type = JOURNAL_EVENT_CREATED, .name = file->name, .block = block };
+    event.inum = (uint32_t)file->inum;
+    report(&event);
+    return 0;
+}
+
+// Give back what create_inode() allocated for a file that is not created
+static int create_undo(txn_t *txn, const new_file_t *file) {
+    if (file->data >= 0 && free_bits(txn, 1, (uint64_t)file->data, 1) != 0) return -1;
+    if (file->inum < 0) return 0;
+    
+    inode_t *inode_block = txn_get_block(txn, disk_sb.inode_table_start +
+                                              file->inum / INODES_PER_BLOCK);
+    if (!inode_block) return -1;
+    inode_t *inode = &inode_block[file->inum % INODES_PER_BLOCK];
+    memset(inode, 0, sizeof(inode_t));
+    txn_mark_dirty(txn, inode, sizeof(inode_t));
+    return free_bits(txn, 0, (uint64_t)file->inum, 1);
+}
+
+static int undo_files(txn_t *txn, const new_file_t *files, int count) {
+    for (int f = 0; f < count; f++) {
+        if (create_undo(txn, &files[f]) != 0) return -1;
+    }
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strncmp(*(const char *const *)a, *(const char *const *)b, MAX_FILENAME - 1);
+}
+
+// Returns 1 if any name is already in the directory or given twice
+static int names_taken(txn_t *txn, const inode_t *dir, const new_file_t *files, int count) {
+    const char **sorted = malloc(count * sizeof(char *));
+    if (!sorted) {
+        fprintf(stderr, "Error: Out of memory creating files\n");
+        return -1;
+    }
+    for (int f = 0; f < count; f++) sorted[f] = files[f].name;
+    qsort(sorted, count, sizeof(char *), compare_names);
+    
+    int ret = 0;
+    for (int f = 0; f < count && ret == 0; f++) {
+        uint32_t existing;
+        int found = f > 0 && compare_names(&sorted[f - 1], &sorted[f]) == 0;
+        if (!found) found = dir_lookup(txn, dir, sorted[f], &existing);
+        if (found > 0) fprintf(stderr, "Error: File '%s' already exists\n", sorted[f]);
+        ret = found;
+    }
+    free(sorted);
+    return ret;
+}
+
+// Add the new files to the root directory. Every name is checked first, so
+// a batch with a name that is taken adds none of them (returns 1).
+static int link_files(txn_t *txn, const new_file_t *files, int count) {
+    // Root inode is always inode 0
+    inode_t *inode_block = txn_get_block(txn, disk_sb.inode_table_start);
+    if (!inode_block) return -1;
+    inode_t *root_inode = &inode_block[0];
+    
+    if (root_inode->blocks[0] == 0) {
+        fprintf(stderr, "Error: Root directory has no data block\n");
+        return -1;
+    }
+    
+    // 4. Root directory - add entries (splitting index leaves as it grows)
+    dir_lock(0);
+    int ret = names_taken(txn, root_inode, files, count);
+    for (int f = 0; f < count && ret == 0; f++) {
+        ret = dir_add(txn, root_inode, files[f].name, (uint32_t)files[f].inum);
+    }
+    dir_unlock(0);
+    return ret;
+}
+
+// Create up to CREATE_GROUP_FILES files in one transaction (write to
+// journal only). Each modified metadata block is logged once, however many
+// files touch it; if any file cannot be created, nothing is logged.
+// Concurrent calls share the running transaction and are logged together.
+static int create_group(const char *const filenames[], int count) {
+    new_file_t *files = malloc(count * sizeof(new_file_t));
+    if (!files) {
+        fprintf(stderr, "Error: Out of memory creating files\n");
+        return -1;
+    }
+    for (int f = 0; f < count; f++) {
+        files[f].name = filenames[f];
+        files[f].inum = -1;
+        files[f].data = -1;
+    }
     
-    // Clear the journal
-    printf("Clearing journal...\n");
-    memset(header_block, 0, BLOCK_SIZE);
-    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
-        if (disk_write(JOURNAL_START + i, header_block) != 0) {
-            fprintf(stderr, "Error: Failed to clear journal block %d\n", i);
+    txn_t *txn = txn_begin(create_credits(count));
+    if (!txn) {
+        free(files);
+        return -1;
+    }
+    
+    int ret = 0;
+    int undo = 1;
+    for (int f = 0; f < count && ret == 0; f++) ret = create_inode(txn, &files[f]);
+    if (ret == 0) {
+        ret = link_files(txn, files, count);
+        undo = ret > 0;               // On error, entries may be half added
+    }
+    if (ret == 0) {
+        free(files);
+        return txn_commit(txn);
+    }
+    
+    // Until a name is linked the allocations can be given back, leaving the
+    // handle with nothing to keep, so the transaction other creators share
+    // is not failed with it
+    if (undo && undo_files(txn, files, count) == 0) txn->dirty = 0;
+    free(files);
+    txn_abort(txn);
+    return -1;
+}
+
+int create_batch(const char *const filenames[], int count) {
+    for (int done = 0; done < count; done += CREATE_GROUP_FILES) {
+        int n = count - done < CREATE_GROUP_FILES ? count - done : CREATE_GROUP_FILES;
+        if (create_group(filenames + done, n) != 0) {
+            if (done > 0) fprintf(stderr, "Error: Only the first %d of %d files were created\n",
+                                  done, count);
             return -1;
         }
     }
+    return 0;
+}
+
+// Install the live journal; io_lock must be held
+static int install_live(void) {
+    // Only transactions whose checksum matches were collected; a torn one
+    // was never committed
+    if (load_live() != 0) return -1;
+    if (live.torn) {
+        journal_event_t event = { .type = JOURNAL_EVENT_TORN, .sequence = live.torn };
+        report(&event);
+        live.torn = 0;
+    }
     
-    printf("Install complete: %d transactions, %d records applied\n", 
-           transactions, records_applied);
+    int transactions = live.transactions;
+    int records = live.num_records;
+    int written = checkpoint(&live, 1);
+    if (written < 0) return -1;
     
+    journal_event_t event = { .type = JOURNAL_EVENT_INSTALLED };
+    event.transactions = (uint32_t)transactions;
+    event.records = (uint32_t)records;
+    event.blocks = (uint32_t)written;
+    report(&event);
     return 0;
 }
+
+int journal_checkpoint(void) {
+    pthread_mutex_lock(&io_lock);
+    int ret = load_live();
+    if (ret == 0 && live.num_records > 0) ret = checkpoint(&live, 0) < 0 ? -1 : 0;
+    pthread_mutex_unlock(&io_lock);
+    return ret;
+}
+
+// Install journaled transactions to the file system
+int install(void) {
+    pthread_mutex_lock(&io_lock);
+    int ret = install_live();
+    pthread_mutex_unlock(&io_lock);
+    return ret;
+}
+
+void journal_shutdown(void) {
+    pthread_mutex_lock(&tm.lock);
+    int started = tm.started;
+    tm.stopping = 1;
+    pthread_cond_signal(&tm.wake);
+    pthread_mutex_unlock(&tm.lock);
+    if (started) pthread_join(tm.committer, NULL);
+    
+    // Every handle that kept changes waited for them to be logged, so a
+    // transaction still running holds nothing worth logging
+    pthread_mutex_lock(&tm.lock);
+    if (tm.running) put_transaction(tm.running);
+    tm.running = NULL;
+    tm.started = 0;
+    tm.stopping = 0;
+    pthread_mutex_unlock(&tm.lock);
+    
+    pthread_mutex_lock(&io_lock);
+    scan_release(&live);
+    live_loaded = 0;
+    pthread_mutex_unlock(&io_lock);
+}
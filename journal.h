@@ -1,10 +1,163 @@
 #ifndef JOURNAL_H
 #define JOURNAL_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include "vsfs.h"
+
+// Default journal high-water mark (percent of the log)
+#define JOURNAL_DEFAULT_HIGH_WATER 100
+
+// Default size below which a modified block is logged as byte-range deltas
+#define JOURNAL_DEFAULT_DELTA_MAX 1024
+
+// Transaction handle limits. Every dirty range may need its own descriptor
+// tag, so TXN_MAX_BLOCKS * TXN_MAX_RANGES must not exceed JOURNAL_TAGS_PER_BLOCK.
+#define TXN_MAX_BLOCKS 120        // Distinct blocks one transaction may touch
+#define TXN_MAX_RANGES 4          // Dirty byte ranges tracked per block
+
+// Journal usage summary
+typedef struct {
+    uint32_t log_blocks;
+    uint32_t used_blocks;
+    uint32_t live_transactions;
+    uint32_t forced_checkpoints;  // In-line checkpoints since mkfs
+} journal_info_t;
+
+// Transaction handle. txn_begin() joins the running transaction, which
+// handles on other threads may share; `credits` is the most blocks the
+// handle will add to it (a handle waits for the next transaction when the
+// running one has no room). Blocks are read with txn_get_block() (which sees
+// transactions not yet installed), modified in place, and reported with
+// txn_mark_dirty(); handles sharing a block must change different bytes of
+// it. txn_commit() leaves and waits until the transaction is logged, with
+// only what was marked, as byte-range deltas when small. txn_abort() leaves
+// without waiting; if the handle marked anything, the whole transaction
+// fails. Commit and abort both free the handle.
+typedef struct txn txn_t;
+
+txn_t *txn_begin(uint32_t credits);
+void *txn_get_block(txn_t *txn, uint32_t block_num);
+
+// A block as the transaction sees it, without adding it to the transaction:
+// a pointer to its copy in the transaction, or `buffer` filled in (NULL on
+// error). For reading blocks the handle will not change.
+const void *txn_peek_block(txn_t *txn, uint32_t block_num, void *buffer);
+void txn_mark_dirty(txn_t *txn, const void *ptr, size_t len);
+int txn_commit(txn_t *txn);
+void txn_abort(txn_t *txn);
+
+// Allocate an inode, or a run of `count` contiguous data blocks (returned as
+// a data bitmap index), starting from the superblock's allocation rotor. The
+// rotor and the superblock's free counts are updated in the transaction.
+// Handles on different threads may allocate at the same time.
+int64_t txn_alloc_inode(txn_t *txn);
+int64_t txn_alloc_data(txn_t *txn, uint32_t count);
+
+// Allocate the longest run of up to `max` contiguous data blocks it finds,
+// halving the request until one is free; *count receives its length. A full
+// disk is left to the caller to report, which may have mapped enough already.
+int64_t txn_alloc_data_upto(txn_t *txn, uint32_t max, uint32_t *count);
+
+// Give back `count` data blocks from block `start`. Only blocks that have
+// never been journaled, or whose journal copies have been installed, may be
+// freed: install would otherwise write the old copy over whatever the block
+// holds next.
+int txn_free_data(txn_t *txn, uint32_t start, uint32_t count);
+
+// Allocate a data block, add it to the transaction zeroed and fully dirty,
+// and return its buffer (NULL on failure) with its number in *block_num
+void *txn_alloc_block(txn_t *txn, uint32_t *block_num);
+
 // Create a new file (logs changes to journal)
 int create(const char *filename);
 
+// Create several files, in as few transactions as their blocks allow: each
+// transaction takes up to a group of files that cannot overflow it, all or
+// none of them. A group that fails stops the batch, and the groups before
+// it stay created. Safe to call from several threads at once: their files
+// go into the running transaction together, and names are added to the
+// directory under its lock.
+int create_batch(const char *const filenames[], int count);
+
+// Initialize an empty journal (used by mkfs)
+int journal_format(void);
+
 // Install journal transactions to the file system
 int install(void);
 
+// Write the live journal home, for callers that need every journaled block
+// installed before they free one (see txn_free_data()). Unlike install(),
+// nothing is reported and an empty journal is left alone.
+int journal_checkpoint(void);
+
+// Stop the committer thread and forget the journal state loaded from disk
+// (before the disk is closed). No handle may be open.
+void journal_shutdown(void);
+
+// When appending would fill the journal past `percent`, committed
+// transactions are checkpointed first (0 disables this)
+void journal_set_high_water(uint32_t percent);
+
+// Blocks with at most this many modified bytes are logged as deltas
+// (0 always logs full block images)
+void journal_set_delta_max(uint32_t bytes);
+
+// Progress the journal reports as it works, for a front end to print; the
+// journal itself prints nothing but errors. Which fields are set depends
+// on the type.
+typedef enum {
+    JOURNAL_EVENT_CREATED,            // name, inum, block: a new file's inode is filled in
+    JOURNAL_EVENT_LOGGED,             // sequence, first, last: a transaction is in the log
+    JOURNAL_EVENT_CHECKPOINTED,       // transactions, blocks: the log filled, installed in line
+    JOURNAL_EVENT_TORN,               // sequence: install discards a torn transaction
+    JOURNAL_EVENT_COMMITTED,          // sequence: install found a complete transaction
+    JOURNAL_EVENT_APPLYING,           // block: install writes a block home
+    JOURNAL_EVENT_RELEASING,          // install releases the log
+    JOURNAL_EVENT_INSTALLED           // transactions, records, blocks: install is done
+} journal_event_type_t;
+
+typedef struct {
+    journal_event_type_t type;
+    const char *name;
+    uint32_t inum;
+    uint32_t block;                   // Disk block
+    uint32_t sequence;                // Transaction sequence number
+    uint32_t first;                   // Log blocks a transaction was written to
+    uint32_t last;
+    uint32_t transactions;
+    uint32_t records;
+    uint32_t blocks;                  // Blocks written home
+} journal_event_t;
+
+// `fn` is called from creating threads and the committer thread, some of
+// them holding journal locks: it must be thread safe and must not call
+// back into the journal. NULL (the default) reports nothing.
+typedef void (*journal_event_fn)(const journal_event_t *event, void *arg);
+void journal_set_events(journal_event_fn fn, void *arg);
+
+int journal_get_info(journal_info_t *info);
+
+// Checkpoints (install, or in line when the journal is full) this process
+// has made. Metadata read from its home location before the count last
+// changed may be stale.
+uint32_t journal_installs(void);
+
+// What this process has done to the journal. Times are in nanoseconds:
+// commit_ns covers writing transactions to the log (with their barrier),
+// checkpoint_ns whole checkpoints, install or in line.
+typedef struct {
+    uint64_t transactions;            // Logged
+    uint64_t records;                 // Tags in them (full images and deltas)
+    uint64_t bytes_written;           // Log blocks and journal superblock updates
+    uint64_t commit_ns;
+    uint64_t checkpoints;
+    uint64_t checkpoint_blocks;       // Blocks written home
+    uint64_t checkpoint_ns;
+    uint64_t lookups;                 // Blocks read through the journal
+    uint64_t lookup_records;          // Records those reads looked at
+} journal_stats_t;
+
+void journal_get_stats(journal_stats_t *stats);
+
 #endif // JOURNAL_H
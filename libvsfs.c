@@ -0,0 +1,295 @@
+#include "libvsfs.h"
+#include "disk.h"
+#include "journal.h"
+#include "dir.h"
+#include "check.h"
+#include "file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct vsfs {
+    uint8_t sb_block[BLOCK_SIZE];     // Superblock and free-count summaries
+    int sb_loaded;
+    uint32_t sb_installs;             // journal_installs() when sb_block was read
+    
+    // Bitmaps and inode table, loaded on first use. They point into the
+    // mapping, or into the owned copies below.
+    int loaded;
+    uint32_t installs;                // journal_installs() when they were loaded
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    const void *inode_table;
+    void *inode_bitmap_data;
+    void *data_bitmap_data;
+    void *inode_table_data;
+    
+    vsfs_event_fn event_fn;
+    void *event_arg;
+};
+
+static int mounted = 0;
+
+// Map or read a whole metadata region. `*owned` receives the buffer to free
+// (NULL when the region is mapped).
+static const void *load_region(uint32_t start, uint32_t count, void **owned, const char *what) {
+    *owned = NULL;
+    if (!disk_map_block(start + count - 1)) {
+        *owned = malloc((size_t)count * BLOCK_SIZE);
+        if (!*owned) {
+            fprintf(stderr, "Error: Out of memory reading %s\n", what);
+            return NULL;
+        }
+    }
+    const void *region = disk_map_or_read(start, count, *owned);
+    if (!region) fprintf(stderr, "Error: Failed to read %s\n", what);
+    return region;
+}
+
+static void release_metadata(vsfs_t *fs) {
+    free(fs->inode_bitmap_data);
+    free(fs->data_bitmap_data);
+    free(fs->inode_table_data);
+    fs->inode_bitmap_data = NULL;
+    fs->data_bitmap_data = NULL;
+    fs->inode_table_data = NULL;
+    fs->loaded = 0;
+}
+
+// The superblock block, reread only once transactions have been installed
+static const superblock_t *current_superblock(vsfs_t *fs) {
+    if (!fs->sb_loaded || fs->sb_installs != journal_installs()) {
+        if (disk_read(SUPERBLOCK_BLOCK, fs->sb_block) != 0) {
+            fprintf(stderr, "Error: Failed to read superblock\n");
+            return NULL;
+        }
+        fs->sb_loaded = 1;
+        fs->sb_installs = journal_installs();
+    }
+    return (const superblock_t *)fs->sb_block;
+}
+
+// Bitmaps and inode table, (re)loaded when missing or stale
+static int load_metadata(vsfs_t *fs) {
+    if (fs->loaded && fs->installs == journal_installs()) return 0;
+    release_metadata(fs);
+    
+    const superblock_t *sb = &disk_sb;
+    
+    // Metadata is read front to back
+    disk_advise_sequential(sb->inode_bitmap_block, sb->data_blocks_start - sb->inode_bitmap_block);
+    
+    fs->inode_bitmap = load_region(sb->inode_bitmap_block, sb->inode_bitmap_blocks,
+                                   &fs->inode_bitmap_data, "inode bitmap");
+    fs->data_bitmap = load_region(sb->data_bitmap_block, sb->data_bitmap_blocks,
+                                  &fs->data_bitmap_data, "data bitmap");
+    fs->inode_table = load_region(sb->inode_table_start, sb->inode_table_blocks,
+                                  &fs->inode_table_data, "inode table");
+    if (!fs->inode_bitmap || !fs->data_bitmap || !fs->inode_table) {
+        release_metadata(fs);
+        return -1;
+    }
+    
+    fs->loaded = 1;
+    fs->installs = journal_installs();
+    return 0;
+}
+
+static const inode_t *root_inode(vsfs_t *fs) {
+    if (load_metadata(fs) != 0) return NULL;
+    
+    const inode_t *root = table_inode(fs->inode_table, 0);
+    if (root->blocks[0] == 0) {
+        fprintf(stderr, "Error: Root directory has no data block\n");
+        return NULL;
+    }
+    return root;
+}
+
+vsfs_t *vsfs_mount(const char *image, int flags) {
+    if (mounted) {
+        fprintf(stderr, "Error: Another image is already mounted\n");
+        return NULL;
+    }
+    
+    int open_flags = 0;
+    if (flags & VSFS_DIRECT) open_flags |= DISK_DIRECT;
+    if (flags & VSFS_MMAP) open_flags |= DISK_MMAP;
+    if (disk_open(image, open_flags) != 0) {
+        fprintf(stderr, "Error: Cannot open disk image '%s'\n", image);
+        return NULL;
+    }
+    if (disk_sb.magic != VSFS_MAGIC) {
+        fprintf(stderr, "Error: '%s' has no valid VSFS superblock (re-run mkfs.vsfs)\n", image);
+        disk_close();
+        return NULL;
+    }
+    
+    vsfs_t *fs = calloc(1, sizeof(*fs));
+    if (!fs) {
+        fprintf(stderr, "Error: Out of memory mounting '%s'\n", image);
+        disk_close();
+        return NULL;
+    }
+    mounted = 1;
+    return fs;
+}
+
+void vsfs_unmount(vsfs_t *fs) {
+    if (!fs) return;
+    journal_set_events(NULL, NULL);
+    release_metadata(fs);
+    free(fs);
+    journal_shutdown();
+    disk_close();
+    mounted = 0;
+}
+
+static const vsfs_event_type_t event_types[] = {
+    [JOURNAL_EVENT_CREATED] = VSFS_EVENT_CREATED,
+    [JOURNAL_EVENT_LOGGED] = VSFS_EVENT_LOGGED,
+    [JOURNAL_EVENT_CHECKPOINTED] = VSFS_EVENT_CHECKPOINTED,
+    [JOURNAL_EVENT_TORN] = VSFS_EVENT_TORN,
+    [JOURNAL_EVENT_COMMITTED] = VSFS_EVENT_COMMITTED,
+    [JOURNAL_EVENT_APPLYING] = VSFS_EVENT_APPLYING,
+    [JOURNAL_EVENT_RELEASING] = VSFS_EVENT_RELEASING,
+    [JOURNAL_EVENT_INSTALLED] = VSFS_EVENT_INSTALLED,
+};
+
+static void forward_event(const journal_event_t *event, void *arg) {
+    vsfs_t *fs = arg;
+    vsfs_event_t out;
+    out.type = event_types[event->type];
+    out.name = event->name;
+    out.inum = event->inum;
+    out.block = event->block;
+    out.sequence = event->sequence;
+    out.first = event->first;
+    out.last = event->last;
+    out.transactions = event->transactions;
+    out.records = event->records;
+    out.blocks = event->blocks;
+    fs->event_fn(&out, fs->event_arg);
+}
+
+void vsfs_set_events(vsfs_t *fs, vsfs_event_fn fn, void *arg) {
+    fs->event_fn = fn;
+    fs->event_arg = arg;
+    journal_set_events(fn ? forward_event : NULL, fs);
+}
+
+int vsfs_create(vsfs_t *fs, const char *const names[], int count) {
+    (void)fs;
+    return create_batch(names, count);
+}
+
+int vsfs_install(vsfs_t *fs) {
+    (void)fs;
+    return install();
+}
+
+int vsfs_lookup(vsfs_t *fs, const char *name, uint32_t *inum) {
+    const inode_t *root = root_inode(fs);
+    if (!root) return -1;
+    return dir_find(root, name, inum);
+}
+
+int64_t vsfs_write(vsfs_t *fs, const char *name, int fd) {
+    (void)fs;
+    return file_write(name, fd, 0);
+}
+
+int64_t vsfs_append(vsfs_t *fs, const char *name, int fd) {
+    (void)fs;
+    return file_write(name, fd, 1);
+}
+
+int64_t vsfs_read(vsfs_t *fs, const char *name, int fd) {
+    uint32_t inum;
+    const inode_t *root = root_inode(fs);
+    if (!root) return -1;
+    int found = dir_find(root, name, &inum);
+    if (found <= 0) {
+        if (found == 0) fprintf(stderr, "Error: File '%s' not found\n", name);
+        return -1;
+    }
+    
+    const inode_t *inode = table_inode(fs->inode_table, inum);
+    if (inode->type != T_FILE) {
+        fprintf(stderr, "Error: '%s' is not a file\n", name);
+        return -1;
+    }
+    return file_read(inode, fd);
+}
+
+// vsfs_readdir() state
+typedef struct {
+    vsfs_t *fs;
+    vsfs_readdir_fn fn;
+    void *arg;
+    int count;
+} readdir_t;
+
+static void readdir_entry(const dirent_t *entry, void *arg) {
+    readdir_t *walk = arg;
+    
+    if (entry->inum >= disk_sb.num_inodes) {
+        fprintf(stderr, "Error: Failed to read inode %u\n", entry->inum);
+        return;
+    }
+    
+    vsfs_dirent_t dirent;
+    memcpy(dirent.name, entry->name, MAX_FILENAME);
+    dirent.name[MAX_FILENAME - 1] = '\0';
+    dirent.inum = entry->inum;
+    dirent.size = table_inode(walk->fs->inode_table, entry->inum)->size;
+    walk->fn(&dirent, walk->arg);
+    walk->count++;
+}
+
+int vsfs_readdir(vsfs_t *fs, vsfs_readdir_fn fn, void *arg) {
+    const inode_t *root = root_inode(fs);
+    if (!root) return -1;
+    
+    readdir_t walk;
+    walk.fs = fs;
+    walk.fn = fn;
+    walk.arg = arg;
+    walk.count = 0;
+    if (dir_for_each(root, NULL, readdir_entry, &walk) != 0) return -1;
+    return walk.count;
+}
+
+int vsfs_stat(vsfs_t *fs, vsfs_stat_t *st) {
+    // The free counts are kept in the superblock, so this reads at most one
+    // block however large the disk is
+    const superblock_t *sb = current_superblock(fs);
+    if (!sb) return -1;
+    
+    memset(st, 0, sizeof(*st));
+    st->magic = sb->magic;
+    st->num_blocks = sb->num_blocks;
+    st->num_inodes = sb->num_inodes;
+    st->data_blocks = sb->data_blocks_count;
+    st->free_inodes = sb->free_inodes;
+    st->free_blocks = sb->free_blocks;
+    
+    // Journal fields stay zero if the journal cannot be read
+    journal_info_t journal;
+    if (journal_get_info(&journal) == 0) {
+        st->journal_blocks = journal.log_blocks;
+        st->journal_used = journal.used_blocks;
+        st->pending_transactions = journal.live_transactions;
+        st->forced_checkpoints = journal.forced_checkpoints;
+    }
+    return 0;
+}
+
+int vsfs_check(vsfs_t *fs, int threads, FILE *out) {
+    if (load_metadata(fs) != 0) return -1;
+    int errors = check_fs(fs->inode_bitmap, fs->data_bitmap, fs->inode_table, threads, out);
+    
+    // A rebuild of the free counts rewrites the superblock
+    fs->sb_loaded = 0;
+    return errors;
+}
@@ -0,0 +1,123 @@
+#ifndef LIBVSFS_H
+#define LIBVSFS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "vsfs.h"
+
+// libvsfs: a VSFS image behind a mount handle. The handle keeps the
+// superblock, bitmaps and inode table in memory (mapped when the image is
+// mapped) and reloads them only after transactions are installed, so
+// repeated operations do not reread metadata.
+//
+// ONE IMAGE PER PROCESS. The disk, the journal and its committer thread are
+// process-wide state, not part of vsfs_t: vsfs_mount() fails while another
+// image is mounted, and a second image needs vsfs_unmount() of the first
+// (or another process).
+//
+// Creates and file writes are journaled; lookup, readdir, stat and read see
+// the file system as installed. Calls print nothing but errors (to stderr);
+// progress goes to the handler set with vsfs_set_events().
+//
+// vsfs_create() may be called from many threads at once: concurrent creates
+// share the running transaction and are logged by one committer thread.
+// Other calls must not overlap with creates or with each other.
+
+// Mount flags
+#define VSFS_DIRECT 0x1       // Bypass the page cache (O_DIRECT)
+#define VSFS_MMAP   0x2       // Map the whole image
+
+typedef struct vsfs vsfs_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_blocks;
+    uint32_t num_inodes;
+    uint32_t data_blocks;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t journal_blocks;      // Log blocks
+    uint32_t journal_used;
+    uint32_t pending_transactions;
+    uint32_t forced_checkpoints;
+} vsfs_stat_t;
+
+typedef struct {
+    char name[MAX_FILENAME];
+    uint32_t inum;
+    uint32_t size;
+} vsfs_dirent_t;
+
+typedef void (*vsfs_readdir_fn)(const vsfs_dirent_t *entry, void *arg);
+
+// Progress of creates, transactions and installs. Which fields are set
+// depends on the type.
+typedef enum {
+    VSFS_EVENT_CREATED,               // name, inum, block: a new file's inode is filled in
+    VSFS_EVENT_LOGGED,                // sequence, first, last: a transaction is in the journal
+    VSFS_EVENT_CHECKPOINTED,          // transactions, blocks: the journal filled, installed in line
+    VSFS_EVENT_TORN,                  // sequence: install discards a torn transaction
+    VSFS_EVENT_COMMITTED,             // sequence: install found a complete transaction
+    VSFS_EVENT_APPLYING,              // block: install writes a block home
+    VSFS_EVENT_RELEASING,             // install releases the journal
+    VSFS_EVENT_INSTALLED              // transactions, records, blocks: install is done
+} vsfs_event_type_t;
+
+typedef struct {
+    vsfs_event_type_t type;
+    const char *name;
+    uint32_t inum;
+    uint32_t block;                   // Disk block
+    uint32_t sequence;                // Transaction sequence number
+    uint32_t first;                   // Journal blocks a transaction was written to
+    uint32_t last;
+    uint32_t transactions;
+    uint32_t records;
+    uint32_t blocks;                  // Blocks written home
+} vsfs_event_t;
+
+typedef void (*vsfs_event_fn)(const vsfs_event_t *event, void *arg);
+
+// Open and validate an image; NULL on failure, or when an image is already
+// mounted in this process
+vsfs_t *vsfs_mount(const char *image, int flags);
+void vsfs_unmount(vsfs_t *fs);
+
+// Report progress to `fn` (NULL, the default: nowhere). It is called from
+// creating threads and the committer thread, some of them holding journal
+// locks, so it must be thread safe and must not call into the library.
+void vsfs_set_events(vsfs_t *fs, vsfs_event_fn fn, void *arg);
+
+// Create files in the root directory, in one transaction (which concurrent
+// callers may share) or, for a long list, one per group of files (see
+// create_batch()). Returns once the files are logged.
+int vsfs_create(vsfs_t *fs, const char *const names[], int count);
+
+// Install journaled transactions
+int vsfs_install(vsfs_t *fs);
+
+// Replace the contents of root directory file `name` (created when it does
+// not exist) with everything read from `fd`, or add it at the end. File
+// data is written in place and journaled in ordered mode (see file.h).
+// Returns the number of bytes written, or -1.
+int64_t vsfs_write(vsfs_t *fs, const char *name, int fd);
+int64_t vsfs_append(vsfs_t *fs, const char *name, int fd);
+
+// Write the contents of `name`, as installed, to `fd`. Returns the number
+// of bytes, or -1.
+int64_t vsfs_read(vsfs_t *fs, const char *name, int fd);
+
+// 1 and *inum when `name` exists, 0 when it does not, -1 on error
+int vsfs_lookup(vsfs_t *fs, const char *name, uint32_t *inum);
+
+// Call fn for every file in the root directory (in hash order once it is
+// indexed). Returns the number of files, or -1 on error.
+int vsfs_readdir(vsfs_t *fs, vsfs_readdir_fn fn, void *arg);
+
+int vsfs_stat(vsfs_t *fs, vsfs_stat_t *st);
+
+// Consistency check (see check.h), printing its findings to `out` (NULL:
+// nowhere); returns the number of errors or -1
+int vsfs_check(vsfs_t *fs, int threads, FILE *out);
+
+#endif // LIBVSFS_H
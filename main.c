@@ -1,264 +1,636 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "vsfs.h"
-#include "disk.h"
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "libvsfs.h"
 #include "journal.h"
+#include "cache.h"
+#include "disk.h"
+#include "iostat.h"
+#include "serve.h"
 
 void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <disk_image> <command> [args...]\n", prog);
+    fprintf(stderr, "Usage: %s [options] <disk_image> <command> [args...]\n", prog);
+    fprintf(stderr, "       %s [options] --connect=<socket> <command> [args...]\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --direct            - Bypass the page cache (O_DIRECT)\n");
+    fprintf(stderr, "  --mmap              - Map the image (default for ls, stat, check,\n");
+    fprintf(stderr, "                        serve and batch)\n");
+    fprintf(stderr, "  --journal-hwm=<pct>  - Checkpoint in line past this journal fill level\n");
+    fprintf(stderr, "                        (default %d, 0 disables)\n", JOURNAL_DEFAULT_HIGH_WATER);
+    fprintf(stderr, "  --journal-delta=<bytes> - Log blocks with at most this many changed bytes\n");
+    fprintf(stderr, "                        as deltas (default %d, 0 disables)\n",
+            JOURNAL_DEFAULT_DELTA_MAX);
+    fprintf(stderr, "  --cache=<blocks>    - Buffer cache size (default %d, 0 disables)\n",
+            BCACHE_DEFAULT_BLOCKS);
+    fprintf(stderr, "  --queue-depth=<n>   - Writes in flight when installing and logging\n");
+    fprintf(stderr, "                        (default %d, 1 writes one at a time)\n",
+            DISK_DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  --iostat            - Print I/O statistics when the command finishes\n");
+    fprintf(stderr, "                        (%s=<file|-> dumps them as JSON)\n", IOSTAT_ENV);
+    fprintf(stderr, "  --threads=<n>       - Worker threads for check (default: one per CPU), or\n");
+    fprintf(stderr, "                        concurrent creators for create (one file each), or\n");
+    fprintf(stderr, "                        workers for serve (default %d)\n", SERVE_DEFAULT_WORKERS);
+    fprintf(stderr, "  --connect=<socket>  - Send the command to a vsfs serve process\n");
     fprintf(stderr, "Commands:\n");
-    fprintf(stderr, "  create <filename>   - Create a new file (logs to journal)\n");
+    fprintf(stderr, "  create <filename>...       - Create files, in as few transactions as fit (logs to journal)\n");
+    fprintf(stderr, "  create --from <list.txt>   - Create the files named in a list, one per line\n");
     fprintf(stderr, "  install             - Install journal transactions\n");
     fprintf(stderr, "  ls                  - List files in root directory\n");
     fprintf(stderr, "  stat                - Show file system statistics\n");
     fprintf(stderr, "  check               - Validate file system consistency\n");
+    fprintf(stderr, "  write <name> [file]  - Replace a file's contents with a host file (default\n");
+    fprintf(stderr, "                        stdin), creating it when needed; not atomic past\n");
+    fprintf(stderr, "                        16 MiB, where a crash can leave part of the write\n");
+    fprintf(stderr, "  append <name> [file] - Add a host file (default stdin) at a file's end\n");
+    fprintf(stderr, "  cat <name>          - Write an installed file's contents to stdout\n");
+    fprintf(stderr, "  serve <socket>      - Answer commands from --connect clients until SIGINT\n");
+    fprintf(stderr, "  batch [--timing] [script] - Run the commands in a script (default stdin),\n");
+    fprintf(stderr, "                        one per line, on one mount\n");
 }
 
-void cmd_ls(void) {
-    uint8_t inode_table_data[BLOCK_SIZE * INODE_TABLE_BLOCKS];
-    uint8_t root_dir_block[BLOCK_SIZE];
+// Read a list of file names, one per line (blank lines are skipped)
+static char **read_name_list(const char *path, int *count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Failed to open name list");
+        return NULL;
+    }
     
-    // Read inode table
-    for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {
-        if (disk_read(INODE_TABLE_START + i, inode_table_data + i * BLOCK_SIZE) != 0) {
-            fprintf(stderr, "Error: Failed to read inode table\n");
-            return;
+    char line[256];
+    int capacity = 64;
+    char **names = malloc(capacity * sizeof(char *));
+    *count = 0;
+    
+    while (names && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        
+        if (*count == capacity) {
+            capacity *= 2;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (!grown) {
+                free(names);
+                names = NULL;
+                break;
+            }
+            names = grown;
         }
+        names[*count] = malloc(strlen(line) + 1);
+        if (!names[*count]) break;
+        strcpy(names[(*count)++], line);
     }
     
-    inode_t *inode_table = (inode_t *)inode_table_data;
-    inode_t *root = &inode_table[0];
+    fclose(fp);
+    if (!names) fprintf(stderr, "Error: Out of memory reading '%s'\n", path);
+    return names;
+}
+
+// create --threads: each thread creates every `step`-th file, one per call
+typedef struct {
+    vsfs_t *fs;
+    char **names;
+    int count;
+    int first;
+    int step;
+    int failed;
+} create_worker_t;
+
+static void *create_worker(void *arg) {
+    create_worker_t *worker = arg;
+    for (int i = worker->first; i < worker->count; i += worker->step) {
+        if (vsfs_create(worker->fs, (const char *const *)&worker->names[i], 1) != 0) {
+            worker->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+// Create the files from `threads` threads at once; their creates share
+// transactions instead of each waiting for its own commit
+static int create_parallel(vsfs_t *fs, char **names, int count, int threads) {
+    if (threads > count) threads = count;
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    create_worker_t *workers = calloc(threads, sizeof(create_worker_t));
+    if (!tids || !workers) {
+        fprintf(stderr, "Error: Out of memory starting creators\n");
+        free(tids);
+        free(workers);
+        return 1;
+    }
     
-    if (root->blocks[0] == 0) {
-        fprintf(stderr, "Error: Root directory has no data block\n");
-        return;
+    int started = 0;
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[i].fs = fs;
+        workers[i].names = names;
+        workers[i].count = count;
+        workers[i].first = i;
+        workers[i].step = threads;
+        if (pthread_create(&tids[i], NULL, create_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Error: Failed to start creator thread\n");
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= workers[i].failed;
+    }
+    free(tids);
+    free(workers);
+    return failed;
+}
+
+static int create_names(vsfs_t *fs, char **names, int count, int threads) {
+    if (threads > 1) return create_parallel(fs, names, count, threads);
+    return vsfs_create(fs, (const char *const *)names, count) != 0;
+}
+
+static int cmd_create(vsfs_t *fs, int argc, char *argv[], int threads) {
+    if (strcmp(argv[0], "--from") != 0) {
+        return create_names(fs, argv, argc, threads);
     }
     
-    // Read root directory
-    if (disk_read(root->blocks[0], root_dir_block) != 0) {
-        fprintf(stderr, "Error: Failed to read root directory\n");
-        return;
+    if (argc < 2) {
+        fprintf(stderr, "Error: create --from requires a file name list\n");
+        return 1;
     }
     
-    dirent_t *entries = (dirent_t *)root_dir_block;
+    int count = 0;
+    char **names = read_name_list(argv[1], &count);
+    if (!names) return 1;
     
+    int ret = create_names(fs, names, count, threads);
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    return ret;
+}
+
+
+static void ls_entry(const vsfs_dirent_t *entry, void *arg) {
+    (void)arg;
+    printf("%-30s %10u %10u\n", entry->name, entry->inum, entry->size);
+}
+
+// Progress from the library, as it happens
+static void print_event(const vsfs_event_t *event, void *arg) {
+    (void)arg;
+    switch (event->type) {
+    case VSFS_EVENT_CREATED:
+        printf("Creating file: %s\n  Allocating inode %u, data block %u\n", event->name,
+               event->inum, event->block);
+        break;
+    case VSFS_EVENT_LOGGED:
+        printf("  Transaction %u logged to journal (blocks %u-%u)\n", event->sequence,
+               event->first, event->last);
+        break;
+    case VSFS_EVENT_CHECKPOINTED:
+        printf("  Journal full: checkpointed %u transactions (%u blocks written)\n",
+               event->transactions, event->blocks);
+        break;
+    case VSFS_EVENT_TORN:
+        printf("  Discarding torn transaction %u (checksum mismatch)\n", event->sequence);
+        break;
+    case VSFS_EVENT_COMMITTED:
+        printf("  Found COMMIT record (transaction %u complete)\n", event->sequence);
+        break;
+    case VSFS_EVENT_APPLYING:
+        printf("  Applying DATA record: block %u\n", event->block);
+        break;
+    case VSFS_EVENT_RELEASING:
+        printf("Releasing journal...\n");
+        break;
+    case VSFS_EVENT_INSTALLED:
+        printf("Install complete: %u transactions, %u records applied (%u blocks written)\n",
+               event->transactions, event->records, event->blocks);
+        break;
+    }
+}
+
+static void print_ls_header(void) {
     printf("Files in root directory:\n");
     printf("%-30s %10s %10s\n", "Name", "Inode", "Size");
     printf("-------------------------------------------------------\n");
+}
+
+static void cmd_ls(vsfs_t *fs) {
+    print_ls_header();
     
-    int count = 0;
-    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inum != 0) {
-            inode_t *file_inode = &inode_table[entries[i].inum];
-            printf("%-30s %10u %10u\n", entries[i].name, entries[i].inum, file_inode->size);
-            count++;
-        }
-    }
+    // Indexed directories are listed in hash order
+    int count = vsfs_readdir(fs, ls_entry, NULL);
+    if (count < 0) return;
     
     printf("\nTotal: %d files\n", count);
 }
 
-void cmd_stat(void) {
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    superblock_t sb;
-    
-    if (disk_read(SUPERBLOCK_BLOCK, &sb) != 0) {
-        fprintf(stderr, "Error: Failed to read superblock\n");
-        return;
+static void print_stat(const vsfs_stat_t *st) {
+    printf("File System Statistics:\n");
+    printf("  Magic:        0x%08x\n", st->magic);
+    printf("  Total blocks: %u\n", st->num_blocks);
+    printf("  Total inodes: %u\n", st->num_inodes);
+    printf("  Used inodes:  %u / %u\n", st->num_inodes - st->free_inodes, st->num_inodes);
+    printf("  Used blocks:  %u / %u\n", st->data_blocks - st->free_blocks, st->data_blocks);
+    printf("  Free inodes:  %u\n", st->free_inodes);
+    printf("  Free blocks:  %u\n", st->free_blocks);
+    if (st->journal_blocks > 0) {
+        printf("  Journal:      %u / %u blocks used, %u transactions pending\n",
+               st->journal_used, st->journal_blocks, st->pending_transactions);
+        printf("  Forced checkpoints: %u\n", st->forced_checkpoints);
     }
-    
-    if (disk_read(INODE_BITMAP_BLOCK, inode_bitmap) != 0) {
-        fprintf(stderr, "Error: Failed to read inode bitmap\n");
-        return;
+}
+
+static void cmd_stat(vsfs_t *fs) {
+    vsfs_stat_t st;
+    if (vsfs_stat(fs, &st) != 0) return;
+    print_stat(&st);
+}
+
+// write|append <name> [file|-]
+static int cmd_write(vsfs_t *fs, int argc, char *argv[], int append) {
+    int fd = STDIN_FILENO;
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
+            perror("Failed to open source file");
+            return 1;
+        }
     }
     
-    if (disk_read(DATA_BITMAP_BLOCK, data_bitmap) != 0) {
-        fprintf(stderr, "Error: Failed to read data bitmap\n");
-        return;
+    int64_t bytes = append ? vsfs_append(fs, argv[0], fd) : vsfs_write(fs, argv[0], fd);
+    if (fd != STDIN_FILENO) close(fd);
+    if (bytes < 0) return 1;
+    printf("%s %lld bytes to %s\n", append ? "Appended" : "Wrote", (long long)bytes, argv[0]);
+    return 0;
+}
+
+static int cmd_cat(vsfs_t *fs, const char *name) {
+    // Anything printed so far goes out ahead of the file
+    fflush(stdout);
+    return vsfs_read(fs, name, STDOUT_FILENO) < 0;
+}
+
+// --connect: requests that wait for one reply
+static int client_call(int fd, uint16_t op, const void *payload, uint32_t length,
+                       void **reply, uint32_t *reply_length) {
+    serve_response_t response;
+    void *data;
+    if (serve_call(fd, op, payload, length, &response, &data) != 0) return -1;
+    if (reply) {
+        *reply = data;
+        *reply_length = response.length;
+    } else {
+        free(data);
     }
-    
-    // Count allocated inodes and blocks
-    int used_inodes = 0;
-    int used_blocks = 0;
-    
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (bitmap_get(inode_bitmap, i)) {
-            used_inodes++;
-        }
+    return response.status;
+}
+
+// Send the creates pipelined, up to CLIENT_WINDOW requests in flight. With
+// --threads each request names one file, like the local concurrent creators;
+// otherwise a request takes as many names as fit in one payload.
+#define CLIENT_WINDOW 64
+
+static int client_create(int fd, char **names, int count, int threads) {
+    char *payload = malloc(SERVE_MAX_PAYLOAD);
+    if (!payload) {
+        fprintf(stderr, "Error: Out of memory sending creates\n");
+        return 1;
     }
     
-    for (int i = 0; i < DATA_BLOCKS_COUNT; i++) {
-        if (bitmap_get(data_bitmap, i)) {
-            used_blocks++;
+    int next = 0;
+    int in_flight = 0;
+    int failed = 0;
+    while (next < count || in_flight > 0) {
+        while (next < count && in_flight < CLIENT_WINDOW) {
+            uint32_t length = 0;
+            int first = next;
+            while (next < count && (next == first || threads <= 1)) {
+                size_t size = strlen(names[next]) + 1;
+                if (length + size > SERVE_MAX_PAYLOAD) break;
+                memcpy(payload + length, names[next++], size);
+                length += size;
+            }
+            if (next == first) {
+                fprintf(stderr, "Error: File name too long\n");
+                free(payload);
+                return 1;
+            }
+            if (serve_send(fd, (uint32_t)first, SERVE_CREATE, payload, length) != 0) {
+                free(payload);
+                return 1;
+            }
+            in_flight++;
+        }
+        
+        serve_response_t response;
+        void *reply;
+        if (serve_recv(fd, &response, &reply) != 0) {
+            free(payload);
+            return 1;
+        }
+        free(reply);
+        if (response.status != 0) {
+            fprintf(stderr, "Error: Failed to create '%s'\n", names[response.id]);
+            failed = 1;
         }
+        in_flight--;
     }
-    
-    printf("File System Statistics:\n");
-    printf("  Magic:        0x%08x\n", sb.magic);
-    printf("  Total blocks: %u\n", sb.num_blocks);
-    printf("  Total inodes: %u\n", sb.num_inodes);
-    printf("  Used inodes:  %d / %d\n", used_inodes, MAX_INODES);
-    printf("  Used blocks:  %d / %d\n", used_blocks, DATA_BLOCKS_COUNT);
-    printf("  Free inodes:  %d\n", MAX_INODES - used_inodes);
-    printf("  Free blocks:  %d\n", DATA_BLOCKS_COUNT - used_blocks);
+    free(payload);
+    return failed;
 }
 
-void cmd_check(void) {
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    uint8_t inode_table_data[BLOCK_SIZE * INODE_TABLE_BLOCKS];
-    uint8_t root_dir_block[BLOCK_SIZE];
-    
-    printf("Checking file system consistency...\n");
+static int client_ls(int fd) {
+    void *reply = NULL;
+    uint32_t length;
+    if (client_call(fd, SERVE_LS, NULL, 0, &reply, &length) != 0) {
+        free(reply);
+        return 1;
+    }
     
-    // Read bitmaps
-    if (disk_read(INODE_BITMAP_BLOCK, inode_bitmap) != 0) return;
-    if (disk_read(DATA_BITMAP_BLOCK, data_bitmap) != 0) return;
+    const vsfs_dirent_t *entries = reply;
+    int count = (int)(length / sizeof(vsfs_dirent_t));
+    print_ls_header();
+    for (int i = 0; i < count; i++) ls_entry(&entries[i], NULL);
+    printf("\nTotal: %d files\n", count);
+    free(reply);
+    return 0;
+}
+
+static int client_stat(int fd) {
+    void *reply = NULL;
+    uint32_t length;
+    int ret = client_call(fd, SERVE_STAT, NULL, 0, &reply, &length);
+    if (ret == 0 && length == sizeof(vsfs_stat_t)) print_stat(reply);
+    free(reply);
+    return ret == 0 ? 0 : 1;
+}
+
+static int run_client(const char *path, int argc, char *argv[], int threads) {
+    const char *command = argv[0];
+    int fd = serve_connect(path);
+    if (fd < 0) return 1;
     
-    // Read inode table
-    for (int i = 0; i < INODE_TABLE_BLOCKS; i++) {
-        if (disk_read(INODE_TABLE_START + i, inode_table_data + i * BLOCK_SIZE) != 0) {
-            return;
+    int ret = 0;
+    if (strcmp(command, "create") == 0 && argc >= 2 && strcmp(argv[1], "--from") != 0) {
+        ret = client_create(fd, argv + 1, argc - 1, threads);
+    } else if (strcmp(command, "create") == 0 && argc >= 3) {
+        int count = 0;
+        char **names = read_name_list(argv[2], &count);
+        ret = names ? client_create(fd, names, count, threads) : 1;
+        for (int i = 0; names && i < count; i++) free(names[i]);
+        free(names);
+    } else if (strcmp(command, "create") == 0) {
+        fprintf(stderr, "Error: create requires a filename\n");
+        ret = 1;
+    } else if (strcmp(command, "install") == 0) {
+        ret = client_call(fd, SERVE_INSTALL, NULL, 0, NULL, NULL) != 0;
+    } else if (strcmp(command, "ls") == 0) {
+        ret = client_ls(fd);
+    } else if (strcmp(command, "stat") == 0) {
+        ret = client_stat(fd);
+    } else if (strcmp(command, "check") == 0) {
+        // The full report goes to the server's output
+        int errors = client_call(fd, SERVE_CHECK, NULL, 0, NULL, NULL);
+        if (errors == 0) {
+            printf("✓ File system is consistent\n");
+        } else if (errors > 0) {
+            printf("✗ Found %d error(s)\n", errors);
         }
+        ret = errors < 0;
+    } else {
+        fprintf(stderr, "Error: Unknown command '%s'\n", command);
+        ret = 1;
     }
     
-    inode_t *inode_table = (inode_t *)inode_table_data;
-    inode_t *root = &inode_table[0];
-    
-    int errors = 0;
+    close(fd);
+    return ret;
+}
+
+// Run one of the commands that work on a mounted image; argv[0] names it.
+// Usage errors print the usage when `prog` is set.
+static int run_command(vsfs_t *fs, int argc, char *argv[], int threads, const char *prog) {
+    const char *command = argv[0];
+    int ret = 0;
     
-    // Check root directory
-    if (!bitmap_get(inode_bitmap, 0)) {
-        printf("ERROR: Root inode not allocated in bitmap\n");
-        errors++;
+    if (strcmp(command, "create") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Error: create requires a filename\n");
+            if (prog) print_usage(prog);
+            ret = 1;
+        } else {
+            ret = cmd_create(fs, argc - 1, argv + 1, threads);
+        }
+    } 
+    else if (strcmp(command, "install") == 0) {
+        printf("Installing journal transactions...\n");
+        ret = vsfs_install(fs);
     }
-    
-    if (root->blocks[0] == 0) {
-        printf("ERROR: Root directory has no data block\n");
-        errors++;
-        return;
+    else if (strcmp(command, "ls") == 0) {
+        cmd_ls(fs);
     }
-    
-    // Read root directory
-    if (disk_read(root->blocks[0], root_dir_block) != 0) return;
-    dirent_t *entries = (dirent_t *)root_dir_block;
-    
-    // Check each file
-    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inum == 0) continue;
-        
-        uint32_t inum = entries[i].inum;
-        
-        // Check inode is in valid range
-        if (inum >= MAX_INODES) {
-            printf("ERROR: File '%s' has invalid inode %u\n", entries[i].name, inum);
-            errors++;
-            continue;
-        }
-        
-        // Check inode is marked allocated
-        if (!bitmap_get(inode_bitmap, inum)) {
-            printf("ERROR: File '%s' inode %u not marked in bitmap (dangling pointer)\n", 
-                   entries[i].name, inum);
-            errors++;
-        }
-        
-        // Check data blocks
-        inode_t *inode = &inode_table[inum];
-        for (int j = 0; j < DIRECT_POINTERS; j++) {
-            if (inode->blocks[j] == 0) continue;
-            
-            // Check block is in valid range
-            if (inode->blocks[j] < DATA_BLOCKS_START || 
-                inode->blocks[j] >= DATA_BLOCKS_START + DATA_BLOCKS_COUNT) {
-                printf("ERROR: File '%s' has invalid block pointer %u\n", 
-                       entries[i].name, inode->blocks[j]);
-                errors++;
-                continue;
-            }
-            
-            // Check block is marked allocated
-            uint32_t data_block_idx = inode->blocks[j] - DATA_BLOCKS_START;
-            if (!bitmap_get(data_bitmap, data_block_idx)) {
-                printf("ERROR: File '%s' block %u not marked in bitmap\n", 
-                       entries[i].name, inode->blocks[j]);
-                errors++;
-            }
+    else if (strcmp(command, "stat") == 0) {
+        cmd_stat(fs);
+    }
+    else if (strcmp(command, "check") == 0) {
+        ret = vsfs_check(fs, threads, stdout) != 0;
+    }
+    else if (strcmp(command, "write") == 0 || strcmp(command, "append") == 0 ||
+             strcmp(command, "cat") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Error: %s requires a filename\n", command);
+            if (prog) print_usage(prog);
+            ret = 1;
+        } else if (strcmp(command, "cat") == 0) {
+            ret = cmd_cat(fs, argv[1]);
+        } else {
+            ret = cmd_write(fs, argc - 1, argv + 1, strcmp(command, "append") == 0);
         }
     }
+    else {
+        fprintf(stderr, "Error: Unknown command '%s'\n", command);
+        if (prog) print_usage(prog);
+        ret = 1;
+    }
+    return ret;
+}
+
+// Split a script line into words at blanks; '#' starts a comment
+static int split_line(char *line, char ***words, int *capacity) {
+    int count = 0;
+    char *save;
+    line[strcspn(line, "#\r\n")] = '\0';
     
-    // Check for leaked inodes (allocated but not referenced)
-    for (int i = 1; i < MAX_INODES; i++) { // Skip root (inode 0)
-        if (!bitmap_get(inode_bitmap, i)) continue;
-        
-        int found = 0;
-        for (size_t j = 0; j < DIRENTS_PER_BLOCK; j++) {
-            if (entries[j].inum == (uint32_t)i) {
-                found = 1;
-                break;
+    for (char *word = strtok_r(line, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+        if (count == *capacity) {
+            int grown_capacity = *capacity ? *capacity * 2 : 64;
+            char **grown = realloc(*words, grown_capacity * sizeof(char *));
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory reading script\n");
+                return -1;
             }
+            *words = grown;
+            *capacity = grown_capacity;
         }
-        
-        if (!found) {
-            printf("ERROR: Inode %d is allocated but not referenced (leak)\n", i);
-            errors++;
+        (*words)[count++] = word;
+    }
+    return count;
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// batch [--timing] [script|-]: run the script's commands, one per line, on
+// the mounted image. The handle's metadata carries over between commands;
+// the first failing command stops the script.
+static int cmd_batch(vsfs_t *fs, int argc, char *argv[], int threads) {
+    int timing = argc > 0 && strcmp(argv[0], "--timing") == 0;
+    if (timing) {
+        argc--;
+        argv++;
+    }
+    
+    FILE *fp = stdin;
+    if (argc > 0 && strcmp(argv[0], "-") != 0) {
+        fp = fopen(argv[0], "r");
+        if (!fp) {
+            perror("Failed to open script");
+            return 1;
         }
     }
     
-    if (errors == 0) {
-        printf("✓ File system is consistent\n");
-    } else {
-        printf("✗ Found %d error(s)\n", errors);
+    char *line = NULL;
+    size_t line_size = 0;
+    char **words = NULL;
+    int capacity = 0;
+    int line_number = 0;
+    int commands = 0;
+    int ret = 0;
+    struct timespec batch_start;
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+    
+    while (ret == 0 && getline(&line, &line_size, fp) != -1) {
+        line_number++;
+        int count = split_line(line, &words, &capacity);
+        if (count < 0) {
+            ret = 1;
+            break;
+        }
+        if (count == 0) continue;
+        
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = run_command(fs, count, words, threads, NULL);
+        commands++;
+        
+        // Output of the command is complete before its timing line
+        fflush(stdout);
+        if (timing) printf("[%d] %s: %.3f ms\n", line_number, words[0], elapsed_ms(&start));
+        if (ret != 0) fprintf(stderr, "Error: Line %d failed: %s\n", line_number, words[0]);
     }
+    
+    if (timing) printf("Batch: %d commands in %.3f ms\n", commands, elapsed_ms(&batch_start));
+    free(words);
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return ret != 0;
 }
 
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    int mount_flags = 0;
+    int threads = 0;
+    int iostat = 0;
+    const char *connect_path = NULL;
+    
+    // Global options precede the disk image
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--direct") == 0) {
+            mount_flags |= VSFS_DIRECT;
+        } else if (strcmp(argv[1], "--mmap") == 0) {
+            mount_flags |= VSFS_MMAP;
+        } else if (strncmp(argv[1], "--journal-hwm=", 14) == 0) {
+            journal_set_high_water((uint32_t)strtoul(argv[1] + 14, NULL, 10));
+        } else if (strncmp(argv[1], "--journal-delta=", 16) == 0) {
+            journal_set_delta_max((uint32_t)strtoul(argv[1] + 16, NULL, 10));
+        } else if (strncmp(argv[1], "--cache=", 8) == 0) {
+            bcache_set_capacity((uint32_t)strtoul(argv[1] + 8, NULL, 10));
+        } else if (strncmp(argv[1], "--queue-depth=", 14) == 0) {
+            disk_set_queue_depth((uint32_t)strtoul(argv[1] + 14, NULL, 10));
+        } else if (strcmp(argv[1], "--iostat") == 0) {
+            iostat = 1;
+        } else if (strncmp(argv[1], "--threads=", 10) == 0) {
+            threads = (int)strtol(argv[1] + 10, NULL, 10);
+        } else if (strncmp(argv[1], "--connect=", 10) == 0) {
+            connect_path = argv[1] + 10;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[1]);
+            print_usage(prog);
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+    
+    // A server holds the image; the command names no image
+    if (connect_path && argc >= 2) return run_client(connect_path, argc - 1, argv + 1, threads);
+    
     if (argc < 3) {
-        print_usage(argv[0]);
+        print_usage(prog);
         return 1;
     }
     
     const char *disk_image = argv[1];
     const char *command = argv[2];
     
-    // Open disk image
-    if (disk_open(disk_image) != 0) {
-        fprintf(stderr, "Error: Cannot open disk image '%s'\n", disk_image);
-        return 1;
+    // Read-mostly commands walk metadata in place through a mapping, and so
+    // do the long-lived mounts of serve and batch, which answer ls, stat and
+    // check too (a mapped check runs on several threads)
+    if (!(mount_flags & VSFS_DIRECT) &&
+        (strcmp(command, "ls") == 0 || strcmp(command, "stat") == 0 ||
+         strcmp(command, "check") == 0 || strcmp(command, "serve") == 0 ||
+         strcmp(command, "batch") == 0)) {
+        mount_flags |= VSFS_MMAP;
     }
     
+    vsfs_t *fs = vsfs_mount(disk_image, mount_flags);
+    if (!fs) return 1;
+    vsfs_set_events(fs, print_event, NULL);
+    
     // Execute command
     int ret = 0;
     
-    if (strcmp(command, "create") == 0) {
+    if (strcmp(command, "serve") == 0) {
         if (argc < 4) {
-            fprintf(stderr, "Error: create requires a filename\n");
-            print_usage(argv[0]);
+            fprintf(stderr, "Error: serve requires a socket path\n");
+            print_usage(prog);
             ret = 1;
         } else {
-            ret = create(argv[3]);
+            ret = vsfs_serve(fs, argv[3], threads) != 0;
         }
-    } 
-    else if (strcmp(command, "install") == 0) {
-        ret = install();
     }
-    else if (strcmp(command, "ls") == 0) {
-        cmd_ls();
-    }
-    else if (strcmp(command, "stat") == 0) {
-        cmd_stat();
-    }
-    else if (strcmp(command, "check") == 0) {
-        cmd_check();
+    else if (strcmp(command, "batch") == 0) {
+        ret = cmd_batch(fs, argc - 3, argv + 3, threads);
     }
     else {
-        fprintf(stderr, "Error: Unknown command '%s'\n", command);
-        print_usage(argv[0]);
-        ret = 1;
+        ret = run_command(fs, argc - 2, argv + 2, threads, prog);
     }
     
-    disk_close();
+    vsfs_unmount(fs);
+    
+    // Counted through the unmount, which writes back the buffer cache
+    if (iostat) {
+        printf("\n");
+        iostat_print(stdout);
+    }
+    const char *dump = getenv(IOSTAT_ENV);
+    if (dump && dump[0] && iostat_dump(dump) != 0) ret = 1;
     return ret;
 }
@@ -1,34 +1,86 @@
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "vsfs.h"
 #include "disk.h"
+#include "journal.h"
 
-#define VSFS_MAGIC 0x56534653  // "VSFS"
-#define TOTAL_BLOCKS 85
+static uint32_t div_round_up(uint64_t n, uint64_t d) {
+    return (uint32_t)((n + d - 1) / d);
+}
 
-void create_disk_image(const char *filename) {
+// Lay out the regions for the requested sizes. Data blocks take whatever is
+// left, less the data bitmap that tracks them.
+static int compute_geometry(superblock_t *sb, uint32_t num_blocks, uint32_t num_inodes,
+                            uint32_t journal_blocks) {
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = VSFS_MAGIC;
+    sb->num_blocks = num_blocks;
+    sb->num_inodes = num_inodes;
+    sb->journal_blocks = journal_blocks;
+    
+    if (num_inodes == 0) {
+        fprintf(stderr, "Error: At least one inode is required\n");
+        return -1;
+    }
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+        fprintf(stderr, "Error: Journal needs at least %d blocks\n", MIN_JOURNAL_BLOCKS);
+        return -1;
+    }
+    
+    sb->inode_bitmap_blocks = div_round_up(num_inodes, BITS_PER_BLOCK);
+    sb->inode_table_blocks = div_round_up(num_inodes, INODES_PER_BLOCK);
+    
+    uint64_t fixed = (uint64_t)JOURNAL_START + journal_blocks + sb->inode_bitmap_blocks +
+                     sb->inode_table_blocks;
+    if (fixed + 2 > num_blocks) {
+        fprintf(stderr, "Error: %u blocks is too small for %u inodes and a %u-block journal\n",
+                num_blocks, num_inodes, journal_blocks);
+        return -1;
+    }
+    
+    // Each data bitmap block covers BITS_PER_BLOCK data blocks
+    uint32_t remaining = num_blocks - (uint32_t)fixed;
+    sb->data_bitmap_blocks = div_round_up(remaining, BITS_PER_BLOCK + 1);
+    sb->data_blocks_count = remaining - sb->data_bitmap_blocks;
+    
+    sb->inode_bitmap_block = JOURNAL_START + journal_blocks;
+    sb->data_bitmap_block = sb->inode_bitmap_block + sb->inode_bitmap_blocks;
+    sb->inode_table_start = sb->data_bitmap_block + sb->data_bitmap_blocks;
+    sb->data_blocks_start = sb->inode_table_start + sb->inode_table_blocks;
+    
+    // Free-count summary groups cover as many bitmap blocks as it takes for
+    // both bitmaps' groups to fit in the superblock block
+    uint32_t bitmap_blocks = sb->inode_bitmap_blocks + sb->data_bitmap_blocks;
+    sb->group_blocks = bitmap_blocks <= SUMMARY_SLOTS ? 1 :
+                       div_round_up(bitmap_blocks, SUMMARY_SLOTS - 2);
+    return 0;
+}
+
+static void create_disk_image(const char *filename, uint32_t num_blocks) {
     FILE *fp = fopen(filename, "wb");
     if (!fp) {
         perror("Failed to create disk image");
         exit(1);
     }
     
-    // Create empty disk
-    uint8_t zero_block[BLOCK_SIZE];
-    memset(zero_block, 0, BLOCK_SIZE);
-    
-    for (int i = 0; i < TOTAL_BLOCKS; i++) {
-        fwrite(zero_block, 1, BLOCK_SIZE, fp);
+    // Create empty disk. The image is sparse: every block reads as zero, so
+    // only metadata that is not all zero has to be written.
+    if (ftruncate(fileno(fp), (off_t)num_blocks * BLOCK_SIZE) != 0) {
+        perror("Failed to size disk image");
+        fclose(fp);
+        exit(1);
     }
     
     fclose(fp);
-    printf("Created disk image: %s (%d blocks, %d bytes)\n", 
-           filename, TOTAL_BLOCKS, TOTAL_BLOCKS * BLOCK_SIZE);
+    printf("Created disk image: %s (%u blocks, %llu bytes)\n",
+           filename, num_blocks, (unsigned long long)num_blocks * BLOCK_SIZE);
 }
 
-void format_vsfs(const char *filename) {
-    if (disk_open(filename) != 0) {
+static void format_vsfs(const char *filename, const superblock_t *geometry) {
+    if (disk_open(filename, 0) != 0) {
         fprintf(stderr, "Error: Cannot open disk image\n");
         exit(1);
     }
@@ -37,35 +89,35 @@ void format_vsfs(const char *filename) {
     
     // 1. Write superblock
     memset(block, 0, BLOCK_SIZE);
-    superblock_t *sb = (superblock_t *)block;
-    sb->magic = VSFS_MAGIC;
-    sb->num_blocks = TOTAL_BLOCKS;
-    sb->num_inodes = MAX_INODES;
-    sb->inode_bitmap_block = INODE_BITMAP_BLOCK;
-    sb->data_bitmap_block = DATA_BITMAP_BLOCK;
-    sb->inode_table_start = INODE_TABLE_START;
-    sb->data_blocks_start = DATA_BLOCKS_START;
-    
-    if (disk_write(SUPERBLOCK_BLOCK, block) != 0) {
+    memcpy(block, geometry, sizeof(*geometry));
+    
+    // Everything is free but the root inode and its directory block
+    summary_rebuild(block, NULL, NULL);
+    superblock_t *counts = (superblock_t *)block;
+    counts->free_inodes--;
+    counts->free_blocks--;
+    (*summary_free(block, 0, 0))--;
+    (*summary_free(block, 1, 0))--;
+    counts->inode_rotor = 1;
+    counts->data_rotor = 1;
+    
+    if (disk_write(SUPERBLOCK_BLOCK, block) != 0 || disk_load_superblock() != 0) {
         fprintf(stderr, "Error: Failed to write superblock\n");
         exit(1);
     }
     printf("Wrote superblock\n");
     
-    // 2. Clear journal
-    memset(block, 0, BLOCK_SIZE);
-    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
-        if (disk_write(JOURNAL_START + i, block) != 0) {
-            fprintf(stderr, "Error: Failed to clear journal\n");
-            exit(1);
-        }
+    // 2. Initialize journal
+    if (journal_format() != 0) {
+        fprintf(stderr, "Error: Failed to initialize journal\n");
+        exit(1);
     }
-    printf("Cleared journal (%d blocks)\n", JOURNAL_BLOCKS);
+    printf("Initialized journal (%u blocks)\n", disk_sb.journal_blocks);
     
     // 3. Initialize inode bitmap (mark inode 0 for root)
     memset(block, 0, BLOCK_SIZE);
     bitmap_set(block, 0);  // Root inode
-    if (disk_write(INODE_BITMAP_BLOCK, block) != 0) {
+    if (disk_write(disk_sb.inode_bitmap_block, block) != 0) {
         fprintf(stderr, "Error: Failed to write inode bitmap\n");
         exit(1);
     }
@@ -74,7 +126,7 @@ void format_vsfs(const char *filename) {
     // 4. Initialize data bitmap (mark block 0 for root directory)
     memset(block, 0, BLOCK_SIZE);
     bitmap_set(block, 0);  // Root directory data block
-    if (disk_write(DATA_BITMAP_BLOCK, block) != 0) {
+    if (disk_write(disk_sb.data_bitmap_block, block) != 0) {
         fprintf(stderr, "Error: Failed to write data bitmap\n");
         exit(1);
     }
@@ -84,71 +136,91 @@ void format_vsfs(const char *filename) {
     memset(block, 0, BLOCK_SIZE);
     inode_t *inodes = (inode_t *)block;
     
-    // Create root inode (inode 0)
+    // Create root inode (inode 0); its directory block starts out empty
     inodes[0].type = T_DIR;
     inodes[0].size = 0;
     inodes[0].nlink = 1;
-    inodes[0].blocks[0] = DATA_BLOCKS_START;  // First data block
+    inodes[0].blocks[0] = disk_sb.data_blocks_start;  // First data block
     
-    if (disk_write(INODE_TABLE_START, block) != 0) {
+    if (disk_write(disk_sb.inode_table_start, block) != 0) {
         fprintf(stderr, "Error: Failed to write inode table block 0\n");
         exit(1);
     }
-    
-    // Write second inode table block (empty)
-    memset(block, 0, BLOCK_SIZE);
-    if (disk_write(INODE_TABLE_START + 1, block) != 0) {
-        fprintf(stderr, "Error: Failed to write inode table block 1\n");
-        exit(1);
-    }
     printf("Initialized inode table\n");
     
-    // 6. Initialize root directory (empty)
-    memset(block, 0, BLOCK_SIZE);
-    if (disk_write(DATA_BLOCKS_START, block) != 0) {
-        fprintf(stderr, "Error: Failed to write root directory\n");
+    if (disk_sync() != 0) {
+        fprintf(stderr, "Error: Failed to sync disk image\n");
         exit(1);
     }
-    printf("Initialized root directory\n");
-    
-    // 7. Clear remaining data blocks
-    memset(block, 0, BLOCK_SIZE);
-    for (int i = 1; i < DATA_BLOCKS_COUNT; i++) {
-        if (disk_write(DATA_BLOCKS_START + i, block) != 0) {
-            fprintf(stderr, "Error: Failed to clear data block %d\n", i);
-            exit(1);
-        }
-    }
-    printf("Cleared data blocks\n");
-    
-    disk_close();
     
+    const superblock_t *sb = &disk_sb;
     printf("\nVSFS formatted successfully!\n");
     printf("  Superblock:    block %d\n", SUPERBLOCK_BLOCK);
-    printf("  Journal:       blocks %d-%d (%d blocks)\n", 
-           JOURNAL_START, JOURNAL_START + JOURNAL_BLOCKS - 1, JOURNAL_BLOCKS);
-    printf("  Inode bitmap:  block %d\n", INODE_BITMAP_BLOCK);
-    printf("  Data bitmap:   block %d\n", DATA_BITMAP_BLOCK);
-    printf("  Inode table:   blocks %d-%d\n", INODE_TABLE_START, INODE_TABLE_START + INODE_TABLE_BLOCKS - 1);
-    printf("  Data blocks:   blocks %d-%d (%d blocks)\n", 
-           DATA_BLOCKS_START, DATA_BLOCKS_START + DATA_BLOCKS_COUNT - 1, DATA_BLOCKS_COUNT);
+    printf("  Journal:       blocks %d-%u (%u blocks)\n",
+           JOURNAL_START, JOURNAL_START + sb->journal_blocks - 1, sb->journal_blocks);
+    printf("  Inode bitmap:  blocks %u-%u\n", sb->inode_bitmap_block,
+           sb->inode_bitmap_block + sb->inode_bitmap_blocks - 1);
+    printf("  Data bitmap:   blocks %u-%u\n", sb->data_bitmap_block,
+           sb->data_bitmap_block + sb->data_bitmap_blocks - 1);
+    printf("  Inode table:   blocks %u-%u (%u inodes)\n", sb->inode_table_start,
+           sb->inode_table_start + sb->inode_table_blocks - 1, sb->num_inodes);
+    printf("  Data blocks:   blocks %u-%u (%u blocks)\n",
+           sb->data_blocks_start, sb->num_blocks - 1, sb->data_blocks_count);
+    disk_close();
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <disk_image>\n", prog);
+    fprintf(stderr, "Creates and formats a VSFS disk image\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --blocks=<n>   - Image size in %d-byte blocks (default %d)\n",
+            BLOCK_SIZE, DEFAULT_NUM_BLOCKS);
+    fprintf(stderr, "  --inodes=<n>   - Number of inodes (default %d)\n", DEFAULT_NUM_INODES);
+    fprintf(stderr, "  --journal=<n>  - Journal size in blocks (default %d)\n",
+            DEFAULT_JOURNAL_BLOCKS);
 }
 
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    uint32_t num_blocks = DEFAULT_NUM_BLOCKS;
+    uint32_t num_inodes = DEFAULT_NUM_INODES;
+    uint32_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    
+    // Options precede the disk image
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strncmp(argv[1], "--blocks=", 9) == 0) {
+            num_blocks = (uint32_t)strtoul(argv[1] + 9, NULL, 10);
+        } else if (strncmp(argv[1], "--inodes=", 9) == 0) {
+            num_inodes = (uint32_t)strtoul(argv[1] + 9, NULL, 10);
+        } else if (strncmp(argv[1], "--journal=", 10) == 0) {
+            journal_blocks = (uint32_t)strtoul(argv[1] + 10, NULL, 10);
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[1]);
+            print_usage(prog);
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+    
     if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk_image>\n", argv[0]);
-        fprintf(stderr, "Creates and formats a VSFS disk image\n");
+        print_usage(prog);
         return 1;
     }
     
     const char *filename = argv[1];
     
+    superblock_t geometry;
+    if (compute_geometry(&geometry, num_blocks, num_inodes, journal_blocks) != 0) {
+        return 1;
+    }
+    
     printf("Creating VSFS disk image: %s\n", filename);
     printf("========================================\n\n");
     
-    create_disk_image(filename);
+    create_disk_image(filename, num_blocks);
     printf("\n");
-    format_vsfs(filename);
+    format_vsfs(filename, &geometry);
     
     return 0;
 }
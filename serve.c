@@ -0,0 +1,500 @@
+#define _POSIX_C_SOURCE 200809L
+#include "serve.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// A client connection. Its reader thread queues requests; the workers that
+// answer them share the socket for writing. It is freed when the reader has
+// finished and no request of it is left.
+typedef struct connection {
+    int fd;
+    pthread_mutex_t write_lock;
+    int refs;                         // Reader and queued requests (server lock)
+    struct connection *next;
+} connection_t;
+
+typedef struct request {
+    connection_t *conn;
+    serve_request_t header;
+    char *payload;
+    struct request *next;
+} request_t;
+
+static struct {
+    vsfs_t *fs;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    request_t *head;                  // Request queue
+    request_t *tail;
+    connection_t *conns;              // Connections whose reader is running
+    int readers;
+    int stopping;                     // Workers exit once the queue is empty
+    
+    // Creates share the file system; other operations hold it alone, and
+    // waiting for it holds off new creates
+    int sharers;
+    int exclusive;
+    int exclusive_waiting;
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Transfer exactly `length` bytes; 0 when the peer closed before the first
+static int read_full(int fd, void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char *)buffer + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return done == 0 && n == 0 ? 0 : -1;
+        done += (size_t)n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = send(fd, (const char *)buffer + done, length - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static void enter_shared(void) {
+    pthread_mutex_lock(&server.lock);
+    while (server.exclusive || server.exclusive_waiting > 0) {
+        pthread_cond_wait(&server.changed, &server.lock);
+    }
+    server.sharers++;
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void leave_shared(void) {
+    pthread_mutex_lock(&server.lock);
+    server.sharers--;
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void enter_exclusive(void) {
+    pthread_mutex_lock(&server.lock);
+    server.exclusive_waiting++;
+    while (server.exclusive || server.sharers > 0) {
+        pthread_cond_wait(&server.changed, &server.lock);
+    }
+    server.exclusive_waiting--;
+    server.exclusive = 1;
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void leave_exclusive(void) {
+    pthread_mutex_lock(&server.lock);
+    server.exclusive = 0;
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+}
+
+// Drop a reference; the server lock must be held
+static void conn_put(connection_t *conn) {
+    if (--conn->refs > 0) return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+static void respond(connection_t *conn, uint32_t id, int32_t status, const void *payload,
+                    uint32_t length) {
+    serve_response_t response;
+    response.id = id;
+    response.status = status;
+    response.length = length;
+    
+    // A client that went away just misses its answer
+    pthread_mutex_lock(&conn->write_lock);
+    if (write_full(conn->fd, &response, sizeof(response)) == 0 && length > 0) {
+        write_full(conn->fd, payload, length);
+    }
+    pthread_mutex_unlock(&conn->write_lock);
+}
+
+// SERVE_CREATE: the payload is a run of NUL-terminated names
+static int32_t do_create(const request_t *req) {
+    uint32_t length = req->header.length;
+    if (length == 0 || req->payload[length - 1] != '\0') return -1;
+    
+    int count = 0;
+    for (uint32_t i = 0; i < length; i++) count += req->payload[i] == '\0';
+    const char **names = malloc(count * sizeof(char *));
+    if (!names) return -1;
+    
+    const char *name = req->payload;
+    for (int i = 0; i < count; i++) {
+        names[i] = name;
+        name += strlen(name) + 1;
+    }
+    
+    enter_shared();
+    int ret = vsfs_create(server.fs, names, count);
+    leave_shared();
+    free(names);
+    return ret == 0 ? 0 : -1;
+}
+
+// SERVE_LS reply: every entry, appended to a growing array
+typedef struct {
+    vsfs_dirent_t *entries;
+    int count;
+    int capacity;
+    int failed;
+} listing_t;
+
+static void list_entry(const vsfs_dirent_t *entry, void *arg) {
+    listing_t *list = arg;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        vsfs_dirent_t *grown = realloc(list->entries, capacity * sizeof(vsfs_dirent_t));
+        if (!grown) {
+            list->failed = 1;
+            return;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    list->entries[list->count++] = *entry;
+}
+
+static void handle(const request_t *req) {
+    connection_t *conn = req->conn;
+    uint32_t id = req->header.id;
+    
+    switch (req->header.op) {
+    case SERVE_CREATE:
+        respond(conn, id, do_create(req), NULL, 0);
+        return;
+    case SERVE_INSTALL: {
+        enter_exclusive();
+        int ret = vsfs_install(server.fs);
+        leave_exclusive();
+        respond(conn, id, ret == 0 ? 0 : -1, NULL, 0);
+        return;
+    }
+    case SERVE_LS: {
+        listing_t list;
+        memset(&list, 0, sizeof(list));
+        enter_exclusive();
+        int ret = vsfs_readdir(server.fs, list_entry, &list);
+        leave_exclusive();
+        if (ret < 0 || list.failed ||
+            (uint64_t)list.count * sizeof(vsfs_dirent_t) > SERVE_MAX_PAYLOAD) {
+            respond(conn, id, -1, NULL, 0);
+        } else {
+            respond(conn, id, 0, list.entries, list.count * sizeof(vsfs_dirent_t));
+        }
+        free(list.entries);
+        return;
+    }
+    case SERVE_STAT: {
+        vsfs_stat_t st;
+        enter_exclusive();
+        int ret = vsfs_stat(server.fs, &st);
+        leave_exclusive();
+        respond(conn, id, ret == 0 ? 0 : -1, &st, ret == 0 ? sizeof(st) : 0);
+        return;
+    }
+    case SERVE_CHECK: {
+        enter_exclusive();
+        int errors = vsfs_check(server.fs, 0, stdout);
+        leave_exclusive();
+        respond(conn, id, errors, NULL, 0);
+        return;
+    }
+    default:
+        fprintf(stderr, "Error: Unknown request %u\n", req->header.op);
+        respond(conn, id, -1, NULL, 0);
+    }
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    
+    pthread_mutex_lock(&server.lock);
+    for (;;) {
+        request_t *req = server.head;
+        if (!req) {
+            if (server.stopping) break;
+            pthread_cond_wait(&server.changed, &server.lock);
+            continue;
+        }
+        server.head = req->next;
+        if (!server.head) server.tail = NULL;
+        pthread_mutex_unlock(&server.lock);
+        
+        handle(req);
+        
+        pthread_mutex_lock(&server.lock);
+        conn_put(req->conn);
+        free(req->payload);
+        free(req);
+    }
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+// Read one request; 0 at a clean end of the stream
+static int read_request(connection_t *conn, request_t **out) {
+    serve_request_t header;
+    int ret = read_full(conn->fd, &header, sizeof(header));
+    if (ret <= 0) return ret;
+    if (header.length > SERVE_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Request of %u bytes is too large\n", header.length);
+        return -1;
+    }
+    
+    request_t *req = calloc(1, sizeof(request_t));
+    if (!req) return -1;
+    req->conn = conn;
+    req->header = header;
+    req->payload = malloc(header.length + 1);
+    if (!req->payload || (header.length > 0 &&
+                          read_full(conn->fd, req->payload, header.length) != 1)) {
+        free(req->payload);
+        free(req);
+        return -1;
+    }
+    *out = req;
+    return 1;
+}
+
+static void *reader_main(void *arg) {
+    connection_t *conn = arg;
+    request_t *req;
+    
+    while (read_request(conn, &req) == 1) {
+        pthread_mutex_lock(&server.lock);
+        conn->refs++;
+        if (server.tail) server.tail->next = req;
+        else server.head = req;
+        server.tail = req;
+        pthread_cond_broadcast(&server.changed);
+        pthread_mutex_unlock(&server.lock);
+    }
+    
+    pthread_mutex_lock(&server.lock);
+    connection_t **pp = &server.conns;
+    while (*pp != conn) pp = &(*pp)->next;
+    *pp = conn->next;
+    server.readers--;
+    conn_put(conn);
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+static void start_reader(int fd) {
+    connection_t *conn = calloc(1, sizeof(connection_t));
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    pthread_t thread;
+    pthread_mutex_lock(&server.lock);
+    if (pthread_create(&thread, &attr, reader_main, conn) == 0) {
+        conn->next = server.conns;
+        server.conns = conn;
+        server.readers++;
+    } else {
+        fprintf(stderr, "Error: Failed to start a connection thread\n");
+        conn_put(conn);
+    }
+    pthread_mutex_unlock(&server.lock);
+    pthread_attr_destroy(&attr);
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accept connections until a stop signal arrives. The signals are blocked
+// everywhere but in pselect(), so they always interrupt it.
+static void accept_loop(int listen_fd, const sigset_t *wait_mask) {
+    while (!stop_requested) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(listen_fd, &fds);
+        if (pselect(listen_fd + 1, &fds, NULL, NULL, NULL, wait_mask) <= 0) continue;
+        
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) start_reader(fd);
+    }
+}
+
+// Answer what has been received, then let the workers go
+static void shut_down(pthread_t *threads, int workers) {
+    pthread_mutex_lock(&server.lock);
+    for (connection_t *conn = server.conns; conn; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RD);
+    }
+    while (server.readers > 0) pthread_cond_wait(&server.changed, &server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+    
+    for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+}
+
+int vsfs_serve(vsfs_t *fs, const char *path, int workers) {
+    if (workers <= 0) workers = SERVE_DEFAULT_WORKERS;
+    
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+    
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    int listen_fd = open_socket(path);
+    if (listen_fd < 0) {
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+    
+    server.fs = fs;
+    server.stopping = 0;
+    stop_requested = 0;
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < workers &&
+           pthread_create(&threads[started], NULL, worker_main, NULL) == 0) {
+        started++;
+    }
+    
+    int ret = 0;
+    if (started == 0) {
+        fprintf(stderr, "Error: Failed to start workers\n");
+        ret = -1;
+    } else {
+        printf("Serving on %s with %d workers\n", path, started);
+        fflush(stdout);
+        
+        sigset_t wait_mask = old_mask;
+        sigdelset(&wait_mask, SIGINT);
+        sigdelset(&wait_mask, SIGTERM);
+        accept_loop(listen_fd, &wait_mask);
+    }
+    
+    close(listen_fd);
+    unlink(path);
+    shut_down(threads, started);
+    free(threads);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return ret;
+}
+
+int serve_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Failed to connect to server");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_send(int fd, uint32_t id, uint16_t op, const void *payload, uint32_t length) {
+    serve_request_t header;
+    header.id = id;
+    header.op = op;
+    header.reserved = 0;
+    header.length = length;
+    if (write_full(fd, &header, sizeof(header)) != 0 ||
+        (length > 0 && write_full(fd, payload, length) != 0)) {
+        perror("Failed to send request");
+        return -1;
+    }
+    return 0;
+}
+
+int serve_recv(int fd, serve_response_t *response, void **payload) {
+    *payload = NULL;
+    if (read_full(fd, response, sizeof(*response)) != 1 ||
+        response->length > SERVE_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Lost connection to server\n");
+        return -1;
+    }
+    if (response->length == 0) return 0;
+    
+    *payload = malloc(response->length);
+    if (!*payload || read_full(fd, *payload, response->length) != 1) {
+        fprintf(stderr, "Error: Lost connection to server\n");
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int serve_call(int fd, uint16_t op, const void *payload, uint32_t length,
+               serve_response_t *response, void **reply) {
+    if (serve_send(fd, 0, op, payload, length) != 0) return -1;
+    return serve_recv(fd, response, reply);
+}
@@ -0,0 +1,57 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+#include "libvsfs.h"
+
+// vsfs serve: one process keeps an image mounted, its metadata in memory,
+// and answers requests from local clients over an AF_UNIX stream socket.
+// Clients may pipeline: every request carries an id, and its response,
+// tagged with the same id, may come back before those of earlier requests.
+// Creates run side by side on a pool of workers, so creates from every
+// client share journal transactions; install, ls, stat and check run alone.
+//
+// Wire format, in host byte order (the socket is local): a request header
+// followed by `length` payload bytes, answered by a response header followed
+// by `length` bytes.
+typedef struct {
+    uint32_t id;
+    uint16_t op;
+    uint16_t reserved;
+    uint32_t length;
+} serve_request_t;
+
+typedef struct {
+    uint32_t id;
+    int32_t status;                   // 0, or -1 on failure; check: errors found
+    uint32_t length;
+} serve_response_t;
+
+// Operations, with their payloads
+enum {
+    SERVE_CREATE = 1,                 // Request: NUL-terminated names, one transaction
+    SERVE_INSTALL,
+    SERVE_LS,                         // Response: vsfs_dirent_t array
+    SERVE_STAT,                       // Response: vsfs_stat_t
+    SERVE_CHECK                       // Response: none; the report is printed by the server
+};
+
+#define SERVE_MAX_PAYLOAD (1u << 20)
+#define SERVE_DEFAULT_WORKERS 16
+
+// Serve `fs` on a socket created at `path` until SIGINT or SIGTERM, with
+// `workers` threads (0: SERVE_DEFAULT_WORKERS). Requests already received
+// are answered before it returns. Returns -1 if the socket cannot be set up.
+int vsfs_serve(vsfs_t *fs, const char *path, int workers);
+
+// Client side. serve_send() and serve_recv() pipeline; serve_call() sends
+// one request and waits for its response. A response payload is returned in
+// a malloc()ed buffer (NULL when empty) that the caller frees. All return -1
+// if the connection fails.
+int serve_connect(const char *path);
+int serve_send(int fd, uint32_t id, uint16_t op, const void *payload, uint32_t length);
+int serve_recv(int fd, serve_response_t *response, void **payload);
+int serve_call(int fd, uint16_t op, const void *payload, uint32_t length,
+               serve_response_t *response, void **reply);
+
+#endif // SERVE_H
@@ -79,17 +79,373 @@ echo ""
 # Test multiple creates before install
 echo "Step 9: Testing multiple transactions"
 echo "--------------------------------------"
-echo "(Note: With 16-block journal and 11 blocks/transaction,"
-echo " we can only buffer 1 transaction before install)"
+echo "(Note: a single create logs only the bytes it changes as deltas,"
+echo " 3 journal blocks per transaction)"
 $VSFS "$DISK_IMAGE" create alpha.txt
-echo "Journal now full, must install before next create..."
-$VSFS "$DISK_IMAGE" install
 $VSFS "$DISK_IMAGE" create beta.txt
 $VSFS "$DISK_IMAGE" install
 $VSFS "$DISK_IMAGE" ls
 $VSFS "$DISK_IMAGE" check
 echo ""
 
+# Batched creates: many files, one transaction
+echo "Step 10: Creating a batch of files in one transaction"
+echo "------------------------------------------------------"
+printf 'list1.txt\nlist2.txt\nlist3.txt\n' > batch_list.txt
+$VSFS "$DISK_IMAGE" create batch1.txt batch2.txt batch3.txt batch4.txt
+$VSFS "$DISK_IMAGE" create --from batch_list.txt
+rm -f batch_list.txt
+$VSFS "$DISK_IMAGE" install
+$VSFS "$DISK_IMAGE" ls
+$VSFS "$DISK_IMAGE" check
+echo ""
+
+# Journal fills up: the next create checkpoints in line instead of failing
+echo "Step 11: Automatic checkpoint when the journal is full"
+echo "-------------------------------------------------------"
+for i in 1 2 3 4 5 6; do
+    $VSFS "$DISK_IMAGE" create auto$i.txt
+done | tee auto_create.log
+grep -q "checkpointed" auto_create.log
+rm -f auto_create.log
+$VSFS "$DISK_IMAGE" install
+$VSFS "$DISK_IMAGE" stat
+$VSFS "$DISK_IMAGE" check
+echo ""
+
+# A crash while the transaction was being written: its checksum no longer
+# matches, so install must discard it instead of applying garbage
+echo "Step 12: Torn transaction is rejected by its checksum"
+echo "------------------------------------------------------"
+start=$($VSFS "$DISK_IMAGE" create torn.txt | sed -n 's/.*logged to journal (blocks \([0-9]*\)-.*/\1/p')
+printf 'garbage' | dd of="$DISK_IMAGE" bs=4096 seek=$((2 + (start + 1) % 15)) conv=notrunc 2>/dev/null
+$VSFS "$DISK_IMAGE" install | tee torn_install.log
+grep -q "Discarding torn transaction" torn_install.log
+rm -f torn_install.log
+if $VSFS "$DISK_IMAGE" ls | grep -q "torn.txt"; then
+    echo "Torn transaction was applied"
+    exit 1
+fi
+$VSFS "$DISK_IMAGE" check
+echo ""
+
+# Geometry comes from the superblock: multi-block bitmaps and inode table
+echo "Step 13: Formatting a larger image"
+echo "-----------------------------------"
+$MKFS --blocks=100000 --inodes=70000 --journal=64 large.img
+$VSFS large.img create $(seq -f "big%g.txt" 1 100)
+$VSFS large.img install
+$VSFS large.img stat | tee large_stat.log
+grep -q "Used inodes:  101 / 70000" large_stat.log
+rm -f large_stat.log
+$VSFS large.img check | grep -q "consistent"
+rm -f large.img
+echo ""
+
+# A directory outgrowing its block switches to a hashed index
+echo "Step 14: Hashed directory index"
+echo "--------------------------------"
+$MKFS --blocks=5000 --inodes=1000 --journal=256 dir.img > /dev/null
+for batch in 1 2 3; do
+    $VSFS dir.img create $(seq -f "dir${batch}_%g.txt" 1 100) > /dev/null
+done
+if $VSFS dir.img create dir2_50.txt 2>/dev/null; then
+    echo "Duplicate name in indexed directory was accepted"
+    exit 1
+fi
+$VSFS dir.img install
+$VSFS dir.img ls | grep -q "Total: 300 files"
+$VSFS dir.img check | tee dir_check.log
+grep -q "consistent" dir_check.log
+rm -f dir.img dir_check.log
+echo ""
+
+# New files are extent mapped; check validates each extent as one run
+echo "Step 15: Extent-mapped files"
+echo "-----------------------------"
+$MKFS extent.img > /dev/null
+$VSFS extent.img create extent.txt > /dev/null
+$VSFS extent.img install > /dev/null
+$VSFS extent.img check | grep -q "consistent"
+# Stretch inode 1's first extent (its length is at byte 92 of the inode
+# table) past the end of the disk
+printf '\xff\xff\x00\x00' | dd of=extent.img bs=1 seek=$((19 * 4096 + 92)) conv=notrunc 2>/dev/null
+if $VSFS extent.img check > extent_check.log; then
+    echo "Error: check of a corrupt image succeeded"
+    exit 1
+fi
+cat extent_check.log
+grep -q "invalid extent" extent_check.log
+rm -f extent.img extent_check.log
+echo ""
+
+# stat reads the free counts kept in the superblock; check recounts them
+echo "Step 16: Free-count summaries"
+echo "------------------------------"
+$MKFS counts.img > /dev/null
+$VSFS counts.img create one.txt two.txt > /dev/null
+$VSFS counts.img install > /dev/null
+$VSFS counts.img stat | grep -q "Used inodes:  3 / 64"
+# Clobber the free block count (byte 60 of the superblock)
+printf '\x07\x00\x00\x00' | dd of=counts.img bs=1 seek=60 conv=notrunc 2>/dev/null
+$VSFS counts.img stat | grep -q "Free blocks:  7$"
+$VSFS counts.img check | tee counts_check.log
+grep -q "Rebuilt free counts" counts_check.log
+$VSFS counts.img stat | grep -q "Free blocks:  62$"
+rm -f counts.img counts_check.log
+echo ""
+
+# Two inodes sharing a block are caught by check's shadow bitmap
+echo "Step 17: Doubly-allocated blocks"
+echo "---------------------------------"
+$MKFS shared.img > /dev/null
+$VSFS shared.img create first.txt second.txt > /dev/null
+$VSFS shared.img install > /dev/null
+# Point inode 2's extent (start at byte 148 of the inode table) at inode 1's
+dd if=shared.img of=shared.img bs=1 skip=$((19 * 4096 + 88)) seek=$((19 * 4096 + 148)) \
+    count=4 conv=notrunc 2>/dev/null
+$VSFS --threads=2 shared.img check > shared_check.log || true
+cat shared_check.log
+grep -q "also used by another inode" shared_check.log
+grep -q "not used (leak)" shared_check.log
+rm -f shared.img shared_check.log
+echo ""
+
+# Concurrent creators share transactions; the directory lock lets only one
+# of several creates of the same name through
+echo "Step 18: Concurrent creators"
+echo "----------------------------"
+$MKFS threads.img > /dev/null
+$VSFS --threads=4 threads.img create $(seq -f "thread%g.txt" 1 40) > threads.log
+echo "$(grep -c "logged to journal" threads.log) transactions for 40 files"
+if $VSFS --threads=4 threads.img create same.txt same.txt same.txt same.txt > /dev/null 2>&1; then
+    echo "Error: duplicate concurrent creates should fail"
+    exit 1
+fi
+$VSFS threads.img install > /dev/null
+$VSFS threads.img ls | grep -q "Total: 41 files"
+$VSFS threads.img check | grep -q "consistent"
+$VSFS threads.img stat | grep -q "Free inodes:  22$"
+rm -f threads.img threads.log
+echo "  40 concurrent files and one of four same-named creates installed"
+echo ""
+
+# Installs and journal writes go out as batches with many writes in flight;
+# the image must come out the same as with one write at a time
+echo "Step 19: Batched writes"
+echo "-----------------------"
+$MKFS --blocks=4096 --inodes=1024 --journal=512 batch.img > /dev/null
+seq -f "batch%g.txt" 1 600 > batch_names.txt
+$VSFS batch.img create --from batch_names.txt > /dev/null
+cp batch.img serial.img
+$VSFS batch.img install > /dev/null
+$VSFS --queue-depth=1 serial.img install > /dev/null
+cmp batch.img serial.img
+$VSFS batch.img check | grep -q "consistent"
+rm -f batch.img serial.img batch_names.txt
+echo "  Batched and one-at-a-time installs wrote identical images"
+echo ""
+
+# Replay reads the log up to the head hint in one request; a transaction
+# whose superblock update was lost lies past the hint and is read on demand
+echo "Step 20: Journal read-ahead"
+echo "---------------------------"
+$MKFS ahead.img > /dev/null
+$VSFS ahead.img create first.txt > /dev/null
+dd if=ahead.img of=ahead_jsb.bin bs=4096 skip=1 count=1 2>/dev/null
+$VSFS ahead.img create second.txt third.txt > /dev/null
+# Put back the journal superblock from before the second transaction
+dd if=ahead_jsb.bin of=ahead.img bs=4096 seek=1 conv=notrunc 2>/dev/null
+$VSFS ahead.img install | grep -q "Install complete: 2 transactions"
+$VSFS ahead.img ls | grep -q "Total: 3 files"
+$VSFS ahead.img check | grep -q "consistent"
+rm -f ahead.img ahead_jsb.bin
+echo "  Transactions past a stale head hint were replayed"
+echo ""
+
+# vsfs_bench runs every workload on its own scratch image and reports one
+# row per workload
+echo "Step 21: Benchmark harness"
+echo "--------------------------"
+./vsfs_bench --image=bench_smoke.img --ops=20 --workloads=create,install:5,ls,stat,check:2 \
+    --files=50 --format=csv > bench_smoke.csv
+cat bench_smoke.csv
+[ "$(wc -l < bench_smoke.csv)" -eq 6 ]
+# Every create logs at least a descriptor, a commit and the journal superblock
+awk -F, '$1 == "create" && $8 >= 3 * 4096 { found = 1 } END { exit !found }' bench_smoke.csv
+[ ! -f bench_smoke.img ]
+rm -f bench_smoke.csv
+echo ""
+
+# --iostat prints the disk, cache and journal counters; VSFS_IOSTAT dumps
+# them as JSON when the command exits
+echo "Step 22: I/O statistics"
+echo "-----------------------"
+$MKFS iostat.img > /dev/null
+$VSFS --iostat iostat.img create one.txt two.txt | tee iostat.log
+grep -q "Journal:      1 transactions" iostat.log
+VSFS_IOSTAT=iostat.json $VSFS iostat.img install > /dev/null
+grep -q '"checkpoints": 1,' iostat.json
+grep -q '"inode_table": {"bytes_read": [0-9]*, "bytes_written": 4096}' iostat.json
+rm -f iostat.img iostat.log iostat.json
+echo ""
+
+# vsfs serve keeps the image mounted; pipelined creates from several
+# clients share its journal transactions
+echo "Step 23: Serve daemon"
+echo "---------------------"
+$MKFS --blocks=4096 --inodes=1024 --journal=512 serve.img > /dev/null
+rm -f serve.sock
+$VSFS serve.img serve serve.sock > serve.log &
+SERVE_PID=$!
+for i in $(seq 50); do [ -S serve.sock ] && break; sleep 0.1; done
+for client in 1 2 3 4; do
+    $VSFS --connect=serve.sock --threads=8 create $(seq -f "serve${client}_%g.txt" 1 25) &
+done
+wait $(jobs -p | grep -v "^$SERVE_PID$")
+$VSFS --connect=serve.sock create listed.txt
+$VSFS --connect=serve.sock install
+$VSFS --connect=serve.sock ls | grep -q "Total: 101 files"
+$VSFS --connect=serve.sock stat | grep -q "Used inodes:  102"
+$VSFS --connect=serve.sock check | grep -q "consistent"
+kill -TERM $SERVE_PID
+wait $SERVE_PID
+[ ! -S serve.sock ]
+$VSFS serve.img check | grep -q "consistent"
+rm -f serve.img serve.log
+echo "  Four clients created 100 files through one server"
+echo ""
+
+# batch runs a script's commands on one mount and stops at the first
+# failing line
+echo "Step 24: Batch scripts"
+echo "----------------------"
+$MKFS batchmode.img > /dev/null
+cat > batchmode.script <<'SCRIPT'
+# provision
+create one.txt two.txt
+create three.txt    # second transaction
+
+install
+ls
+check
+SCRIPT
+$VSFS batchmode.img batch --timing batchmode.script | tee batchmode.log
+grep -q "Total: 3 files" batchmode.log
+grep -q "consistent" batchmode.log
+grep -q "^\[3\] create: [0-9.]* ms" batchmode.log
+grep -q "^Batch: 5 commands" batchmode.log
+if printf 'create two.txt\ninstall\n' | $VSFS batchmode.img batch 2>/dev/null | grep -q "Install"; then
+    echo "Error: batch ran past a failing command"
+    exit 1
+fi
+printf 'create four.txt\ninstall\nls\n' | $VSFS batchmode.img batch | grep -q "Total: 4 files"
+# A check that finds errors stops the script like any other failure (inode
+# 1's first extent length is at byte 92 of the inode table)
+printf '\xff\xff\x00\x00' | dd of=batchmode.img bs=1 seek=$((19 * 4096 + 92)) conv=notrunc 2>/dev/null
+if printf 'check\nls\n' | $VSFS batchmode.img batch > batchmode.log 2>&1; then
+    echo "Error: batch succeeded past a failing check"
+    exit 1
+fi
+grep -q "Line 1 failed: check" batchmode.log
+if grep -q "Total:" batchmode.log; then
+    echo "Error: batch ran past a failing check"
+    exit 1
+fi
+rm -f batchmode.img batchmode.script batchmode.log
+echo ""
+
+echo "Step 25: File data"
+echo "------------------"
+$MKFS --blocks=4096 --journal=64 filedata.img > /dev/null
+head -c 3145851 /dev/urandom > filedata.src
+head -c 5000 /dev/urandom > filedata.tail
+$VSFS filedata.img write big.bin filedata.src | grep -q "Wrote 3145851 bytes to big.bin"
+$VSFS filedata.img install > /dev/null
+$VSFS filedata.img cat big.bin | cmp - filedata.src
+cat filedata.tail | $VSFS filedata.img append big.bin - | grep -q "Appended 5000 bytes"
+$VSFS filedata.img install > /dev/null
+cat filedata.src filedata.tail > filedata.both
+$VSFS --direct filedata.img cat big.bin | cmp - filedata.both
+$VSFS --direct filedata.img write small.bin filedata.tail > /dev/null
+$VSFS --mmap filedata.img append small.bin filedata.tail > /dev/null
+# A rewrite that shrinks a file frees the blocks past its new size
+used() { $VSFS filedata.img stat | awk '/Used blocks/ { print $3 }'; }
+before=$(used)
+$VSFS filedata.img write big.bin filedata.tail > /dev/null
+$VSFS filedata.img install > /dev/null
+echo "  Rewrite to 5000 bytes: $before -> $(used) blocks used"
+[ "$(used)" -lt "$((before - 700))" ]
+$VSFS filedata.img cat big.bin | cmp - filedata.tail
+cat filedata.tail filedata.tail | cmp - <($VSFS filedata.img cat small.bin)
+$VSFS filedata.img ls | grep -q "big.bin .* 5000$"
+# Interleaved appends give a file extents in index blocks, which go too
+for i in 1 2 3 4 5 6 7 8; do
+    $VSFS filedata.img append frag.bin filedata.tail > /dev/null
+    $VSFS filedata.img append small.bin filedata.tail > /dev/null
+done
+$VSFS filedata.img install > /dev/null
+before=$(used)
+printf 'abc' | $VSFS filedata.img write frag.bin > /dev/null
+$VSFS filedata.img install > /dev/null
+[ "$(used)" -lt "$before" ]
+[ "$($VSFS filedata.img cat frag.bin)" = "abc" ]
+$VSFS filedata.img check | tee filedata.log
+grep -q "consistent" filedata.log
+rm -f filedata.img filedata.src filedata.tail filedata.both filedata.log
+echo ""
+
+echo "Step 26: Creates into a large journal"
+echo "-------------------------------------"
+# Reading a block through the journal must not cost a pass over every live
+# record: with the index by destination and the cached images of blocks
+# with deltas, each record is looked at about once per process, so the
+# records looked at stay under one per lookup plus the journal's records
+$MKFS --blocks=32768 --inodes=8192 --journal=16384 bigjournal.img > /dev/null
+seq -f "create early_%g" 1 4000 > bigjournal.script
+$VSFS --journal-hwm=0 bigjournal.img batch bigjournal.script > /dev/null
+seq -f "create late_%g" 1 1000 > bigjournal.script
+$VSFS --journal-hwm=0 --iostat bigjournal.img batch bigjournal.script > bigjournal.log
+lookups=$(sed -n 's/.*Lookups: *\([0-9]*\) blocks.*/\1/p' bigjournal.log)
+looked=$(sed -n 's/.*journal, \([0-9]*\) records looked at.*/\1/p' bigjournal.log)
+$VSFS bigjournal.img install > bigjournal.log
+grep -q "5000 transactions" bigjournal.log
+records=$(sed -n 's/.*transactions, \([0-9]*\) records applied.*/\1/p' bigjournal.log)
+echo "  1000 creates after 4000: $lookups lookups looked at $looked of $records records"
+if [ "$looked" -gt "$((lookups + records))" ]; then
+    echo "Error: reads through the journal look at records more than once"
+    exit 1
+fi
+$VSFS bigjournal.img ls | grep -q "Total: 5000 files"
+$VSFS bigjournal.img check | grep -q "consistent"
+rm -f bigjournal.img bigjournal.script bigjournal.log
+echo ""
+
+# A name list larger than one transaction can hold is created in groups,
+# each all or nothing; a taken name stops the list at its group
+echo "Step 27: Create lists larger than a transaction"
+echo "-----------------------------------------------"
+$MKFS --blocks=16384 --inodes=8192 --journal=2048 biglist.img > /dev/null
+seq -f "old_%g" 1 3000 > biglist.txt
+$VSFS biglist.img create --from biglist.txt > /dev/null
+$VSFS biglist.img install > /dev/null
+seq -f "new_%g" 1 1000 > biglist.txt
+$VSFS biglist.img create --from biglist.txt > biglist.log
+echo "  1000 names in $(grep -c "logged to journal" biglist.log) transactions"
+[ "$(grep -c "logged to journal" biglist.log)" -gt 1 ]
+seq -f "late_%g" 1 100 > biglist.txt
+echo "old_7" >> biglist.txt
+if $VSFS biglist.img create --from biglist.txt > /dev/null 2> biglist.log; then
+    echo "Error: a list with a taken name was created"
+    exit 1
+fi
+grep -q "already exists" biglist.log
+$VSFS biglist.img install > /dev/null
+$VSFS biglist.img ls | grep -q "Total: 4088 files"
+$VSFS biglist.img check | grep -q "consistent"
+rm -f biglist.img biglist.txt biglist.log
+echo ""
+
 echo "========================================="
 echo "All tests completed successfully!"
 echo "========================================="
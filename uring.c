@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+int uring_open(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0) return -1;
+    ring->entries = params.sq_entries;
+    
+    // The queues are mapped separately, which every kernel accepts
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = map_ring(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+    ring->cq_map = map_ring(ring->fd, ring->cq_map_size, IORING_OFF_CQ_RING);
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sq_map || !ring->cq_map || !ring->sqes) {
+        int saved = errno;
+        uring_close(ring);
+        errno = saved;
+        return -1;
+    }
+    
+    uint8_t *sq = ring->sq_map;
+    uint8_t *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_ktail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+    ring->sq_tail = *ring->sq_ktail;
+    return 0;
+}
+
+void uring_close(uring_t *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Next submission entry, zeroed, or NULL when the queue is full
+static struct io_uring_sqe *get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head >= ring->entries) return NULL;
+    
+    unsigned index = ring->sq_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_prep_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = (unsigned)iovcnt;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_drain_fdatasync(uring_t *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_submit(uring_t *ring, unsigned wait) {
+    // Entries must be complete before the kernel can see the new tail
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    
+    int n;
+    do {
+        n = sys_enter(ring->fd, ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    
+    // Entries the kernel did not take yet go with the next submit
+    ring->to_submit -= (unsigned)n;
+    return 0;
+}
+
+unsigned uring_unqueue(uring_t *ring) {
+    unsigned count = ring->to_submit;
+    ring->sq_tail -= count;
+    ring->to_submit = 0;
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+int uring_next_cqe(uring_t *ring, uring_cqe_t *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    
+    const struct io_uring_cqe *entry = (const struct io_uring_cqe *)ring->cqes +
+                                       (head & *ring->cq_mask);
+    cqe->user_data = entry->user_data;
+    cqe->res = entry->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,64 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A minimal io_uring ring over the raw system calls (no liburing). The
+// submission queue maps slot i to entry i, so entries are used in order.
+// The kernel structures stay in uring.c: <linux/io_uring.h> pulls in
+// <linux/fs.h>, whose BLOCK_SIZE would replace ours.
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned sq_tail;                 // Local tail, published by uring_submit()
+    unsigned to_submit;               // Entries queued since the last submit
+    
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;
+    
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+// A completion: the caller's tag and the result (bytes, or -errno)
+typedef struct {
+    uint64_t user_data;
+    int32_t res;
+} uring_cqe_t;
+
+// Set up a ring with `entries` submission slots. Returns -1 with errno set
+// when the kernel has no io_uring or it is not permitted (seccomp, sysctl).
+int uring_open(uring_t *ring, unsigned entries);
+void uring_close(uring_t *ring);
+
+// Queue a pwritev(), or an fdatasync() that starts only once every entry
+// queued before it has completed. Both return -1 when the queue is full.
+int uring_prep_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, uint64_t user_data);
+int uring_prep_drain_fdatasync(uring_t *ring, int fd, uint64_t user_data);
+
+// Submit the queued entries and wait for at least `wait` completions
+int uring_submit(uring_t *ring, unsigned wait);
+
+// Take back the entries queued since the last successful submit (after a
+// failed one, which hands the kernel none). Returns how many there were.
+unsigned uring_unqueue(uring_t *ring);
+
+// Take the next completion: returns 1 and fills *cqe, or 0 if there is none
+int uring_next_cqe(uring_t *ring, uring_cqe_t *cqe);
+
+#endif // URING_H
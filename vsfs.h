@@ -7,47 +7,70 @@
 // Block size
 #define BLOCK_SIZE 4096
 
-// Disk layout constants
+// Fixed disk layout: everything else is chosen by mkfs.vsfs and recorded
+// in the superblock (see disk_sb in disk.h)
 #define SUPERBLOCK_BLOCK 0
 #define JOURNAL_START 1
-#define JOURNAL_BLOCKS 16
-#define INODE_BITMAP_BLOCK 17
-#define DATA_BITMAP_BLOCK 18
-#define INODE_TABLE_START 19
-#define INODE_TABLE_BLOCKS 2
-#define DATA_BLOCKS_START 21
-#define DATA_BLOCKS_COUNT 64
+#define VSFS_MAGIC 0x56534653  // "VSFS"
+
+// Default geometry used by mkfs.vsfs
+#define DEFAULT_NUM_BLOCKS 85
+#define DEFAULT_NUM_INODES 64
+#define DEFAULT_JOURNAL_BLOCKS 16
+#define MIN_JOURNAL_BLOCKS 4      // Journal superblock plus a 3-block transaction
 
 // File system limits
-#define MAX_INODES 64
-#define MAX_FILES MAX_INODES
 #define MAX_FILENAME 28
 #define DIRECT_POINTERS 12
 
-// Journal record types
-#define JOURNAL_DATA 1
+// Journal block types
+#define JOURNAL_MAGIC 0x4A524E4C  // "JRNL"
+#define JOURNAL_DESCRIPTOR 1
 #define JOURNAL_COMMIT 2
+#define JOURNAL_SUPERBLOCK 3
 
 // File types
 #define T_DIR 1
 #define T_FILE 2
 
-// Superblock structure
+// Inode flags
+#define INODE_DIR_INDEX 0x1       // Directory: blocks[0] is a hashed index root
+#define INODE_EXTENTS 0x2         // File: blocks[] holds an extent_root_t
+
+// Superblock structure. Regions follow each other in this order:
+// superblock, journal, inode bitmap, data bitmap, inode table, data blocks.
 typedef struct {
     uint32_t magic;           // Magic number to identify VSFS
     uint32_t num_blocks;      // Total number of blocks
     uint32_t num_inodes;      // Total number of inodes
-    uint32_t inode_bitmap_block;
-    uint32_t data_bitmap_block;
+    uint32_t inode_bitmap_block;  // First inode bitmap block
+    uint32_t data_bitmap_block;   // First data bitmap block
     uint32_t inode_table_start;
     uint32_t data_blocks_start;
+    uint32_t journal_blocks;      // Including the journal superblock
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_blocks;
+    uint32_t inode_table_blocks;
+    uint32_t data_blocks_count;
+    uint32_t inode_rotor;     // Inode the next allocation search starts at
+    uint32_t data_rotor;      // Data block the next allocation search starts at
+    uint32_t free_inodes;
+    uint32_t free_blocks;     // Free data blocks
+    uint32_t group_blocks;    // Bitmap blocks per free-count summary group
 } superblock_t;
 
+// Per-group free counts follow the superblock in its block: one uint32_t per
+// group of `group_blocks` bitmap blocks, inode groups first, then data
+// groups. mkfs makes groups large enough for all of them to fit.
+#define SUMMARY_OFFSET 128
+#define SUMMARY_SLOTS ((BLOCK_SIZE - SUMMARY_OFFSET) / sizeof(uint32_t))
+
 // Inode structure
 typedef struct {
     uint32_t size;            // File size in bytes
     uint16_t type;            // T_DIR or T_FILE
     uint16_t nlink;           // Number of links
+    uint32_t flags;           // INODE_* flags
     uint32_t blocks[DIRECT_POINTERS];  // Direct block pointers
 } inode_t;
 
@@ -57,15 +80,96 @@ typedef struct {
     uint32_t inum;            // Inode number (0 = unused entry)
 } dirent_t;
 
-// Journal record header
+// Extent-mapped files (INODE_EXTENTS). An extent maps a run of consecutive
+// file blocks to consecutive disk blocks. The first INODE_INLINE_EXTENTS
+// extents live in the inode, in place of the direct pointers; the rest
+// spill over into a chain of index blocks. Extents are kept in file order.
+#define INODE_INLINE_EXTENTS 3
+#define EXTENT_INDEX_MAGIC 0x45585449  // "EXTI"
+
+typedef struct {
+    uint32_t logical;         // First file block covered
+    uint32_t start;           // First disk block
+    uint32_t length;          // Number of blocks
+} extent_t;
+
+typedef struct {
+    uint32_t count;           // Extents in use, inline and spilled
+    uint32_t index_block;     // First spill-over index block (0 = none)
+    uint32_t last_index;      // Last index block in the chain, where appends go
+    extent_t extents[INODE_INLINE_EXTENTS];
+} extent_root_t;              // Must fit in inode_t.blocks
+
 typedef struct {
-    uint32_t type;            // JOURNAL_DATA or JOURNAL_COMMIT
-    uint32_t block_num;       // For DATA: destination block number
-    uint32_t size;            // Size of data following header
+    uint32_t magic;           // EXTENT_INDEX_MAGIC
+    uint32_t count;           // Extents in this block
+    uint32_t next;            // Next index block (0 = last)
+} extent_index_header_t;
+
+// Hashed directory index (INODE_DIR_INDEX), in the style of ext3's htree.
+// The directory's blocks[0] is the index root; leaves are ordinary dirent
+// blocks. Index entries are sorted by hash, and each covers the name hashes
+// from its own up to the next entry's. With levels == 1 the root's entries
+// point at index blocks whose entries point at leaves. A small directory
+// keeps the plain format: blocks[0] is its only dirent block.
+#define DIR_INDEX_MAGIC 0x48545245  // "HTRE"
+
+typedef struct {
+    uint32_t magic;           // DIR_INDEX_MAGIC
+    uint16_t count;           // Entries in use
+    uint16_t levels;          // Root: index levels below it (0 or 1)
+} dir_index_header_t;
+
+typedef struct {
+    uint32_t hash;            // Lowest name hash mapped to the child
+    uint32_t block;           // Child block: a leaf, or an index block
+    uint16_t used;            // Leaf: entries in use
+    uint16_t free_hint;       // Leaf: no free slot below this one
+} dir_index_entry_t;
+
+// Journal superblock (first journal block). The log after it is circular:
+// live transactions start at tail and are numbered from tail_sequence.
+// Checkpointing advances the tail. head/head_sequence are a hint: the log
+// ends at the first transaction that is out of sequence or fails its
+// checksum, so recovery never depends on the head being durable.
+typedef struct {
+    uint32_t magic;           // JOURNAL_MAGIC
+    uint32_t type;            // JOURNAL_SUPERBLOCK
+    uint32_t log_start;       // First log block
+    uint32_t log_blocks;      // Number of log blocks
+    uint32_t tail;            // Log offset of the oldest live transaction
+    uint32_t head;            // Log offset where the next transaction goes
+    uint32_t tail_sequence;   // Sequence number of the transaction at tail
+    uint32_t head_sequence;   // Sequence number of the next transaction
+    uint32_t forced_checkpoints;  // Checkpoints forced by a full journal
+} journal_superblock_t;
+
+// Journal block header (starts every descriptor and commit block)
+// A transaction is: [DESCRIPTOR: tags][data block]...[data block][COMMIT]
+typedef struct {
+    uint32_t magic;           // JOURNAL_MAGIC
+    uint32_t type;            // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    uint32_t sequence;        // Transaction sequence number
+    uint32_t nr_tags;         // Number of tags in the descriptor
+    uint32_t nr_blocks;       // Number of data blocks in the transaction
+    uint32_t checksum;        // Commit: CRC32C of the descriptor and data blocks
 } journal_header_t;
 
+// Descriptor tag. A full-image tag (length 0) owns the next data block, in
+// tag order; a delta tag's bytes are packed into the data blocks that follow
+// all full images, in tag order, never straddling a block boundary.
+typedef struct {
+    uint32_t block_num;       // Destination block
+    uint16_t offset;          // Delta: byte offset within the block
+    uint16_t length;          // Delta: byte count (0 = full block image)
+} journal_tag_t;
+
 // Helper macros
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
 #define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
+#define EXTENTS_PER_INDEX ((BLOCK_SIZE - sizeof(extent_index_header_t)) / sizeof(extent_t))
+#define DIR_INDEX_ENTRIES ((BLOCK_SIZE - sizeof(dir_index_header_t)) / sizeof(dir_index_entry_t))
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define JOURNAL_TAGS_PER_BLOCK ((BLOCK_SIZE - sizeof(journal_header_t)) / sizeof(journal_tag_t))
 
 #endif // VSFS_H
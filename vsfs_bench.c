@@ -0,0 +1,362 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "libvsfs.h"
+#include "journal.h"
+#include "disk.h"
+
+// vsfs_bench: drive libvsfs operations against freshly formatted images and
+// report throughput, latency percentiles, journal bytes and I/O syscalls per
+// operation. Every workload gets its own image; only the operations
+// themselves are timed and counted, not formatting or populating.
+
+#define DEFAULT_BLOCKS 16384
+#define DEFAULT_INODES 4096
+#define DEFAULT_JOURNAL 1024
+#define DEFAULT_OPS 1000
+#define DEFAULT_FILES 1000
+#define DEFAULT_WORKLOADS "create,install:200,ls,stat,check:50"
+
+#define MAX_WORKLOADS 16
+#define POPULATE_BATCH 64
+
+enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+typedef struct {
+    const char *image;
+    const char *mkfs;
+    uint32_t blocks;
+    uint32_t inodes;
+    uint32_t journal;
+    int ops;                          // Default operations per workload
+    int batch;                        // Files per create
+    int files;                        // Files present for ls, stat and check
+    int threads;                      // check threads (0: one per CPU)
+    int mount_flags;
+} bench_config_t;
+
+typedef struct {
+    const char *name;
+    int ops;
+    double seconds;                   // Timed operations only
+    uint64_t *latency_ns;
+    uint64_t journal_bytes;
+    uint64_t syscalls;
+} bench_result_t;
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "Benchmarks VSFS operations on freshly formatted images\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --image=<path>      - Scratch image (default bench.img, removed afterwards)\n");
+    fprintf(stderr, "  --mkfs=<path>       - Formatter (default ./mkfs.vsfs)\n");
+    fprintf(stderr, "  --blocks=<n>        - Image size in blocks (default %d)\n", DEFAULT_BLOCKS);
+    fprintf(stderr, "  --inodes=<n>        - Number of inodes (default %d)\n", DEFAULT_INODES);
+    fprintf(stderr, "  --journal=<n>       - Journal size in blocks (default %d)\n", DEFAULT_JOURNAL);
+    fprintf(stderr, "  --workloads=<list>  - Comma-separated name[:ops] among create, install,\n");
+    fprintf(stderr, "                        ls, stat, check (default %s)\n", DEFAULT_WORKLOADS);
+    fprintf(stderr, "  --ops=<n>           - Operations for workloads without :ops (default %d)\n",
+            DEFAULT_OPS);
+    fprintf(stderr, "  --batch=<n>         - Files per create; install creates as many before\n");
+    fprintf(stderr, "                        each operation (default 1)\n");
+    fprintf(stderr, "  --files=<n>         - Files present for ls, stat, check (default %d)\n",
+            DEFAULT_FILES);
+    fprintf(stderr, "  --threads=<n>       - Worker threads for check (default: one per CPU)\n");
+    fprintf(stderr, "  --direct, --mmap    - Mount flags, as for vsfs\n");
+    fprintf(stderr, "  --format=<fmt>      - text, csv or json (default text)\n");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Format the scratch image by running the formatter
+static int format_image(const bench_config_t *config) {
+    char blocks[32], inodes[32], journal[32];
+    snprintf(blocks, sizeof(blocks), "--blocks=%u", config->blocks);
+    snprintf(inodes, sizeof(inodes), "--inodes=%u", config->inodes);
+    snprintf(journal, sizeof(journal), "--journal=%u", config->journal);
+    
+    unlink(config->image);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to start mkfs");
+        return -1;
+    }
+    if (pid == 0) {
+        // Only the report goes to stdout
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        execl(config->mkfs, config->mkfs, blocks, inodes, journal, config->image, (char *)NULL);
+        perror("Failed to run mkfs");
+        _exit(127);
+    }
+    
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: Failed to format '%s'\n", config->image);
+        return -1;
+    }
+    return 0;
+}
+
+// Create `count` files named <prefix><n>, starting at n = first
+static int create_files(vsfs_t *fs, const char *prefix, int first, int count) {
+    char names[POPULATE_BATCH][MAX_FILENAME];
+    const char *ptrs[POPULATE_BATCH];
+    
+    while (count > 0) {
+        int n = count < POPULATE_BATCH ? count : POPULATE_BATCH;
+        for (int i = 0; i < n; i++) {
+            snprintf(names[i], MAX_FILENAME, "%s%d", prefix, first + i);
+            ptrs[i] = names[i];
+        }
+        if (vsfs_create(fs, ptrs, n) != 0) return -1;
+        first += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static void count_entry(const vsfs_dirent_t *entry, void *arg) {
+    (void)entry;
+    (*(int *)arg)++;
+}
+
+// One timed operation of a workload
+static int run_op(const char *workload, vsfs_t *fs, const bench_config_t *config, int i) {
+    if (strcmp(workload, "create") == 0) {
+        return create_files(fs, "bench", i * config->batch, config->batch);
+    }
+    if (strcmp(workload, "install") == 0) return vsfs_install(fs);
+    if (strcmp(workload, "ls") == 0) {
+        int count = 0;
+        return vsfs_readdir(fs, count_entry, &count) < 0 ? -1 : 0;
+    }
+    if (strcmp(workload, "stat") == 0) {
+        vsfs_stat_t st;
+        return vsfs_stat(fs, &st);
+    }
+    return vsfs_check(fs, config->threads, NULL) == 0 ? 0 : -1;
+}
+
+// Untimed work before each operation: install needs something to install
+static int prepare_op(const char *workload, vsfs_t *fs, const bench_config_t *config, int i) {
+    if (strcmp(workload, "install") != 0) return 0;
+    return create_files(fs, "pending", i * config->batch, config->batch);
+}
+
+// Untimed set-up once the image is mounted
+static int prepare_workload(const char *workload, vsfs_t *fs, const bench_config_t *config) {
+    if (strcmp(workload, "create") == 0 || strcmp(workload, "install") == 0) return 0;
+    if (create_files(fs, "file", 0, config->files) != 0) return -1;
+    return vsfs_install(fs);
+}
+
+static int run_workload(bench_result_t *result, const bench_config_t *config) {
+    const char *workload = result->name;
+    result->latency_ns = malloc((size_t)result->ops * sizeof(uint64_t));
+    if (!result->latency_ns) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    
+    if (format_image(config) != 0) return -1;
+    vsfs_t *fs = vsfs_mount(config->image, config->mount_flags);
+    if (!fs) return -1;
+    
+    int ret = prepare_workload(workload, fs, config);
+    for (int i = 0; i < result->ops && ret == 0; i++) {
+        ret = prepare_op(workload, fs, config, i);
+        if (ret != 0) break;
+        
+        disk_stats_t before, after;
+        disk_get_stats(&before);
+        journal_stats_t journal_before, journal_after;
+        journal_get_stats(&journal_before);
+        uint64_t start = now_ns();
+        ret = run_op(workload, fs, config, i);
+        uint64_t elapsed = now_ns() - start;
+        disk_get_stats(&after);
+        journal_get_stats(&journal_after);
+        
+        result->latency_ns[i] = elapsed;
+        result->seconds += elapsed / 1e9;
+        result->journal_bytes += journal_after.bytes_written - journal_before.bytes_written;
+        result->syscalls += after.syscalls - before.syscalls;
+    }
+    
+    vsfs_unmount(fs);
+    unlink(config->image);
+    if (ret != 0) fprintf(stderr, "Error: %s workload failed\n", workload);
+    return ret;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies, in microseconds
+static double percentile_us(const bench_result_t *result, double p) {
+    int rank = (int)(p * result->ops + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > result->ops) rank = result->ops;
+    return result->latency_ns[rank - 1] / 1e3;
+}
+
+static void report(FILE *out, int format, bench_result_t *results, int count,
+                   const bench_config_t *config) {
+    if (format == FORMAT_CSV) {
+        fprintf(out, "workload,ops,seconds,ops_per_sec,p50_us,p99_us,p999_us,"
+                     "journal_bytes_per_op,syscalls_per_op\n");
+    } else if (format == FORMAT_JSON) {
+        fprintf(out, "{\n  \"blocks\": %u,\n  \"inodes\": %u,\n  \"journal\": %u,\n"
+                     "  \"batch\": %d,\n  \"files\": %d,\n  \"results\": [\n",
+                config->blocks, config->inodes, config->journal, config->batch, config->files);
+    } else {
+        fprintf(out, "%-8s %7s %12s %10s %10s %10s %14s %12s\n", "Workload", "Ops", "Ops/s",
+                "p50 (us)", "p99 (us)", "p999 (us)", "Journal B/op", "Syscalls/op");
+    }
+    
+    for (int i = 0; i < count; i++) {
+        bench_result_t *r = &results[i];
+        qsort(r->latency_ns, r->ops, sizeof(uint64_t), compare_u64);
+        double ops_per_sec = r->seconds > 0 ? r->ops / r->seconds : 0;
+        double p50 = percentile_us(r, 0.50);
+        double p99 = percentile_us(r, 0.99);
+        double p999 = percentile_us(r, 0.999);
+        double journal = (double)r->journal_bytes / r->ops;
+        double syscalls = (double)r->syscalls / r->ops;
+        
+        if (format == FORMAT_CSV) {
+            fprintf(out, "%s,%d,%.6f,%.1f,%.2f,%.2f,%.2f,%.1f,%.2f\n", r->name, r->ops,
+                    r->seconds, ops_per_sec, p50, p99, p999, journal, syscalls);
+        } else if (format == FORMAT_JSON) {
+            fprintf(out, "    {\"workload\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+                         "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                         "\"p999_us\": %.2f, \"journal_bytes_per_op\": %.1f, "
+                         "\"syscalls_per_op\": %.2f}%s\n",
+                    r->name, r->ops, r->seconds, ops_per_sec, p50, p99, p999, journal, syscalls,
+                    i + 1 < count ? "," : "");
+        } else {
+            fprintf(out, "%-8s %7d %12.1f %10.2f %10.2f %10.2f %14.1f %12.2f\n", r->name,
+                    r->ops, ops_per_sec, p50, p99, p999, journal, syscalls);
+        }
+    }
+    if (format == FORMAT_JSON) fprintf(out, "  ]\n}\n");
+}
+
+static int known_workload(const char *name) {
+    return strcmp(name, "create") == 0 || strcmp(name, "install") == 0 ||
+           strcmp(name, "ls") == 0 || strcmp(name, "stat") == 0 || strcmp(name, "check") == 0;
+}
+
+// Parse name[:ops],... into results; returns the count or -1
+static int parse_workloads(char *list, int default_ops, bench_result_t *results) {
+    int count = 0;
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        char *ops = strchr(name, ':');
+        if (ops) *ops++ = '\0';
+        if (!known_workload(name)) {
+            fprintf(stderr, "Error: Unknown workload '%s'\n", name);
+            return -1;
+        }
+        if (count == MAX_WORKLOADS) {
+            fprintf(stderr, "Error: At most %d workloads\n", MAX_WORKLOADS);
+            return -1;
+        }
+        memset(&results[count], 0, sizeof(results[count]));
+        results[count].name = name;
+        results[count].ops = ops ? atoi(ops) : default_ops;
+        if (results[count].ops < 1) {
+            fprintf(stderr, "Error: Workload '%s' needs at least one operation\n", name);
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    char workloads[256] = DEFAULT_WORKLOADS;
+    int format = FORMAT_TEXT;
+    
+    bench_config_t config;
+    config.image = "bench.img";
+    config.mkfs = "./mkfs.vsfs";
+    config.blocks = DEFAULT_BLOCKS;
+    config.inodes = DEFAULT_INODES;
+    config.journal = DEFAULT_JOURNAL;
+    config.ops = DEFAULT_OPS;
+    config.batch = 1;
+    config.files = DEFAULT_FILES;
+    config.threads = 0;
+    config.mount_flags = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--image=", 8) == 0) {
+            config.image = arg + 8;
+        } else if (strncmp(arg, "--mkfs=", 7) == 0) {
+            config.mkfs = arg + 7;
+        } else if (strncmp(arg, "--blocks=", 9) == 0) {
+            config.blocks = (uint32_t)strtoul(arg + 9, NULL, 10);
+        } else if (strncmp(arg, "--inodes=", 9) == 0) {
+            config.inodes = (uint32_t)strtoul(arg + 9, NULL, 10);
+        } else if (strncmp(arg, "--journal=", 10) == 0) {
+            config.journal = (uint32_t)strtoul(arg + 10, NULL, 10);
+        } else if (strncmp(arg, "--workloads=", 12) == 0) {
+            snprintf(workloads, sizeof(workloads), "%s", arg + 12);
+        } else if (strncmp(arg, "--ops=", 6) == 0) {
+            config.ops = atoi(arg + 6);
+        } else if (strncmp(arg, "--batch=", 8) == 0) {
+            config.batch = atoi(arg + 8);
+        } else if (strncmp(arg, "--files=", 8) == 0) {
+            config.files = atoi(arg + 8);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            config.threads = atoi(arg + 10);
+        } else if (strcmp(arg, "--direct") == 0) {
+            config.mount_flags |= VSFS_DIRECT;
+        } else if (strcmp(arg, "--mmap") == 0) {
+            config.mount_flags |= VSFS_MMAP;
+        } else if (strcmp(arg, "--format=text") == 0) {
+            format = FORMAT_TEXT;
+        } else if (strcmp(arg, "--format=csv") == 0) {
+            format = FORMAT_CSV;
+        } else if (strcmp(arg, "--format=json") == 0) {
+            format = FORMAT_JSON;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", arg);
+            print_usage(prog);
+            return 1;
+        }
+    }
+    if (config.batch < 1 || config.files < 0) {
+        print_usage(prog);
+        return 1;
+    }
+    
+    bench_result_t results[MAX_WORKLOADS];
+    int count = parse_workloads(workloads, config.ops, results);
+    if (count <= 0) return 1;
+    
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i++) {
+        ret = run_workload(&results[i], &config);
+    }
+    if (ret == 0) report(stdout, format, results, count, &config);
+    
+    for (int i = 0; i < count; i++) free(results[i].latency_ns);
+    return ret == 0 ? 0 : 1;
+}